@@ -23,7 +23,7 @@ typedef logic [3:0] StateIdx_t;
 typedef logic [$bits(State_t)-1:0] RawState_t;
 typedef logic [4:0] RoundCounter_t;
 
-localparam RoundCounter_t MAX_ROUND_COUNT = 5'd19;
+localparam int ROUND_COUNT = 20;
 localparam StateIdx_t BCOUNT_IDX = StateIdx_t'(12);
 
 // Rotates a word to the left by n positions
@@ -75,7 +75,27 @@ function automatic State_t OddRound(input State_t s);
     OddRound = s;
 endfunction
 
-module ChaCha20(
+// Does the summation stage: adds the initial state of a block to the result of its rounds
+// bCount - block count the block was computed with
+function automatic State_t Summation(input State_t s, input State_t init, input Word_t bCount);
+    for(int i = 0; i < $size(State_t); i++) begin
+        Summation[i] = s[i] + (i == BCOUNT_IDX ? bCount : init[i]);
+    end
+endfunction
+
+module ChaCha20 #(
+    // Do the summation stage in hardware (1) or leave it to software (0)
+    parameter SUMMATION = 1,
+    
+    // Number of rounds computed in one clock cycle (must divide 20)
+    parameter ROUNDS_PER_CYCLE = 1,
+    
+    // Number of blocks computed in parallel (1 to 255)
+    parameter LANES = 1,
+    
+    // Number of jobs that can be queued (2 to 255)
+    parameter JOB_DEPTH = 16
+)(
     input logic clock,
     input logic reset,
     
@@ -92,34 +112,135 @@ module ChaCha20(
     input logic st_ready
 );
 
-    // Round being computed currently
-    RoundCounter_t roundCounter;
+    typedef logic [7:0] LaneIdx_t;
+    typedef logic [7:0] JobIdx_t;
+    
+    // Number of clock cycles needed to compute one block
+    localparam int STEPS = ROUND_COUNT / ROUNDS_PER_CYCLE;
+    
+    // Feature bits reported through the csr interface
+    // bit 0 - the summation stage is done in hardware
+    // bit 1 - jobs can be queued
+    // bit 2 - performance counters
+    // bits 15:8 - number of lanes
+    // bits 23:16 - number of rounds per cycle
+    // bits 31:24 - number of jobs that can be queued
+    localparam Word_t FEATURES = 
+        Word_t'(SUMMATION != 0) | 
+        Word_t'(2) |
+        Word_t'(4) |
+        Word_t'(LANES) << 8 | 
+        Word_t'(ROUNDS_PER_CYCLE) << 16 |
+        Word_t'(JOB_DEPTH) << 24;
+    
+    // Does ROUNDS_PER_CYCLE rounds starting from round <step> * ROUNDS_PER_CYCLE
+    // The lowest bit of the round number chooses even or odd round function
+    function automatic State_t Rounds(input State_t s, input RoundCounter_t step);
+        for(int i = 0; i < ROUNDS_PER_CYCLE; i++) begin
+            s = (step * ROUNDS_PER_CYCLE + i) % 2 ? OddRound(s) : EvenRound(s);
+        end
+        Rounds = s;
+    endfunction
+
+    // Step being computed currently by each lane
+    RoundCounter_t step[LANES];
     
-    // Number of OTP being computed currently
+    // Lane is computing a block
+    logic busy[LANES];
+    
+    // Lane holds a computed block that is not consumed yet
+    logic done[LANES];
+    
+    // Number of OTP blocks that are not started yet
     Word_t padCounter;
     
+    // Block count of the OTP being computed by each lane
+    Word_t blockCount[LANES];
+    
+    // Lane that starts the next block and lane that outputs the next block
+    // Blocks are started and output in the same round-robin order,
+    // so the output stays ordered by block count
+    LaneIdx_t issueLane, outLane;
+    
     // ChaCha20 states
-    State_t initState, state;
+    State_t initState, state[LANES];
     
-    // not actually a register and is used in a MUX
-    State_t roundResult, stateSrc;
-        
-    //
-    assign stateSrc = roundCounter == 1'b0 ? initState : state;
-         
-    // Get round result
-    // roundCounter[0] is used to choose even or odd round function
-    assign roundResult = roundCounter[0] ? OddRound(stateSrc) : EvenRound(stateSrc);
-    
-    // Connect out data directly to the state
-    assign st_data = ToRawState(state);
+    // Input and output of the round logic of each lane
+    // A lane that starts a block takes the initial state, so every lane has one round instance
+    State_t stateSrc[LANES], roundResult[LANES];
+    RoundCounter_t stepSrc[LANES];
+    
+    // Job queue: block count and number of OTP blocks of queued jobs
+    Word_t jobBCount[JOB_DEPTH];
+    Word_t jobPads[JOB_DEPTH];
+    JobIdx_t jobRead, jobWrite, jobCount;
+    
+    // Block count for the next queued job
+    Word_t nextJobBCount;
+    
+    // Job is pushed to / popped from the queue at this clock edge
+    logic jobPush, jobPop;
+    
+    // Output block is consumed at this clock edge
+    logic consumed;
+    
+    // Issue lane can start a new block at this clock edge
+    logic canIssue;
+    
+    // The core has pads to compute or blocks to output
+    logic active;
+    
+    // Free-running performance counters (wrap around):
+    // all cycles, active cycles, cycles with a block not accepted by the sink
+    // and blocks output
+    Word_t cycleCounter, busyCounter, stallCounter, blockCounter;
+    
+    assign jobPush = csr_write && csr_address == 5'b10101 && jobCount != JOB_DEPTH;
+    assign jobPop = padCounter == 1'b0 && jobCount != 1'b0;
+    
+    assign st_valid = done[outLane];
+    assign consumed = st_valid && st_ready;
+    assign canIssue = padCounter != 1'b0 && !busy[issueLane] && 
+        (!done[issueLane] || (consumed && outLane == issueLane));
+    
+    always_comb begin
+        active = padCounter != 1'b0 || jobCount != 1'b0;
+        for(int i = 0; i < LANES; i++) active = active || busy[i] || done[i];
+    end
+    
+    always_comb begin
+        for(int i = 0; i < LANES; i++) begin
+            stateSrc[i] = canIssue && issueLane == i ? initState : state[i];
+            stepSrc[i] = canIssue && issueLane == i ? 1'b0 : step[i];
+            roundResult[i] = Rounds(stateSrc[i], stepSrc[i]);
+        end
+    end
+    
+    // Connect out data to the state of the output lane 
+    // (after the summation stage if enabled)
+    assign st_data = ToRawState(SUMMATION ? 
+        Summation(state[outLane], initState, blockCount[outLane]) : 
+        state[outLane]);
 
     always_ff @(posedge clock) begin
         // Reset logic
         if (reset) begin
-            st_valid <= 1'b0;
-            roundCounter <= 1'b0;
             padCounter <= 1'b0;
+            issueLane <= 1'b0;
+            outLane <= 1'b0;
+            jobRead <= 1'b0;
+            jobWrite <= 1'b0;
+            jobCount <= 1'b0;
+            cycleCounter <= 1'b0;
+            busyCounter <= 1'b0;
+            stallCounter <= 1'b0;
+            blockCounter <= 1'b0;
+            
+            for(int i = 0; i < LANES; i++) begin
+                busy[i] <= 1'b0;
+                done[i] <= 1'b0;
+                step[i] <= 1'b0;
+            end
         end
         
         // Non-reset logic
@@ -128,66 +249,105 @@ module ChaCha20(
             if (csr_read) casez(csr_address)
                 5'b0????: csr_readdata <= initState[csr_address[3:0]];
                 5'b10000: csr_readdata <= padCounter;
-                5'b10001: csr_readdata <= roundCounter;
+                5'b10001: csr_readdata <= Word_t'(step[0] * ROUNDS_PER_CYCLE);
+                5'b10011: csr_readdata <= FEATURES;
+                5'b10100: csr_readdata <= nextJobBCount;
+                5'b10101: csr_readdata <= JOB_DEPTH - jobCount;
+                5'b10110: csr_readdata <= cycleCounter;
+                5'b10111: csr_readdata <= busyCounter;
+                5'b11000: csr_readdata <= stallCounter;
+                5'b11001: csr_readdata <= blockCounter;
                 // random constant to probe the module 
                 default: csr_readdata <= 32'hfb7e03d9; 
             endcase
+            
+            // Performance counters are not cleared by software
+            cycleCounter <= cycleCounter + 1'b1;
+            if (active) busyCounter <= busyCounter + 1'b1;
+            if (st_valid && !st_ready) stallCounter <= stallCounter + 1'b1;
+            if (consumed) blockCounter <= blockCounter + 1'b1;
+            
+            // Computing lanes do their next step
+            for(int i = 0; i < LANES; i++) begin
+                if (busy[i]) begin
+                    state[i] <= roundResult[i];
+                    step[i] <= step[i] + 1'b1;
+                    
+                    // Last step logic
+                    if (step[i] == STEPS - 1) begin
+                        busy[i] <= 1'b0;
+                        done[i] <= 1'b1;
+                    end
+                end
+                
+                // Output block leaves the lane
+                else if (consumed && outLane == i) done[i] <= 1'b0;
+            end
+            
+            // Next lane will provide the output
+            if (consumed) outLane <= outLane == LANES - 1 ? 1'b0 : outLane + 1'b1;
+            
+            // Start a new block in the issue lane
+            if (canIssue) begin
+                // The first step is done from the initial state
+                state[issueLane] <= roundResult[issueLane];
+                step[issueLane] <= 1'b1;
+                busy[issueLane] <= STEPS != 1;
+                done[issueLane] <= STEPS == 1;
+                
+                // Remember block count of the block for the summation stage
+                blockCount[issueLane] <= initState[BCOUNT_IDX];
+                
+                // Increment block count to compute next pad
+                initState[BCOUNT_IDX] <= initState[BCOUNT_IDX] + 1'b1;
+                
+                // One more pad has been started
+                padCounter <= padCounter - 1'b1;
+                issueLane <= issueLane == LANES - 1 ? 1'b0 : issueLane + 1'b1;
+            end
+            
+            // Start the next queued job when the current one is fully issued
+            // Lanes are not reset, so blocks of consecutive jobs stay in order
+            if (jobPop) begin
+                initState[BCOUNT_IDX] <= jobBCount[jobRead];
+                padCounter <= jobPads[jobRead];
+                jobRead <= jobRead == JOB_DEPTH - 1 ? 1'b0 : jobRead + 1'b1;
+            end
+            
+            // Queue a job
+            if (jobPush) begin
+                jobBCount[jobWrite] <= nextJobBCount;
+                jobPads[jobWrite] <= csr_writedata;
+                jobWrite <= jobWrite == JOB_DEPTH - 1 ? 1'b0 : jobWrite + 1'b1;
+            end
+            
+            jobCount <= jobCount + jobPush - jobPop;
         
-            // Avalon write operation
+            // Avalon write operation (has priority over the computation)
             if (csr_write) casez(csr_address)
                 // Words of initial state
                 5'b0????: begin
                     initState[csr_address[3:0]] <= csr_writedata;
                 end
                 
-                // If padCounter register is written
+                // If padCounter register is written, start over
                 5'b10000: begin
                     padCounter <= csr_writedata;
-                    roundCounter <= 1'b0;
-                end
-            endcase
-
-            // If there is work to do
-            else if (padCounter != 1'b0) begin  
-                // If we can change output data
-                if (st_ready || !st_valid) begin
-                    // Save round result
-                    state <= roundResult;
-                    
-                    // First round logic
-                    if (roundCounter == 1'b0) begin
-                        // One more round has been processed
-                        roundCounter <= roundCounter + 1'b1;
-
-                        // Increment block count to compute next pad
-                        // Has no effect on the current pad
-                        initState[BCOUNT_IDX] <= initState[BCOUNT_IDX] + 1'b1;
-                        
-                        // Output data is invalid now
-                        st_valid <= 1'b0;
-                    end
-                    
-                    // Regular round logic
-                    else if (roundCounter != MAX_ROUND_COUNT) begin
-                        // One more round has been processed
-                        roundCounter <= roundCounter + 1'b1;
-                    end
+                    issueLane <= 1'b0;
+                    outLane <= 1'b0;
+                    jobRead <= 1'b0;
+                    jobWrite <= 1'b0;
+                    jobCount <= 1'b0;
                     
-                    // Last round logic
-                    else begin
-                        // Start new pad computation
-                        roundCounter <= 1'b0;
-                        
-                        // One more pad has been computed
-                        padCounter <= padCounter - 1'b1;
-                        
-                        // Output data is valid now
-                        st_valid <= 1'b1;
+                    for(int i = 0; i < LANES; i++) begin
+                        busy[i] <= 1'b0;
+                        done[i] <= 1'b0;
                     end
                 end
-            end
-            
-            else if (st_ready) st_valid <= 1'b0;
+                
+                // Block count for the next queued job
+                5'b10100: nextJobBCount <= csr_writedata;
+            endcase
         end
     end
 endmodule
\ No newline at end of file
@@ -45,6 +45,34 @@ add_fileset_file ChaCha20.sv SYSTEM_VERILOG PATH ChaCha20.sv TOP_LEVEL_FILE
 # 
 # parameters
 # 
+add_parameter SUMMATION INTEGER 1
+set_parameter_property SUMMATION DEFAULT_VALUE 1
+set_parameter_property SUMMATION DISPLAY_NAME SUMMATION
+set_parameter_property SUMMATION TYPE INTEGER
+set_parameter_property SUMMATION UNITS None
+set_parameter_property SUMMATION ALLOWED_RANGES 0:1
+set_parameter_property SUMMATION HDL_PARAMETER true
+add_parameter ROUNDS_PER_CYCLE INTEGER 1
+set_parameter_property ROUNDS_PER_CYCLE DEFAULT_VALUE 1
+set_parameter_property ROUNDS_PER_CYCLE DISPLAY_NAME ROUNDS_PER_CYCLE
+set_parameter_property ROUNDS_PER_CYCLE TYPE INTEGER
+set_parameter_property ROUNDS_PER_CYCLE UNITS None
+set_parameter_property ROUNDS_PER_CYCLE ALLOWED_RANGES {1 2 4 5 10 20}
+set_parameter_property ROUNDS_PER_CYCLE HDL_PARAMETER true
+add_parameter LANES INTEGER 1
+set_parameter_property LANES DEFAULT_VALUE 1
+set_parameter_property LANES DISPLAY_NAME LANES
+set_parameter_property LANES TYPE INTEGER
+set_parameter_property LANES UNITS None
+set_parameter_property LANES ALLOWED_RANGES 1:255
+set_parameter_property LANES HDL_PARAMETER true
+add_parameter JOB_DEPTH INTEGER 16
+set_parameter_property JOB_DEPTH DEFAULT_VALUE 16
+set_parameter_property JOB_DEPTH DISPLAY_NAME JOB_DEPTH
+set_parameter_property JOB_DEPTH TYPE INTEGER
+set_parameter_property JOB_DEPTH UNITS None
+set_parameter_property JOB_DEPTH ALLOWED_RANGES 2:255
+set_parameter_property JOB_DEPTH HDL_PARAMETER true
 
 
 # 
@@ -0,0 +1,253 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+typedef logic [2:0] CsrAddr_t;
+typedef logic [255:0] MasterData_t;
+typedef logic [511:0] StreamData_t;
+typedef logic [31:0] Word_t;
+typedef logic [7:0] RingIdx_t;
+
+// Reads plaintext from DRAM and XORs it with the OTP stream of ChaCha20,
+// so S2M adapter writes the ciphertext instead of OTP blocks
+// Passes OTP blocks through unchanged if XOR is not enabled
+module M2SAdapter #(
+    // Number of descriptors that can be queued (2 to 255)
+    parameter RING_DEPTH = 16,
+
+    // Number of 256-bit chunks of plaintext that can be requested
+    // ahead of the OTP stream (power of 2, 4 to 256)
+    // Should cover the read latency of the FPGA-to-SDRAM bridge
+    parameter FIFO_DEPTH = 16
+)(
+    input logic clock,
+    input logic reset,
+
+    // Avalon-MM slave interface for configuring the module
+    input logic csr_write,
+    input logic csr_read,
+    input CsrAddr_t csr_address,
+    input Word_t csr_writedata,
+    output Word_t csr_readdata,
+
+    // Avalon-MM master interface for reading the plaintext
+    output logic m_read,
+    output Word_t m_address,
+    output logic [1:0] m_burstcount,
+    input MasterData_t m_readdata,
+    input logic m_readdatavalid,
+    input logic m_waitrequest,
+
+    // Avalon-ST sink interface for consuming OTP blocks
+    input StreamData_t snk_data,
+    input logic snk_valid,
+    output logic snk_ready,
+
+    // Avalon-ST source interface for producing the ciphertext
+    output StreamData_t src_data,
+    output logic src_valid,
+    input logic src_ready
+);
+    // Control register adresses
+    localparam CsrAddr_t LEN_ADDR = 3'h0;
+    localparam CsrAddr_t ADDR_ADDR = 3'h1;
+    localparam CsrAddr_t CONTROL_ADDR = 3'h2;
+    localparam CsrAddr_t DESC_ADDR_ADDR = 3'h3;
+    localparam CsrAddr_t DESC_LEN_ADDR = 3'h4;
+    localparam CsrAddr_t DEPTH_ADDR = 3'h5;
+    localparam CsrAddr_t FIFO_ADDR = 3'h6;
+    localparam CsrAddr_t PROBE_ADDR = 3'h7;
+
+    // Tells software that the module is present
+    localparam Word_t PROBE = 32'h3c5a96e1;
+
+    localparam int FIFO_WIDTH = $clog2(FIFO_DEPTH);
+    typedef logic [FIFO_WIDTH - 1:0] FifoIdx_t;
+    typedef logic [FIFO_WIDTH:0] FifoCount_t;
+
+    // Number of 256-bit chunks left to request
+    Word_t length, nextLength;
+
+    // XOR the OTP stream with the plaintext
+    logic enable;
+
+    // Jobs are aborted: the queued ones are dropped at once, the plaintext
+    // when the requested bursts have arrived (they cannot be cancelled)
+    // Blocks left in the stream are drained, so they do not end up in the next job
+    logic abortWrite, aborting, abortDone;
+
+    // Descriptor ring: starting address and length of queued jobs
+    Word_t ringAddress[RING_DEPTH];
+    Word_t ringLength[RING_DEPTH];
+    RingIdx_t ringRead, ringWrite, ringCount;
+
+    // Address for the next descriptor
+    Word_t descAddress;
+
+    // Plaintext received from DRAM
+    MasterData_t fifo[FIFO_DEPTH];
+    FifoIdx_t fifoRead, fifoWrite, fifoNext;
+
+    // Chunks in the FIFO and chunks in the FIFO or requested from DRAM
+    FifoCount_t fifoCount, reserved, nextReserved;
+
+    // Descriptor is pushed to / popped from the ring at this clock edge
+    logic ringPush, ringPop;
+
+    // Burst is accepted by DRAM at this clock edge
+    logic accept;
+
+    // One OTP block is XORed with two chunks of plaintext at this clock edge
+    logic consume;
+
+    // Plaintext for the next OTP block is available
+    logic plainReady;
+
+    assign ringPush = csr_write && csr_address == DESC_LEN_ADDR && ringCount != RING_DEPTH;
+    assign ringPop = length == 1'b0 && ringCount != 1'b0 && !m_read && !aborting && !abortWrite;
+    assign accept = m_read && !m_waitrequest;
+    assign abortWrite = csr_write && csr_address == CONTROL_ADDR && csr_writedata[1];
+    assign abortDone = aborting && !m_read && reserved == fifoCount && !snk_valid;
+
+    // Always use bursts of 2 (one OTP block)
+    assign m_burstcount = 2'h2;
+
+    // The first chunk of a block goes to the lower address (see S2M adapter)
+    assign fifoNext = fifoRead + 1'b1;
+    assign plainReady = !enable || fifoCount >= 2;
+    assign consume = enable && snk_valid && src_ready && fifoCount >= 2 && !aborting;
+
+    assign src_data = enable ? snk_data ^ {fifo[fifoNext], fifo[fifoRead]} : snk_data;
+    assign src_valid = snk_valid && plainReady && !aborting;
+    assign snk_ready = (src_ready && plainReady) || aborting;
+
+    always_comb begin
+        nextLength = length;
+
+        // Single job mode
+        if (csr_write && csr_address == LEN_ADDR) nextLength = csr_writedata;
+
+        // One burst is requested
+        if (accept) nextLength = length > 2 ? length - 2'h2 : 1'b0;
+
+        // Start the next queued job
+        if (ringPop) nextLength = ringLength[ringRead];
+
+        // Stop requesting the plaintext once the jobs are aborted
+        if (abortWrite || aborting) nextLength = 1'b0;
+
+        nextReserved = abortDone ? 1'b0 : reserved + (accept ? 2'h2 : 2'h0) - (consume ? 2'h2 : 2'h0);
+    end
+
+    // Register read behavior
+    always_ff @(posedge clock) begin
+        if (csr_read) begin
+            case(csr_address)
+                LEN_ADDR: csr_readdata <= length;
+                ADDR_ADDR: csr_readdata <= m_address;
+                CONTROL_ADDR: csr_readdata <= Word_t'(aborting) << 1 | enable;
+                DESC_ADDR_ADDR: csr_readdata <= descAddress;
+                DESC_LEN_ADDR: csr_readdata <= RING_DEPTH - ringCount;
+                DEPTH_ADDR: csr_readdata <= RING_DEPTH;
+                FIFO_ADDR: csr_readdata <= FIFO_DEPTH;
+                PROBE_ADDR: csr_readdata <= PROBE;
+            endcase
+        end
+    end
+
+    // Plaintext FIFO
+    always_ff @(posedge clock) begin
+        if (m_readdatavalid) fifo[fifoWrite] <= m_readdata;
+
+        if (reset) begin
+            fifoRead <= 1'b0;
+            fifoWrite <= 1'b0;
+            fifoCount <= 1'b0;
+        end
+
+        else begin
+            if (m_readdatavalid) fifoWrite <= fifoWrite + 1'b1;
+            if (consume) fifoRead <= fifoRead + 2'h2;
+            fifoCount <= fifoCount + m_readdatavalid - (consume ? 2'h2 : 2'h0);
+
+            // The plaintext of the aborted job is dropped
+            if (abortDone) begin
+                fifoRead <= 1'b0;
+                fifoWrite <= 1'b0;
+                fifoCount <= 1'b0;
+            end
+        end
+    end
+
+    always_ff @(posedge clock) begin
+        // Reset logic
+        if (reset) begin
+            m_read <= 1'b0;
+            length <= 1'b0;
+            reserved <= 1'b0;
+            enable <= 1'b0;
+            ringRead <= 1'b0;
+            ringWrite <= 1'b0;
+            ringCount <= 1'b0;
+            aborting <= 1'b0;
+        end
+
+        else begin
+            // If registers are modified from csr interface
+            if (csr_write) case(csr_address)
+                ADDR_ADDR: m_address <= csr_writedata;
+                CONTROL_ADDR: enable <= csr_writedata[0];
+                DESC_ADDR_ADDR: descAddress <= csr_writedata;
+            endcase
+
+            // Queue a descriptor
+            if (ringPush) begin
+                ringAddress[ringWrite] <= descAddress;
+                ringLength[ringWrite] <= csr_writedata;
+                ringWrite <= ringWrite == RING_DEPTH - 1 ? 1'b0 : ringWrite + 1'b1;
+            end
+
+            // If the burst was accepted, the next one goes 2 * 256 bits = 64 bytes further
+            if (accept) m_address <= m_address + 64;
+
+            // Start the next queued job
+            if (ringPop) begin
+                m_address <= ringAddress[ringRead];
+                ringRead <= ringRead == RING_DEPTH - 1 ? 1'b0 : ringRead + 1'b1;
+            end
+
+            // Request more plaintext only if there is room for it in the FIFO
+            // (a pending request keeps its address and stays asserted)
+            m_read <= (m_read && m_waitrequest) || (nextLength != 1'b0 && nextReserved + 2 <= FIFO_DEPTH);
+
+            length <= nextLength;
+            reserved <= nextReserved;
+            ringCount <= ringCount + ringPush - ringPop;
+
+            // Writing 1 to bit 1 of CONTROL register aborts the jobs, software polls
+            // the bit until the adapter stops reading (bit 0 still enables XOR)
+            if (abortWrite) begin
+                aborting <= 1'b1;
+                ringRead <= 1'b0;
+                ringWrite <= 1'b0;
+                ringCount <= 1'b0;
+            end
+
+            else if (abortDone) aborting <= 1'b0;
+        end
+    end
+
+endmodule
\ No newline at end of file
@@ -0,0 +1,224 @@
+# TCL File Generated by Component Editor 18.1
+# Mon Apr 13 17:08:20 CDT 2020
+# DO NOT MODIFY
+
+
+# 
+# m2s_adapter "M2S Adapter" v1.0
+# Igor Semenov (is0031@uah.edu) 2020.04.13.17:08:20
+# 
+# 
+
+# 
+# request TCL package from ACDS 16.1
+# 
+package require -exact qsys 16.1
+
+
+# 
+# module m2s_adapter
+# 
+set_module_property DESCRIPTION ""
+set_module_property NAME m2s_adapter
+set_module_property VERSION 1.0
+set_module_property INTERNAL false
+set_module_property OPAQUE_ADDRESS_MAP true
+set_module_property AUTHOR "Igor Semenov (is0031@uah.edu)"
+set_module_property DISPLAY_NAME "M2S Adapter"
+set_module_property INSTANTIATE_IN_SYSTEM_MODULE true
+set_module_property EDITABLE true
+set_module_property REPORT_TO_TALKBACK false
+set_module_property ALLOW_GREYBOX_GENERATION false
+set_module_property REPORT_HIERARCHY false
+set_module_property ELABORATION_CALLBACK elaborate
+
+
+# 
+# file sets
+# 
+add_fileset QUARTUS_SYNTH QUARTUS_SYNTH "" ""
+set_fileset_property QUARTUS_SYNTH TOP_LEVEL M2SAdapter
+set_fileset_property QUARTUS_SYNTH ENABLE_RELATIVE_INCLUDE_PATHS false
+set_fileset_property QUARTUS_SYNTH ENABLE_FILE_OVERWRITE_MODE false
+add_fileset_file M2SAdapter.sv SYSTEM_VERILOG PATH M2SAdapter.sv TOP_LEVEL_FILE
+
+
+# 
+# parameters
+# 
+add_parameter RING_DEPTH INTEGER 16
+set_parameter_property RING_DEPTH DEFAULT_VALUE 16
+set_parameter_property RING_DEPTH DISPLAY_NAME RING_DEPTH
+set_parameter_property RING_DEPTH TYPE INTEGER
+set_parameter_property RING_DEPTH UNITS None
+set_parameter_property RING_DEPTH ALLOWED_RANGES 2:255
+set_parameter_property RING_DEPTH HDL_PARAMETER true
+add_parameter FIFO_DEPTH INTEGER 16
+set_parameter_property FIFO_DEPTH DEFAULT_VALUE 16
+set_parameter_property FIFO_DEPTH DISPLAY_NAME FIFO_DEPTH
+set_parameter_property FIFO_DEPTH TYPE INTEGER
+set_parameter_property FIFO_DEPTH UNITS None
+set_parameter_property FIFO_DEPTH ALLOWED_RANGES {4 8 16 32 64 128 256}
+set_parameter_property FIFO_DEPTH HDL_PARAMETER true
+
+
+# 
+# display items
+# 
+
+
+# 
+# connection point reset
+# 
+add_interface reset reset end
+set_interface_property reset associatedClock clock
+set_interface_property reset synchronousEdges DEASSERT
+set_interface_property reset ENABLED true
+set_interface_property reset EXPORT_OF ""
+set_interface_property reset PORT_NAME_MAP ""
+set_interface_property reset CMSIS_SVD_VARIABLES ""
+set_interface_property reset SVD_ADDRESS_GROUP ""
+
+add_interface_port reset reset reset Input 1
+
+
+# 
+# connection point csr
+# 
+add_interface csr avalon end
+set_interface_property csr addressUnits WORDS
+set_interface_property csr associatedClock clock
+set_interface_property csr associatedReset reset
+set_interface_property csr bitsPerSymbol 8
+set_interface_property csr burstOnBurstBoundariesOnly false
+set_interface_property csr burstcountUnits WORDS
+set_interface_property csr explicitAddressSpan 0
+set_interface_property csr holdTime 0
+set_interface_property csr linewrapBursts false
+set_interface_property csr maximumPendingReadTransactions 0
+set_interface_property csr maximumPendingWriteTransactions 0
+set_interface_property csr readLatency 1
+set_interface_property csr readWaitStates 0
+set_interface_property csr readWaitTime 0
+set_interface_property csr setupTime 0
+set_interface_property csr timingUnits Cycles
+set_interface_property csr writeWaitTime 0
+set_interface_property csr ENABLED true
+set_interface_property csr EXPORT_OF ""
+set_interface_property csr PORT_NAME_MAP ""
+set_interface_property csr CMSIS_SVD_VARIABLES ""
+set_interface_property csr SVD_ADDRESS_GROUP ""
+
+add_interface_port csr csr_write write Input 1
+add_interface_port csr csr_address address Input 3
+add_interface_port csr csr_writedata writedata Input 32
+add_interface_port csr csr_read read Input 1
+add_interface_port csr csr_readdata readdata Output 32
+set_interface_assignment csr embeddedsw.configuration.isFlash 0
+set_interface_assignment csr embeddedsw.configuration.isMemoryDevice 0
+set_interface_assignment csr embeddedsw.configuration.isNonVolatileStorage 0
+set_interface_assignment csr embeddedsw.configuration.isPrintableDevice 0
+
+
+# 
+# connection point clock
+# 
+add_interface clock clock end
+set_interface_property clock clockRate 0
+set_interface_property clock ENABLED true
+set_interface_property clock EXPORT_OF ""
+set_interface_property clock PORT_NAME_MAP ""
+set_interface_property clock CMSIS_SVD_VARIABLES ""
+set_interface_property clock SVD_ADDRESS_GROUP ""
+
+add_interface_port clock clock clk Input 1
+
+
+# 
+# connection point snk
+# 
+add_interface snk avalon_streaming end
+set_interface_property snk associatedClock clock
+set_interface_property snk associatedReset reset
+set_interface_property snk dataBitsPerSymbol 512
+set_interface_property snk errorDescriptor ""
+set_interface_property snk firstSymbolInHighOrderBits true
+set_interface_property snk maxChannel 0
+set_interface_property snk readyLatency 0
+set_interface_property snk ENABLED true
+set_interface_property snk EXPORT_OF ""
+set_interface_property snk PORT_NAME_MAP ""
+set_interface_property snk CMSIS_SVD_VARIABLES ""
+set_interface_property snk SVD_ADDRESS_GROUP ""
+
+add_interface_port snk snk_data data Input 512
+add_interface_port snk snk_ready ready Output 1
+add_interface_port snk snk_valid valid Input 1
+
+
+# 
+# connection point src
+# 
+add_interface src avalon_streaming start
+set_interface_property src associatedClock clock
+set_interface_property src associatedReset reset
+set_interface_property src dataBitsPerSymbol 512
+set_interface_property src errorDescriptor ""
+set_interface_property src firstSymbolInHighOrderBits true
+set_interface_property src maxChannel 0
+set_interface_property src readyLatency 0
+set_interface_property src ENABLED true
+set_interface_property src EXPORT_OF ""
+set_interface_property src PORT_NAME_MAP ""
+set_interface_property src CMSIS_SVD_VARIABLES ""
+set_interface_property src SVD_ADDRESS_GROUP ""
+
+add_interface_port src src_data data Output 512
+add_interface_port src src_ready ready Input 1
+add_interface_port src src_valid valid Output 1
+
+
+# 
+# connection point master
+# 
+add_interface master avalon start
+set_interface_property master addressUnits SYMBOLS
+set_interface_property master associatedClock clock
+set_interface_property master associatedReset reset
+set_interface_property master bitsPerSymbol 8
+set_interface_property master burstOnBurstBoundariesOnly false
+set_interface_property master burstcountUnits WORDS
+set_interface_property master doStreamReads false
+set_interface_property master doStreamWrites false
+set_interface_property master holdTime 0
+set_interface_property master linewrapBursts false
+set_interface_property master maximumPendingReadTransactions 8
+set_interface_property master maximumPendingWriteTransactions 0
+set_interface_property master readLatency 0
+set_interface_property master readWaitTime 1
+set_interface_property master setupTime 0
+set_interface_property master timingUnits Cycles
+set_interface_property master writeWaitTime 0
+set_interface_property master ENABLED true
+set_interface_property master EXPORT_OF ""
+set_interface_property master PORT_NAME_MAP ""
+set_interface_property master CMSIS_SVD_VARIABLES ""
+set_interface_property master SVD_ADDRESS_GROUP ""
+
+add_interface_port master m_read read Output 1
+add_interface_port master m_address address Output 32
+add_interface_port master m_readdata readdata Input 256
+add_interface_port master m_readdatavalid readdatavalid Input 1
+add_interface_port master m_burstcount burstcount Output 2
+add_interface_port master m_waitrequest waitrequest Input 1
+
+
+# 
+# elaboration
+# 
+# A burst of 2 beats is requested only if the FIFO has room for its data, so at most
+# FIFO_DEPTH / 2 reads are pending. The interconnect sizes its response buffers and
+# pending-read limiter from this value, so it must not be left at 0
+proc elaborate {} {
+	set_interface_property master maximumPendingReadTransactions [expr {[get_parameter_value FIFO_DEPTH] / 2}]
+}
@@ -15,12 +15,21 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  *******************************************************************************/
 
-typedef logic [1:0] CsrAddr_t;
+typedef logic [3:0] CsrAddr_t;
 typedef logic [255:0] MasterData_t;
 typedef logic [511:0] SinkData_t;
 typedef logic [31:0] Word_t;
+typedef logic [7:0] RingIdx_t;
+typedef logic [4:0] BurstCount_t;
 
-module S2MAdapter(
+module S2MAdapter #(
+    // Number of descriptors that can be queued (2 to 255)
+    parameter RING_DEPTH = 16,
+    
+    // Number of 256-bit chunks written in one burst (2, 4, 8 or 16)
+    // Bursts start only when all their data is buffered
+    parameter BURST_LENGTH = 2
+)(
     input logic clock,
     input logic reset,
     
@@ -35,7 +44,7 @@ module S2MAdapter(
     output logic m_write,
     output Word_t m_address,
     output MasterData_t m_writedata,
-    output logic [1:0] m_burstcount,
+    output BurstCount_t m_burstcount,
     input logic m_waitrequest,
     
     // Avalon-ST sink interface for consuming the data
@@ -47,83 +56,332 @@ module S2MAdapter(
     output logic irq
 );
     // Control register adresses
-    localparam CsrAddr_t LEN_ADDR = 2'h0;
-    localparam CsrAddr_t ADDR_ADDR = 2'h1;
-    localparam CsrAddr_t IRQ_ADDR = 2'h2;
-
-    Word_t length;
+    localparam CsrAddr_t LEN_ADDR = 4'h0;
+    localparam CsrAddr_t ADDR_ADDR = 4'h1;
+    localparam CsrAddr_t IRQ_ADDR = 4'h2;
+    localparam CsrAddr_t DESC_ADDR_ADDR = 4'h3;
+    localparam CsrAddr_t DESC_LEN_ADDR = 4'h4;
+    localparam CsrAddr_t HEAD_ADDR = 4'h5;
+    localparam CsrAddr_t COALESCE_ADDR = 4'h6;
+    localparam CsrAddr_t DEPTH_ADDR = 4'h7;
+    localparam CsrAddr_t BUSY_ADDR = 4'h8;
+    localparam CsrAddr_t WAIT_ADDR = 4'h9;
+    localparam CsrAddr_t BEATS_ADDR = 4'hA;
+    localparam CsrAddr_t ABORT_ADDR = 4'hB;
+    
+    // Bits of DEPTH register telling that the performance counters are present
+    // and that the jobs can be aborted (by this adapter and by M2S adapter)
+    localparam Word_t COUNTERS_FEATURE = 32'h10000;
+    localparam Word_t ABORT_FEATURE = 32'h20000;
+    
+    // The next burst is collected while the current one is written
+    localparam int BUF_DEPTH = 2 * BURST_LENGTH;
+    localparam int BUF_WIDTH = $clog2(BUF_DEPTH);
+    typedef logic [BUF_WIDTH - 1:0] BufIdx_t;
+    typedef logic [BUF_WIDTH:0] BufCount_t;
 
-    // Always use bursts of 2
-    assign m_burstcount = 2'h2;
+    // Number of 256-bit chunks to consume from sink and to write to DRAM
+    Word_t length, nextLength;
+    Word_t writeLength, nextWriteLength;
+    
+    // Address of the next burst and of the next chunk to be written
+    Word_t burstAddress, beatAddress;
+    
+    // Job popped from the ring while the last bursts of the previous one are written
+    // (its blocks are consumed into the buffer behind the rest of the previous job)
+    logic staged;
+    Word_t stagedAddress, stagedLength;
+    
+    // Address the burst that can be started at this clock edge is written to
+    Word_t burstBase;
+    
+    // Chunks left in the current burst
+    BurstCount_t beatsLeft;
+    
+    // Size of the burst that can be started at this clock edge
+    BurstCount_t burstSize;
+    
+    // Chunks consumed from sink and not yet written
+    MasterData_t buffer[BUF_DEPTH];
+    BufIdx_t bufRead, bufWrite;
+    BufCount_t bufCount, nextBufCount;
+    
+    // Descriptor ring: starting address and length of queued jobs
+    Word_t ringAddress[RING_DEPTH];
+    Word_t ringLength[RING_DEPTH];
+    RingIdx_t ringRead, ringWrite, ringCount;
+    
+    // Address for the next descriptor
+    Word_t descAddress;
+    
+    // Number of finished jobs (free running) and the last number seen by software
+    Word_t head, ackHead;
+    
+    // Number of finished jobs that raises the interrupt (0 - one interrupt per job)
+    Word_t coalesce;
+    
+    // Interrupt request of the single job mode
+    logic jobIrq;
+    
+    // Descriptor is pushed to / popped from the ring at this clock edge
+    logic ringPush, ringPop;
+    
+    // Block is consumed from sink / chunk is accepted by DRAM at this clock edge
+    logic push, beat;
+    
+    // Last chunk of a burst / of a job is accepted at this clock edge
+    logic burstEnd, lastBeat;
+    
+    // The staged job starts being written at this clock edge
+    logic switchJob;
+    
+    // The next burst starts at this clock edge
+    logic startBurst;
     
-    // This needs to be turned into a reg
-    // Probably skid buffer for data is needed
-    assign snk_ready = length[0] == 1'b1 && (!m_waitrequest || !m_write);
+    // Nothing to transfer
+    logic idle;
+    
+    // Jobs are aborted: the queued ones are dropped at once, the current one
+    // when its burst is written (an Avalon burst cannot be cut short)
+    // Blocks left in the stream are drained, so they do not end up in the next job
+    logic abortWrite, aborting, abortDone;
+    
+    // Finished jobs not seen by software
+    Word_t pending;
+    
+    // Free-running performance counters (wrap around):
+    // cycles with a job to transfer, cycles a write waits for DRAM and chunks written
+    Word_t busyCounter, waitCounter, beatCounter;
+    
+    assign ringPush = csr_write && csr_address == DESC_LEN_ADDR && ringCount != RING_DEPTH;
+    assign ringPop = length == 1'b0 && !staged && ringCount != 1'b0 && !aborting && !abortWrite;
+    assign push = snk_valid && snk_ready && !aborting;
+    assign beat = m_write && !m_waitrequest;
+    assign burstEnd = beat && beatsLeft == 1'b1;
+    assign lastBeat = beat && writeLength == 1'b1;
+    assign switchJob = staged && (writeLength == 1'b0 || lastBeat) && !abortWrite;
+    assign burstBase = switchJob ? stagedAddress : burstAddress;
+    assign idle = writeLength == 1'b0 && ringCount == 1'b0 && !staged;
+    assign pending = head - ackHead;
+    assign abortWrite = csr_write && csr_address == ABORT_ADDR;
+    assign abortDone = aborting && !m_write && !snk_valid;
+    
+    // Coalesced interrupt: enough jobs are finished or nothing else is going to finish
+    assign irq = coalesce == 1'b0 ? jobIrq : pending >= coalesce || (pending != 1'b0 && idle);
+    
+    // The burst is written straight from the buffer
+    assign m_writedata = buffer[bufRead];
+    
+    always_comb begin
+        nextLength = length;
+        nextWriteLength = writeLength;
+        
+        // Single job mode
+        if (csr_write && csr_address == LEN_ADDR) begin
+            nextLength = csr_writedata;
+            nextWriteLength = csr_writedata;
+        end
+        
+        // The lower chunk of a block is written first
+        if (push) nextLength = length > 2 ? length - 2'h2 : 1'b0;
+        if (beat) nextWriteLength = writeLength - 1'b1;
+        
+        // Start consuming the next queued job, it is written right away
+        // if the previous one is written, otherwise it is staged
+        if (ringPop) begin
+            nextLength = ringLength[ringRead];
+            if (writeLength == 1'b0) nextWriteLength = ringLength[ringRead];
+        end
+        
+        // The previous job is written, the staged one follows without a gap
+        if (switchJob) nextWriteLength = stagedLength;
+        
+        // Stop consuming sink once the jobs are aborted and forget
+        // the rest of the current job when its burst is written
+        if (abortWrite || aborting) nextLength = 1'b0;
+        if (abortDone) nextWriteLength = 1'b0;
+        
+        nextBufCount = abortDone ? 1'b0 : bufCount + (push ? 2'h2 : 2'h0) - beat;
+        
+        // The last burst of a job can be shorter
+        burstSize = nextWriteLength < BURST_LENGTH ? nextWriteLength : BURST_LENGTH;
+        startBurst = (!m_write || burstEnd) && nextWriteLength != 1'b0 && nextBufCount >= burstSize && !aborting;
+    end
 
     // Register read behavior
     always_ff @(posedge clock) begin        
         if (csr_read) begin
             case(csr_address)
-                LEN_ADDR: csr_readdata <= length;
-                ADDR_ADDR: csr_readdata <= m_address;
+                LEN_ADDR: csr_readdata <= writeLength;
+                ADDR_ADDR: csr_readdata <= beatAddress;
                 IRQ_ADDR: csr_readdata <= irq;
+                DESC_ADDR_ADDR: csr_readdata <= descAddress;
+                DESC_LEN_ADDR: csr_readdata <= RING_DEPTH - ringCount;
+                HEAD_ADDR: csr_readdata <= head;
+                COALESCE_ADDR: csr_readdata <= coalesce;
+                DEPTH_ADDR: csr_readdata <= RING_DEPTH | BURST_LENGTH << 8 | COUNTERS_FEATURE | ABORT_FEATURE;
+                BUSY_ADDR: csr_readdata <= busyCounter;
+                WAIT_ADDR: csr_readdata <= waitCounter;
+                BEATS_ADDR: csr_readdata <= beatCounter;
+                ABORT_ADDR: csr_readdata <= aborting;
             endcase
         end
     end
     
+    // Buffer
+    always_ff @(posedge clock) begin
+        if (push) begin
+            buffer[bufWrite] <= snk_data[255:0];
+            buffer[bufWrite + 1'b1] <= snk_data[511:256];
+        end
+        
+        if (reset) begin
+            bufRead <= 1'b0;
+            bufWrite <= 1'b0;
+            bufCount <= 1'b0;
+            snk_ready <= 1'b0;
+        end
+        
+        else begin
+            if (push) bufWrite <= bufWrite + 2'h2;
+            if (beat) bufRead <= bufRead + 1'b1;
+            bufCount <= nextBufCount;
+            
+            // Blocks consumed for the aborted job are dropped
+            if (abortDone) begin
+                bufRead <= 1'b0;
+                bufWrite <= 1'b0;
+            end
+            
+            // Registered ready: a block is accepted only if it fits in the buffer
+            // (any block is accepted and dropped while the jobs are aborted)
+            snk_ready <= (nextLength != 1'b0 && nextBufCount + 2 <= BUF_DEPTH) || abortWrite || (aborting && !abortDone);
+        end
+    end
+    
+    // Bursts
     always_ff @(posedge clock) begin
         // Reset logic
         if (reset) begin
             m_write <= 1'b0;
             length <= 1'b0;
+            writeLength <= 1'b0;
+            staged <= 1'b0;
+            aborting <= 1'b0;
         end
         
-        // If registers are modified from csr interface
-        else if (csr_write) begin
-            if (csr_address == LEN_ADDR) begin
-                length <= csr_writedata;
+        else begin
+            if (startBurst) begin
+                m_write <= 1'b1;
+                m_address <= burstBase;
+                m_burstcount <= burstSize;
+                beatsLeft <= burstSize;
+                burstAddress <= burstBase + (burstSize << 5);
             end
-        end
-        
-        // If we need to and can read more data from sink AND
-        // If we can reed from sink AND
-        // If the register where we place it is available
-        if (length != 1'b0 && snk_valid && (!m_waitrequest || !m_write)) begin
-            // One more 256-bit block will be processed
-            length <= length - 1'b1;
             
-            // Signalize that data is ready
-            m_write <= 1'b1;
+            else begin
+                if (burstEnd) m_write <= 1'b0;
+                if (beat) beatsLeft <= beatsLeft - 1'b1;
+                if (switchJob) burstAddress <= stagedAddress;
+            end
+            
+            // 256 bits = 32 bytes
+            if (beat) beatAddress <= beatAddress + 32;
+            if (switchJob) beatAddress <= stagedAddress;
+            
+            if (csr_write && csr_address == ADDR_ADDR) begin
+                burstAddress <= csr_writedata;
+                beatAddress <= csr_writedata;
+            end
+            
+            // Start the next queued job or stage it
+            if (ringPop && writeLength == 1'b0) begin
+                burstAddress <= ringAddress[ringRead];
+                beatAddress <= ringAddress[ringRead];
+            end
+            
+            if (ringPop && writeLength != 1'b0) begin
+                staged <= 1'b1;
+                stagedAddress <= ringAddress[ringRead];
+                stagedLength <= ringLength[ringRead];
+            end
+            
+            else if (switchJob || abortWrite) staged <= 1'b0;
+            
+            length <= nextLength;
+            writeLength <= nextWriteLength;
             
-            // Choose which chunk to transfer
-            if (length[0] == 1'b0) m_writedata <= snk_data[255:0];
-            else m_writedata <= snk_data[511:256];
+            // Software polls ABORT register until the adapter stops writing
+            if (abortWrite) aborting <= 1'b1;
+            else if (abortDone) aborting <= 1'b0;
+        end
+    end
+    
+    // Performance counters (not cleared by software)
+    always_ff @(posedge clock) begin
+        if (reset) begin
+            busyCounter <= 1'b0;
+            waitCounter <= 1'b0;
+            beatCounter <= 1'b0;
         end
         
-        // If we cannot read data and
-        // no write is pending, stop writing
-        else if (!m_waitrequest) m_write <= 1'b0;
+        else begin
+            if (writeLength != 1'b0) busyCounter <= busyCounter + 1'b1;
+            if (m_write && m_waitrequest) waitCounter <= waitCounter + 1'b1;
+            if (beat) beatCounter <= beatCounter + 1'b1;
+        end
     end
     
     always_ff @(posedge clock) begin
         // Reset logic
         if (reset) begin
-            irq <= 1'b0;
+            jobIrq <= 1'b0;
+            head <= 1'b0;
+            ackHead <= 1'b0;
+            coalesce <= 1'b0;
+            ringRead <= 1'b0;
+            ringWrite <= 1'b0;
+            ringCount <= 1'b0;
         end
         
-        // If registers are modified from csr interface
-        else if (csr_write) case(csr_address)
-            ADDR_ADDR: m_address <= csr_writedata;
-            IRQ_ADDR: irq <= 1'b0;
-        endcase
-        
-        // If last transaction was successful
-        if (!m_waitrequest && m_write) begin
-            // 256 bits = 32 bytes
-            m_address <= m_address + 32;
-
-            // Send IRQ if this is the last transfer
-            if (length == 1'b0) irq <= 1'b1;
+        else begin
+            // If registers are modified from csr interface
+            if (csr_write) case(csr_address)
+                // Clears the single job interrupt and
+                // tells how many jobs software has seen
+                IRQ_ADDR: begin
+                    jobIrq <= 1'b0;
+                    ackHead <= csr_writedata;
+                end
+                
+                DESC_ADDR_ADDR: descAddress <= csr_writedata;
+                COALESCE_ADDR: coalesce <= csr_writedata;
+            endcase
+            
+            // Queue a descriptor
+            if (ringPush) begin
+                ringAddress[ringWrite] <= descAddress;
+                ringLength[ringWrite] <= csr_writedata;
+                ringWrite <= ringWrite == RING_DEPTH - 1 ? 1'b0 : ringWrite + 1'b1;
+            end
+            
+            // Send IRQ and report the job if this is the last transfer
+            if (lastBeat) begin
+                jobIrq <= 1'b1;
+                head <= head + 1'b1;
+            end
+            
+            // Start the next queued job
+            if (ringPop) ringRead <= ringRead == RING_DEPTH - 1 ? 1'b0 : ringRead + 1'b1;
+            
+            ringCount <= ringCount + ringPush - ringPop;
+            
+            // Drop the queued jobs (they are not reported as finished)
+            if (abortWrite) begin
+                ringRead <= 1'b0;
+                ringWrite <= 1'b0;
+                ringCount <= 1'b0;
+            end
         end
     end
 
@@ -45,6 +45,20 @@ add_fileset_file S2MAdapter.sv SYSTEM_VERILOG PATH S2MAdapter.sv TOP_LEVEL_FILE
 # 
 # parameters
 # 
+add_parameter RING_DEPTH INTEGER 16
+set_parameter_property RING_DEPTH DEFAULT_VALUE 16
+set_parameter_property RING_DEPTH DISPLAY_NAME RING_DEPTH
+set_parameter_property RING_DEPTH TYPE INTEGER
+set_parameter_property RING_DEPTH UNITS None
+set_parameter_property RING_DEPTH ALLOWED_RANGES 2:255
+set_parameter_property RING_DEPTH HDL_PARAMETER true
+add_parameter BURST_LENGTH INTEGER 2
+set_parameter_property BURST_LENGTH DEFAULT_VALUE 2
+set_parameter_property BURST_LENGTH DISPLAY_NAME BURST_LENGTH
+set_parameter_property BURST_LENGTH TYPE INTEGER
+set_parameter_property BURST_LENGTH UNITS None
+set_parameter_property BURST_LENGTH ALLOWED_RANGES {2 4 8 16}
+set_parameter_property BURST_LENGTH HDL_PARAMETER true
 
 
 # 
@@ -104,7 +118,7 @@ set_interface_property csr CMSIS_SVD_VARIABLES ""
 set_interface_property csr SVD_ADDRESS_GROUP ""
 
 add_interface_port csr csr_write write Input 1
-add_interface_port csr csr_address address Input 2
+add_interface_port csr csr_address address Input 4
 add_interface_port csr csr_writedata writedata Input 32
 add_interface_port csr csr_read read Input 1
 add_interface_port csr csr_readdata readdata Output 32
@@ -0,0 +1,633 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#include <stdint.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <array>
+#include <functional>
+#include <stdexcept>
+#include "verilated.h"
+#include "VChaCha20.h"
+#include "VM2SAdapter.h"
+#include "VS2MAdapter.h"
+#include "ChaCha20/ChaCha20.h"
+
+// Encryption parameters (the same as in chacha20 utility)
+const ChaCha20::State state
+{
+    ChaCha20::DEFAULT_CONSTS,
+    ChaCha20::Key
+    {
+        0x03020100, 0x07060504, 0x0b0a0908, 0x0f0e0d0c,
+        0x13121110, 0x17161514, 0x1b1a1918, 0x1f1e1d1c
+    },
+    ChaCha20::BCount{ 0x00000001 },
+    ChaCha20::Nonce{ 0x09000000, 0x4a000000, 0x00000000 }
+};
+
+// Register word addresses of ChaCha20 accelerator (see README)
+const uint32_t PAD_COUNTER_ADDR = 0x10;
+const uint32_t FEATURES_ADDR = 0x13;
+const uint32_t JOB_BCOUNT_ADDR = 0x14;
+const uint32_t JOB_PADS_ADDR = 0x15;
+const uint32_t BLOCKS_ADDR = 0x19;
+
+// Feature bits of ChaCha20 accelerator
+const uint32_t SUMMATION_FEATURE = 1 << 0;
+const uint32_t LANES_SHIFT = 8;
+const uint32_t ROUNDS_SHIFT = 16;
+
+// Register word addresses of S2M adapter (see README)
+const uint32_t LEN_ADDR = 0x0;
+const uint32_t ADDR_ADDR = 0x1;
+const uint32_t IRQ_ADDR = 0x2;
+const uint32_t DESC_ADDR_ADDR = 0x3;
+const uint32_t DESC_LEN_ADDR = 0x4;
+const uint32_t HEAD_ADDR = 0x5;
+const uint32_t COALESCE_ADDR = 0x6;
+const uint32_t DEPTH_ADDR = 0x7;
+const uint32_t WAIT_ADDR = 0x9;
+const uint32_t BEATS_ADDR = 0xA;
+const uint32_t ABORT_ADDR = 0xB;
+
+// Fields of DEPTH register of S2M adapter
+const uint32_t BURST_SHIFT = 8;
+
+// Register word addresses of M2S adapter (see README)
+const uint32_t CONTROL_ADDR = 0x2;
+const uint32_t READ_DESC_ADDR_ADDR = 0x3;
+const uint32_t READ_DESC_LEN_ADDR = 0x4;
+
+// Depth of altera_avalon_sc_fifo between the cores (see fpgacha.qsys)
+const size_t FIFO_DEPTH = 16;
+
+// Physical address of the emulated DRAM region
+const uint32_t DRAM_BASE = 0x20000000;
+
+// Clock frequency of FpgaCha cores (see fpgacha.qsys)
+const double CLOCK = 50e6;
+
+// Cycles between a read burst being accepted and its first beat
+const uint64_t READ_LATENCY = 12;
+
+// Gives up if a job takes more cycles than this per block
+const uint64_t MAX_CYCLES_PER_BLOCK = 1000;
+
+// Tells whether m_waitrequest is asserted at a given cycle
+typedef std::function<bool(uint64_t)> Backpressure;
+
+// Statistics of one job
+struct JobStats
+{
+    uint64_t cycles = 0;
+    uint64_t beats = 0;
+    uint64_t stalls = 0;
+    // OTP blocks handed to the FIFO
+    uint64_t blocks = 0;
+    uint64_t mismatches = 0;
+};
+
+// Read burst accepted by DRAM
+struct ReadBurst
+{
+    uint32_t address;
+    uint32_t beats;
+    uint64_t ready;
+};
+
+// ChaCha20, M2SAdapter and S2MAdapter connected through a FIFO (as in fpgacha.qsys)
+// with a DRAM model attached to the Avalon-MM masters of the adapters
+class System
+{
+private:
+    typedef std::array<uint32_t, ChaCha20::State::WORD_SIZE> Block;
+
+    VChaCha20 chacha20;
+    VM2SAdapter m2s;
+    VS2MAdapter s2m;
+
+    // Model of altera_avalon_sc_fifo
+    std::deque<Block> fifo;
+
+    // Model of DRAM
+    std::vector<uint32_t> dram;
+
+    // Read bursts waiting for their data
+    std::deque<ReadBurst> reads;
+
+    // State of the current Avalon burst
+    uint32_t burstAddress = 0;
+    uint32_t burstRemaining = 0;
+    uint32_t burstBeat = 0;
+
+    Backpressure backpressure;
+    uint64_t cycle = 0;
+
+    // Cycles the bridge needs to accept the first beat of a write burst
+    // and cycles the current first beat has waited so far
+    const uint32_t overhead;
+    uint32_t setupWaited = 0;
+    JobStats stats;
+
+    // Stores one 256-bit beat in DRAM
+    void writeBeat()
+    {
+        // The address is only sampled on the first beat of a burst
+        if (burstRemaining == 0)
+        {
+            burstAddress = s2m.m_address;
+            burstRemaining = s2m.m_burstcount;
+            burstBeat = 0;
+        }
+
+        const uint32_t offset = burstAddress + burstBeat * 32 - DRAM_BASE;
+        if (offset + 32 > dram.size() * sizeof(uint32_t))
+            throw std::runtime_error("write outside of DRAM at " + std::to_string(burstAddress));
+
+        for(int i = 0; i < 8; i++) dram[offset / sizeof(uint32_t) + i] = s2m.m_writedata[i];
+
+        burstBeat++;
+        burstRemaining--;
+    }
+
+    // Drives one 256-bit beat of the oldest read burst if its data is ready
+    void readBeat()
+    {
+        m2s.m_readdatavalid = !reads.empty() && reads.front().ready <= cycle;
+        if (!m2s.m_readdatavalid) return;
+
+        ReadBurst& burst = reads.front();
+        const uint32_t offset = burst.address - DRAM_BASE;
+        if (offset + 32 > dram.size() * sizeof(uint32_t))
+            throw std::runtime_error("read outside of DRAM at " + std::to_string(burst.address));
+
+        for(int i = 0; i < 8; i++) m2s.m_readdata[i] = dram[offset / sizeof(uint32_t) + i];
+
+        burst.address += 32;
+        if (--burst.beats == 0) reads.pop_front();
+    }
+
+    // Plaintext placed in DRAM word <index> for the inline mode
+    static uint32_t plaintext(size_t index)
+    {
+        return index * 2654435761u ^ 0x5a5a5a5a;
+    }
+
+public:
+    // dramWords - size of the DRAM model in words
+    // overhead - cycles the bridge needs to accept a write burst
+    System(size_t dramWords, uint32_t overhead) : dram(dramWords), overhead(overhead)
+    {
+        backpressure = [](uint64_t) { return false; };
+        chacha20.csr_write = chacha20.csr_read = 0;
+        m2s.csr_write = m2s.csr_read = 0;
+        s2m.csr_write = s2m.csr_read = 0;
+
+        chacha20.reset = m2s.reset = s2m.reset = 1;
+        for(int i = 0; i < 4; i++) tick();
+        chacha20.reset = m2s.reset = s2m.reset = 0;
+    }
+
+    // Advances simulation by one clock cycle
+    void tick()
+    {
+        // Drive stream and bus inputs
+        // Bursts pay the setup overhead on their first beat
+        const bool readWait = backpressure(cycle);
+        const bool setup = s2m.m_write && burstRemaining == 0 && setupWaited < overhead;
+        const bool waitrequest = readWait || setup;
+        chacha20.st_ready = fifo.size() < FIFO_DEPTH;
+        m2s.snk_valid = !fifo.empty();
+        if (!fifo.empty()) for(int i = 0; i < 16; i++) m2s.snk_data[i] = fifo.front()[i];
+        m2s.m_waitrequest = readWait;
+        s2m.m_waitrequest = waitrequest;
+        readBeat();
+
+        // Let combinational logic settle
+        // (the source of M2S adapter depends on the sink of S2M adapter)
+        chacha20.clock = m2s.clock = s2m.clock = 0;
+        chacha20.eval();
+        s2m.eval();
+        m2s.src_ready = s2m.snk_ready;
+        m2s.eval();
+        s2m.snk_valid = m2s.src_valid;
+        for(int i = 0; i < 16; i++) s2m.snk_data[i] = m2s.src_data[i];
+        s2m.eval();
+
+        // Sample handshakes happening at this edge
+        const bool push = chacha20.st_valid && chacha20.st_ready;
+        const bool pop = m2s.snk_valid && m2s.snk_ready;
+        Block data;
+        if (push) for(int i = 0; i < 16; i++) data[i] = chacha20.st_data[i];
+
+        if (s2m.m_write && !waitrequest)
+        {
+            writeBeat();
+            stats.beats++;
+            setupWaited = 0;
+        }
+
+        else if (s2m.m_write)
+        {
+            stats.stalls++;
+            if (setup) setupWaited++;
+        }
+
+        if (m2s.m_read && !readWait)
+            reads.push_back(ReadBurst{ m2s.m_address, m2s.m_burstcount, cycle + READ_LATENCY });
+
+        // Rising edge
+        chacha20.clock = m2s.clock = s2m.clock = 1;
+        chacha20.eval();
+        m2s.eval();
+        s2m.eval();
+
+        if (pop) fifo.pop_front();
+        if (push)
+        {
+            fifo.push_back(data);
+            stats.blocks++;
+        }
+
+        cycle++;
+        stats.cycles++;
+    }
+
+    // Avalon-MM write to ChaCha20 CSR
+    void writeChaCha20(uint32_t address, uint32_t data)
+    {
+        chacha20.csr_write = 1;
+        chacha20.csr_address = address;
+        chacha20.csr_writedata = data;
+        tick();
+        chacha20.csr_write = 0;
+    }
+
+    // Avalon-MM read from ChaCha20 CSR (read latency is 1)
+    uint32_t readChaCha20(uint32_t address)
+    {
+        chacha20.csr_read = 1;
+        chacha20.csr_address = address;
+        tick();
+        chacha20.csr_read = 0;
+        return chacha20.csr_readdata;
+    }
+
+    // Avalon-MM read from S2M adapter CSR (read latency is 1)
+    uint32_t readS2M(uint32_t address)
+    {
+        s2m.csr_read = 1;
+        s2m.csr_address = address;
+        tick();
+        s2m.csr_read = 0;
+        return s2m.csr_readdata;
+    }
+
+    // Avalon-MM read from M2S adapter CSR (read latency is 1)
+    uint32_t readM2S(uint32_t address)
+    {
+        m2s.csr_read = 1;
+        m2s.csr_address = address;
+        tick();
+        m2s.csr_read = 0;
+        return m2s.csr_readdata;
+    }
+
+    // Avalon-MM write to S2M adapter CSR
+    void writeS2M(uint32_t address, uint32_t data)
+    {
+        s2m.csr_write = 1;
+        s2m.csr_address = address;
+        s2m.csr_writedata = data;
+        tick();
+        s2m.csr_write = 0;
+    }
+
+    // Avalon-MM write to M2S adapter CSR
+    void writeM2S(uint32_t address, uint32_t data)
+    {
+        m2s.csr_write = 1;
+        m2s.csr_address = address;
+        m2s.csr_writedata = data;
+        tick();
+        m2s.csr_write = 0;
+    }
+
+    // Reads the performance counters that are checked against the statistics of a job
+    std::array<uint32_t, 3> readCounters()
+    {
+        return {{ readChaCha20(BLOCKS_ADDR), readS2M(WAIT_ADDR), readS2M(BEATS_ADDR) }};
+    }
+
+    // Compares the counts since <before> with <blocks> and the statistics of the job
+    void checkCounters(const std::array<uint32_t, 3>& before, uint32_t blocks)
+    {
+        const std::array<uint32_t, 3> after = readCounters();
+        if (after[0] - before[0] != blocks) stats.mismatches++;
+        if (after[1] - before[1] != stats.stalls) stats.mismatches++;
+        if (after[2] - before[2] != stats.beats) stats.mismatches++;
+    }
+
+    // Produces <blocks> OTP blocks the same way FpgaCha::start does
+    JobStats run(const ChaCha20::State& s, uint32_t blocks, const Backpressure& b)
+    {
+        backpressure = b;
+        std::fill(dram.begin(), dram.end(), 0);
+
+        // FpgaCha::setState
+        for(int i = 0; i < ChaCha20::State::WORD_SIZE; i++) writeChaCha20(i, s[i]);
+
+        // FpgaCha::start
+        const std::array<uint32_t, 3> counters = readCounters();
+        stats = JobStats();
+        writeS2M(IRQ_ADDR, 0);
+        writeChaCha20(PAD_COUNTER_ADDR, blocks);
+        writeS2M(ADDR_ADDR, DRAM_BASE);
+        writeS2M(LEN_ADDR, blocks * 2);
+
+        // FpgaCha::wait
+        waitForIrq(blocks);
+        checkCounters(counters, blocks);
+        check(s, s.bCount[0], 0, blocks);
+
+        return stats;
+    }
+
+    // Produces <blocks> OTP blocks as <jobs> queued jobs the same way FpgaCha::submit does
+    // Jobs are placed in DRAM in reverse order to check descriptor addresses
+    JobStats runQueued(const ChaCha20::State& s, uint32_t blocks, uint32_t jobs, const Backpressure& b)
+    {
+        backpressure = b;
+        std::fill(dram.begin(), dram.end(), 0);
+        const uint32_t jobBlocks = blocks / jobs;
+
+        // FpgaCha::setState
+        for(int i = 0; i < ChaCha20::State::WORD_SIZE; i++) writeChaCha20(i, s[i]);
+
+        // Forget the jobs of earlier runs the same way the FpgaCha constructor does
+        const uint32_t head = readS2M(HEAD_ADDR);
+        writeS2M(IRQ_ADDR, head);
+
+        // One interrupt for all jobs
+        const std::array<uint32_t, 3> counters = readCounters();
+        stats = JobStats();
+        writeS2M(COALESCE_ADDR, jobs);
+
+        // FpgaCha::submit
+        for(uint32_t j = 0; j < jobs; j++)
+        {
+            const uint32_t slot = (jobs - 1 - j) * jobBlocks;
+            writeChaCha20(JOB_BCOUNT_ADDR, s.bCount[0] + j * jobBlocks);
+            writeChaCha20(JOB_PADS_ADDR, jobBlocks);
+            writeS2M(DESC_ADDR_ADDR, DRAM_BASE + slot * ChaCha20::State::BYTE_SIZE);
+            writeS2M(DESC_LEN_ADDR, jobBlocks * 2);
+        }
+
+        // FpgaCha::wait
+        waitForIrq(blocks);
+        checkCounters(counters, jobs * jobBlocks);
+        const uint32_t finished = readS2M(HEAD_ADDR) - head;
+        if (finished != jobs) stats.mismatches++;
+        writeS2M(IRQ_ADDR, head + finished);
+        writeS2M(COALESCE_ADDR, 0);
+
+        for(uint32_t j = 0; j < jobs; j++)
+        {
+            const uint32_t slot = (jobs - 1 - j) * jobBlocks;
+            check(s, s.bCount[0] + j * jobBlocks, slot, jobBlocks);
+        }
+
+        return stats;
+    }
+
+    // Encrypts <blocks> OTP blocks worth of plaintext in place as <jobs> queued jobs
+    // the same way FpgaCha::encrypt does
+    JobStats runInline(const ChaCha20::State& s, uint32_t blocks, uint32_t jobs, const Backpressure& b)
+    {
+        backpressure = b;
+        for(size_t i = 0; i < dram.size(); i++) dram[i] = plaintext(i);
+        const uint32_t jobBlocks = blocks / jobs;
+
+        // FpgaCha::setState and FpgaCha::setInline
+        for(int i = 0; i < ChaCha20::State::WORD_SIZE; i++) writeChaCha20(i, s[i]);
+        writeM2S(CONTROL_ADDR, 1);
+
+        // Forget the jobs of earlier runs the same way the FpgaCha constructor does
+        const uint32_t head = readS2M(HEAD_ADDR);
+        writeS2M(IRQ_ADDR, head);
+
+        // One interrupt for all jobs
+        const std::array<uint32_t, 3> counters = readCounters();
+        stats = JobStats();
+        writeS2M(COALESCE_ADDR, jobs);
+
+        // FpgaCha::encrypt
+        for(uint32_t j = 0; j < jobs; j++)
+        {
+            const uint32_t address = DRAM_BASE + j * jobBlocks * ChaCha20::State::BYTE_SIZE;
+            writeM2S(READ_DESC_ADDR_ADDR, address);
+            writeM2S(READ_DESC_LEN_ADDR, jobBlocks * 2);
+            writeChaCha20(JOB_BCOUNT_ADDR, s.bCount[0] + j * jobBlocks);
+            writeChaCha20(JOB_PADS_ADDR, jobBlocks);
+            writeS2M(DESC_ADDR_ADDR, address);
+            writeS2M(DESC_LEN_ADDR, jobBlocks * 2);
+        }
+
+        // FpgaCha::wait
+        waitForIrq(blocks);
+        checkCounters(counters, jobs * jobBlocks);
+        const uint32_t finished = readS2M(HEAD_ADDR) - head;
+        if (finished != jobs) stats.mismatches++;
+        writeS2M(IRQ_ADDR, head + finished);
+        writeS2M(COALESCE_ADDR, 0);
+        writeM2S(CONTROL_ADDR, 0);
+
+        check(s, s.bCount[0], 0, jobs * jobBlocks, true);
+        return stats;
+    }
+
+    // Aborts inline jobs halfway the same way FpgaCha::reset does, checks that nothing
+    // is written after the adapters stopped and that the aborted jobs are not reported,
+    // then produces <blocks> OTP blocks as <jobs> queued jobs with the same cores
+    JobStats runAbort(const ChaCha20::State& s, uint32_t blocks, uint32_t jobs, const Backpressure& b)
+    {
+        backpressure = b;
+        for(size_t i = 0; i < dram.size(); i++) dram[i] = plaintext(i);
+        const uint32_t jobBlocks = blocks / jobs;
+
+        for(int i = 0; i < ChaCha20::State::WORD_SIZE; i++) writeChaCha20(i, s[i]);
+        writeM2S(CONTROL_ADDR, 1);
+        const uint32_t head = readS2M(HEAD_ADDR);
+        const std::array<uint32_t, 3> counters = readCounters();
+        stats = JobStats();
+
+        for(uint32_t j = 0; j < jobs; j++)
+        {
+            const uint32_t address = DRAM_BASE + j * jobBlocks * ChaCha20::State::BYTE_SIZE;
+            writeM2S(READ_DESC_ADDR_ADDR, address);
+            writeM2S(READ_DESC_LEN_ADDR, jobBlocks * 2);
+            writeChaCha20(JOB_BCOUNT_ADDR, s.bCount[0] + j * jobBlocks);
+            writeChaCha20(JOB_PADS_ADDR, jobBlocks);
+            writeS2M(DESC_ADDR_ADDR, address);
+            writeS2M(DESC_LEN_ADDR, jobBlocks * 2);
+        }
+
+        // Half of the beats are written
+        while(stats.beats < blocks)
+        {
+            if (stats.cycles > (blocks + 1) * MAX_CYCLES_PER_BLOCK)
+                throw std::runtime_error("timeout waiting for blocks");
+
+            tick();
+        }
+
+        // FpgaCha::reset
+        writeChaCha20(PAD_COUNTER_ADDR, 0);
+        writeM2S(CONTROL_ADDR, 2);
+        writeS2M(ABORT_ADDR, 1);
+
+        while(readS2M(ABORT_ADDR) != 0 || (readM2S(CONTROL_ADDR) & 2) != 0)
+        {
+            if (stats.cycles > (blocks + 1) * MAX_CYCLES_PER_BLOCK)
+                throw std::runtime_error("timeout waiting for abort");
+        }
+
+        const uint64_t beats = stats.beats;
+        for(int i = 0; i < 1000; i++) tick();
+        if (stats.beats != beats || !fifo.empty()) stats.mismatches++;
+        if (readS2M(HEAD_ADDR) - head >= jobs) stats.mismatches++;
+
+        // The counters keep counting what was done before the abort
+        checkCounters(counters, stats.blocks);
+        const uint64_t mismatches = stats.mismatches;
+        writeS2M(IRQ_ADDR, readS2M(HEAD_ADDR));
+        writeM2S(CONTROL_ADDR, 0);
+
+        JobStats next = runQueued(s, blocks, jobs, b);
+        next.mismatches += mismatches;
+        return next;
+    }
+
+    // Ticks until the interrupt is raised
+    void waitForIrq(uint32_t blocks)
+    {
+        while(!s2m.irq)
+        {
+            if (stats.cycles > (blocks + 1) * MAX_CYCLES_PER_BLOCK)
+                throw std::runtime_error("timeout waiting for IRQ");
+
+            tick();
+        }
+    }
+
+    // Compares <blocks> blocks at block index <slot> in DRAM with
+    // the software kernel started from block count <bCount>
+    // (XORed with the plaintext if <encrypted>)
+    void check(const ChaCha20::State& s, uint32_t bCount, uint32_t slot, uint32_t blocks, bool encrypted = false)
+    {
+        const bool summation = readChaCha20(FEATURES_ADDR) & SUMMATION_FEATURE;
+        ChaCha20::ChaCha20 reference;
+        ChaCha20::State expected = s;
+        expected.bCount[0] = bCount;
+
+        for(uint32_t b = 0; b < blocks; b++)
+        {
+            if (summation) reference.compute(expected);
+            else reference.computeRounds(expected);
+
+            for(int i = 0; i < ChaCha20::State::WORD_SIZE; i++)
+            {
+                const size_t index = (slot + b) * ChaCha20::State::WORD_SIZE + i;
+                const uint32_t word = encrypted ? reference.state[i] ^ plaintext(index) : reference.state[i];
+                if (dram[index] != word) stats.mismatches++;
+            }
+
+            expected.bCount[0]++;
+        }
+    }
+};
+
+int main(int argc, char* argv[])
+{
+    Verilated::commandArgs(argc, argv);
+
+    const uint32_t blocks = argc > 1 ? std::stoul(argv[1]) : 1024;
+    const uint32_t overhead = argc > 2 ? std::stoul(argv[2]) : 0;
+    System system(blocks * ChaCha20::State::WORD_SIZE, overhead);
+
+    // Backpressure patterns of the FPGA-to-SDRAM bridge
+    const std::vector<std::pair<std::string, Backpressure>> patterns
+    {
+        { "none",         [](uint64_t c) { return false; } },
+        { "1 of 4",       [](uint64_t c) { return c % 4 == 0; } },
+        { "1 of 2",       [](uint64_t c) { return c % 2 == 0; } },
+        { "8 of 16",      [](uint64_t c) { return c % 16 < 8; } },
+        { "refresh",      [](uint64_t c) { return c % 512 < 40; } },
+        { "random 25%",   [](uint64_t c) { return (c * 2654435761u >> 16) % 4 == 0; } },
+        { "random 50%",   [](uint64_t c) { return (c * 2654435761u >> 16) % 2 == 0; } },
+    };
+
+    int result = 0;
+
+    const uint32_t features = system.readChaCha20(FEATURES_ADDR);
+    std::cout << "ChaCha20: " << ((features >> LANES_SHIFT) & 0xFF) << " lane(s), ";
+    std::cout << ((features >> ROUNDS_SHIFT) & 0xFF) << " round(s) per cycle, summation ";
+    std::cout << (features & SUMMATION_FEATURE ? "on" : "off") << std::endl;
+
+    const uint32_t burst = (system.readS2M(DEPTH_ADDR) >> BURST_SHIFT) & 0xFF;
+    std::cout << "S2MAdapter: bursts of " << burst << ", " << overhead << " setup cycle(s) per burst" << std::endl;
+
+    std::cout << std::left << std::setw(24) << "backpressure";
+    std::cout << std::right << std::setw(10) << "cycles";
+    std::cout << std::setw(14) << "cycles/block";
+    std::cout << std::setw(12) << "bus util";
+    std::cout << std::setw(12) << "stalled";
+    std::cout << std::setw(10) << "MiB/s";
+    std::cout << std::setw(8) << "check" << std::endl;
+
+    // Prints one line of the report
+    auto report = [&](const std::string& name, const JobStats& s)
+    {
+        std::cout << std::left << std::setw(24) << name << std::right << std::fixed;
+        std::cout << std::setw(10) << s.cycles;
+        std::cout << std::setw(14) << std::setprecision(2) << (double)s.cycles / blocks;
+        std::cout << std::setw(11) << std::setprecision(1) << 100.0 * s.beats / s.cycles << "%";
+        std::cout << std::setw(11) << std::setprecision(1) << 100.0 * s.stalls / s.cycles << "%";
+        std::cout << std::setw(10) << std::setprecision(1) << s.beats * 32 * CLOCK / s.cycles / (1 << 20);
+        std::cout << std::setw(8) << (s.mismatches == 0 ? "OK" : "FAIL") << std::endl;
+
+        if (s.mismatches != 0) result = 1;
+    };
+
+    // Single job per interrupt
+    for(auto& p : patterns) report(p.first, system.run(state, blocks, p.second));
+
+    // Descriptor ring with a coalesced interrupt
+    for(auto& p : patterns) report(p.first + ", 8 jobs", system.runQueued(state, blocks, 8, p.second));
+
+    // Inline encryption (the plaintext is read through the same bridge)
+    for(auto& p : patterns) report(p.first + ", inline", system.runInline(state, blocks, 8, p.second));
+
+    // Jobs queued after aborted inline jobs
+    for(auto& p : patterns) report(p.first + ", abort", system.runAbort(state, blocks, 8, p.second));
+
+    return result;
+}
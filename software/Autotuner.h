@@ -0,0 +1,463 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <tuple>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+#include "ChaCha20/State.h"
+#include "FpgaCha/FpgaCha.h"
+#include "FpgaCha/EmuFpgaCha.h"
+#include "FpgaCha/DmaPool.h"
+#include "TaskManager.h"
+#include "FakeCryptor.h"
+#include "FakeWorker.h"
+#include "FileMapper.h"
+#include "FileCryptor.h"
+#include "ChaCha20Worker.h"
+#include "FpgaChaWorker.h"
+
+// Worker mix and task geometry of the chacha20 utility
+struct TunedConfig
+{
+    // Number of FpgaChaWorker and ChaCha20Worker instances
+    uint32_t fpgaWorkers = 2;
+    uint32_t cpuWorkers = 0;
+    
+    // Summation threads of every FpgaChaWorker (the T template argument)
+    uint32_t summationThreads = 1;
+    
+    // Number of tasks (the N template argument) and size of one task in words
+    uint32_t tasks = 8;
+    size_t taskSize = 1024 * 256;
+    
+    bool operator<(const TunedConfig& c) const
+    {
+        return std::tie(fpgaWorkers, cpuWorkers, summationThreads, tasks, taskSize) <
+            std::tie(c.fpgaWorkers, c.cpuWorkers, c.summationThreads, c.tasks, c.taskSize);
+    }
+    
+    std::string str() const
+    {
+        std::ostringstream o;
+        o << fpgaWorkers << " FPGA, " << cpuWorkers << " CPU, T=" << summationThreads;
+        o << ", " << tasks << " x " << taskSize * sizeof(uint32_t) / 1024 << " KiB";
+        return o.str();
+    }
+};
+
+// FpgaCha cores and DMA memory of the board (real or emulated)
+template <typename C>
+struct TunedBoard;
+
+template <>
+struct TunedBoard<FpgaCha::FpgaCha>
+{
+    typedef FpgaCha::UDmaPool Pool;
+    
+    static std::string core(uint32_t i)
+    {
+        return "uio" + std::to_string(i);
+    }
+    
+    // Counts UIO devices of FpgaCha cores
+    static uint32_t cores()
+    {
+        uint32_t count = 0;
+        
+        for(uint32_t i = 0; i < 16; i++)
+        {
+            std::ifstream file("/sys/class/uio/" + core(i) + "/name");
+            std::string name;
+            if (getline(file, name) && name.compare(0, 7, "fpgacha") == 0) count++;
+        }
+        
+        return count;
+    }
+    
+    // Adds all udmabuf devices to the pool
+    // Throws if they are too small for <byteSize> bytes of buffers
+    static void addRegions(Pool& pool, size_t byteSize)
+    {
+        size_t capacity = 0;
+        
+        for(uint32_t i = 0; access(("/dev/udmabuf" + std::to_string(i)).c_str(), F_OK) == 0; i++)
+        {
+            capacity += pool.add("udmabuf" + std::to_string(i)).size * sizeof(uint32_t);
+        }
+        
+        if (capacity < byteSize) throw std::runtime_error("udmabuf devices hold " + std::to_string(capacity) + " bytes, " + std::to_string(byteSize) + " needed");
+    }
+    
+    static std::string name()
+    {
+        return "";
+    }
+};
+
+template <>
+struct TunedBoard<FpgaCha::EmuFpgaCha>
+{
+    typedef FpgaCha::EmuDmaPool Pool;
+    
+    static std::string core(uint32_t i)
+    {
+        return "emu" + std::to_string(i);
+    }
+    
+    static uint32_t cores()
+    {
+        return 4;
+    }
+    
+    static void addRegions(Pool& pool, size_t byteSize)
+    {
+        pool.add("emudmabuf0", byteSize);
+    }
+    
+    static std::string name()
+    {
+        return "-emu";
+    }
+};
+
+// Finds the fastest worker mix and task geometry by running short probes
+// and keeps the result per board in ~/.chacha20
+// C - interface to the cores (FpgaCha::FpgaCha or FpgaCha::EmuFpgaCha)
+template <typename C>
+class Autotuner
+{
+private:
+    typedef std::chrono::steady_clock Clock;
+    typedef TunedBoard<C> Board;
+    typedef typename Board::Pool Pool;
+    
+    // One-time pad consumed by a probe without an input file
+    static constexpr size_t PROBE_BYTES = 64 * 1024 * 1024;
+    
+    // A cheaper configuration is chosen if it is at most this much slower
+    // (more cores than DRAM bandwidth can feed only add contention)
+    static constexpr double TOLERANCE = 0.03;
+    
+    // Maximum number of passes over all parameters
+    static constexpr int PASSES = 3;
+    
+    // Runs the pipeline with cryptor K constructed from <args>
+    template <size_t N, size_t T, template <size_t> class K, typename... A>
+    static void runWith(const TunedConfig& c, const ChaCha20::State& s, A&... args)
+    {
+        Pool pool;
+        Board::addRegions(pool, N * c.taskSize * sizeof(uint32_t));
+        TaskManager<N> m(pool, c.taskSize);
+        
+        K<N> cryptor(m, args...);
+        std::deque<FpgaChaWorker<N, T, C, Pool>> fpgaWorkers;
+        std::deque<ChaCha20Worker<N>> cpuWorkers;
+        
+        try
+        {
+            for(uint32_t i = 0; i < c.fpgaWorkers; i++) fpgaWorkers.emplace_back(m, s, Board::core(i), pool);
+            for(uint32_t i = 0; i < c.cpuWorkers; i++) cpuWorkers.emplace_back(m, s);
+        }
+        
+        // Let the cryptor and the started workers finish
+        catch (...)
+        {
+            m.shutdown();
+            throw;
+        }
+    }
+    
+    template <size_t N, template <size_t> class K, typename... A>
+    static void runWith(const TunedConfig& c, const ChaCha20::State& s, A&... args)
+    {
+        if (c.summationThreads == 2) runWith<N, 2, K>(c, s, args...);
+        else runWith<N, 1, K>(c, s, args...);
+    }
+    
+    // Runs the pipeline with cryptor K and one FakeWorker (the ceiling
+    // of the cryptor, i.e. of the DRAM with FileCryptor, as no worker is faster)
+    template <size_t N, template <size_t> class K, typename... A>
+    static void runFakeWith(const TunedConfig& c, A&... args)
+    {
+        Pool pool;
+        Board::addRegions(pool, N * c.taskSize * sizeof(uint32_t));
+        TaskManager<N> m(pool, c.taskSize);
+        
+        K<N> cryptor(m, args...);
+        FakeWorker<N> worker(m);
+    }
+    
+    template <template <size_t> class K, typename... A>
+    static void runFake(const TunedConfig& c, A&... args)
+    {
+        switch(c.tasks)
+        {
+            case 4: runFakeWith<4, K>(c, args...); break;
+            case 8: runFakeWith<8, K>(c, args...); break;
+            case 16: runFakeWith<16, K>(c, args...); break;
+            default: throw std::runtime_error("Unsupported number of tasks: " + std::to_string(c.tasks));
+        }
+    }
+    
+    // Saves <c> as the configuration of this board
+    static void save(const TunedConfig& c)
+    {
+        std::vector<std::string> lines;
+        std::string line;
+        
+        // Keep configurations of other boards
+        {
+            std::ifstream file(fileName());
+            while(getline(file, line))
+            {
+                if (line.compare(0, board().size() + 1, board() + " ") != 0) lines.push_back(line);
+            }
+        }
+        
+        std::ostringstream entry;
+        entry << board() << " " << c.fpgaWorkers << " " << c.cpuWorkers << " ";
+        entry << c.summationThreads << " " << c.tasks << " " << c.taskSize;
+        lines.push_back(entry.str());
+        
+        std::ofstream file(fileName());
+        for(auto& l : lines) file << l << std::endl;
+        
+        if (!file) throw std::runtime_error("Error when writing to '" + fileName() + "'");
+    }
+
+public:
+    // File with the configurations of tuned boards
+    static std::string fileName()
+    {
+        const char* home = getenv("HOME");
+        return std::string(home == nullptr ? "." : home) + "/.chacha20";
+    }
+    
+    // Board name (device tree model or host name)
+    static std::string board()
+    {
+        std::ifstream file("/proc/device-tree/model");
+        std::string name;
+        
+        if (!getline(file, name, '\0') || name.empty())
+        {
+            char host[256] = {};
+            gethostname(host, sizeof(host) - 1);
+            name = host;
+        }
+        
+        std::replace(name.begin(), name.end(), ' ', '_');
+        return name + Board::name();
+    }
+    
+    // Supported numbers of tasks (the N template argument)
+    static std::vector<uint32_t> taskCounts()
+    {
+        return { 4, 8, 16 };
+    }
+    
+    // Runs the pipeline with cryptor K constructed from <args> (e.g. FileCryptor)
+    template <template <size_t> class K, typename... A>
+    static void run(const TunedConfig& c, const ChaCha20::State& s, A&... args)
+    {
+        switch(c.tasks)
+        {
+            case 4: runWith<4, K>(c, s, args...); break;
+            case 8: runWith<8, K>(c, s, args...); break;
+            case 16: runWith<16, K>(c, s, args...); break;
+            default: throw std::runtime_error("Unsupported number of tasks: " + std::to_string(c.tasks));
+        }
+    }
+    
+    // Loads the configuration of this board
+    // Returns false if the board was not tuned
+    static bool load(TunedConfig& c)
+    {
+        std::ifstream file(fileName());
+        std::string line;
+        
+        while(getline(file, line))
+        {
+            std::istringstream entry(line);
+            std::string name;
+            TunedConfig t;
+            
+            entry >> name >> t.fpgaWorkers >> t.cpuWorkers >> t.summationThreads >> t.tasks >> t.taskSize;
+            
+            if (entry && name == board())
+            {
+                c = t;
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    // Searches for the fastest configuration and saves it for this board
+    // inFile - file to encrypt in probes (FakeCryptor is used if empty)
+    static TunedConfig tune(const ChaCha20::State& s, const std::string& inFile)
+    {
+        const uint32_t cores = Board::cores();
+        const uint32_t cpus = std::max(1u, std::thread::hardware_concurrency());
+        const bool softSummation = cores > 0 && !C(Board::core(0)).hasSummation();
+        const std::string outFile = inFile + ".autotune";
+        
+        std::cout << "Tuning '" << board() << "': " << cores << " FpgaCha core(s), " << cpus << " CPU(s)" << std::endl;
+        
+        // Measured throughput of every tried configuration in MiB/s (0 - cannot run)
+        std::map<TunedConfig, double> results;
+        
+        // Runs <c> and returns its throughput in MiB/s (0 - cannot run)
+        // fake - use FakeWorker instead of the workers of <c>
+        auto measure = [&](const TunedConfig& c, bool fake, const std::string& label)
+        {
+            size_t bytes = PROBE_BYTES;
+            const auto start = Clock::now();
+            
+            try
+            {
+                if (inFile.empty())
+                {
+                    if (fake) runFake<FakeCryptor>(c, bytes);
+                    else run<FakeCryptor>(c, s, bytes);
+                }
+                
+                else
+                {
+                    FileMapper in(inFile);
+                    FileMapper out(outFile, in.getSize());
+                    bytes = in.getSize();
+                    if (fake) runFake<FileCryptor>(c, in, out);
+                    else run<FileCryptor>(c, s, in, out);
+                }
+            }
+            
+            catch (std::runtime_error e)
+            {
+                std::cout << std::setw(40) << std::left << label << std::right << e.what() << std::endl;
+                return 0.0;
+            }
+            
+            const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            const double result = bytes / seconds / (1 << 20);
+            
+            std::cout << std::setw(40) << std::left << label << std::right << std::fixed;
+            std::cout << std::setprecision(1) << result << " MiB/s" << std::endl;
+            return result;
+        };
+        
+        auto probe = [&](const TunedConfig& c)
+        {
+            if (results.count(c) != 0) return results[c];
+            if (c.fpgaWorkers + c.cpuWorkers == 0) return results[c] = 0;
+            return results[c] = measure(c, false, c.str());
+        };
+        
+        TunedConfig best;
+        best.fpgaWorkers = std::min(best.fpgaWorkers, cores);
+        if (best.fpgaWorkers == 0) best.cpuWorkers = 1;
+        
+        // No configuration is faster than the cryptor with workers that take no time
+        // (the memory bandwidth with an input file, the task handoff without it)
+        const double ceiling = measure(best, true, "ceiling (FakeWorker)");
+        
+        // Parameters to search (values from the cheapest)
+        typedef std::function<void(TunedConfig&, size_t)> Setter;
+        std::vector<std::pair<std::vector<size_t>, Setter>> parameters;
+        std::vector<size_t> values;
+        
+        values.clear();
+        for(size_t i = 0; i <= cores; i++) values.push_back(i);
+        parameters.push_back({ values, [](TunedConfig& c, size_t v){ c.fpgaWorkers = v; } });
+        
+        values.clear();
+        for(size_t i = 0; i <= cpus; i++) values.push_back(i);
+        parameters.push_back({ values, [](TunedConfig& c, size_t v){ c.cpuWorkers = v; } });
+        
+        if (softSummation) parameters.push_back({ { 1, 2 }, [](TunedConfig& c, size_t v){ c.summationThreads = v; } });
+        
+        values.clear();
+        for(auto n : taskCounts()) values.push_back(n);
+        parameters.push_back({ values, [](TunedConfig& c, size_t v){ c.tasks = v; } });
+        
+        parameters.push_back({ { 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 },
+            [](TunedConfig& c, size_t v){ c.taskSize = v; } });
+        
+        // Tune one parameter at a time until nothing changes
+        for(int pass = 0; pass < PASSES; pass++)
+        {
+            bool changed = false;
+            
+            for(auto& p : parameters)
+            {
+                std::vector<std::pair<TunedConfig, double>> tried;
+                double fastest = 0;
+                
+                for(auto v : p.first)
+                {
+                    TunedConfig c = best;
+                    p.second(c, v);
+                    tried.push_back({ c, probe(c) });
+                    fastest = std::max(fastest, tried.back().second);
+                    
+                    // Costlier values cannot beat the ceiling
+                    if (ceiling > 0 && fastest >= ceiling * (1 - TOLERANCE)) break;
+                }
+                
+                // Take the cheapest value that is almost as fast as the fastest one
+                for(auto& t : tried)
+                {
+                    if (fastest == 0 || t.second < fastest * (1 - TOLERANCE)) continue;
+                    changed |= best < t.first || t.first < best;
+                    best = t.first;
+                    break;
+                }
+            }
+            
+            if (!changed) break;
+        }
+        
+        if (!inFile.empty()) unlink(outFile.c_str());
+        
+        if (results[best] == 0) throw std::runtime_error("No configuration could run");
+        
+        std::cout << "Best: " << best.str() << ", " << std::setprecision(1) << results[best] << " MiB/s";
+        if (ceiling > 0) std::cout << " (" << std::setprecision(0) << 100 * results[best] / ceiling << "% of the ceiling)";
+        std::cout << std::endl;
+        save(best);
+        std::cout << "Saved to '" << fileName() << "'" << std::endl;
+        
+        return best;
+    }
+};
\ No newline at end of file
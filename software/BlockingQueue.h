@@ -42,8 +42,7 @@ public:
     // Returns the number of available slots in the queue
     size_t count() const
     {
-        const size_t c = tail - head;
-        return full ? N : (c < 0 ? c + N : c);
+        return full ? N : (tail >= head ? tail - head : tail + N - head);
     }
     
     // Enables the shutdown mode
@@ -95,4 +94,24 @@ public:
         
         return true;
     }
+    
+    // Get an element from queue without blocking
+    // Returns false if the queue is empty or the shutdown mode was enabled
+    // In this case <item> is invalid
+    bool tryPop(I& item)
+    {
+        if (stopped) return false;
+        
+        {
+            auto lock = std::unique_lock<std::mutex>(mutex);
+            if (count() == 0 || stopped) return false;
+            item = items[head];
+            head = head == N - 1 ? 0 : head + 1;
+            if (head == tail) full = false;
+        }
+        
+        cvNotFull.notify_one();
+        
+        return true;
+    }
 };
\ No newline at end of file
@@ -0,0 +1,181 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+#include <array>
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include "Trace.h"
+#include "Metrics.h"
+
+// DRAM bandwidth budget of the pipeline, so other workloads on the board keep the rest
+// Before a stage moves data through DRAM it takes that many bytes from a token bucket
+// refilled at the budget. A stage may take more than the bucket holds: the bucket goes
+// into debt and the stage sleeps until the debt is paid off, so the stages that follow
+// it wait in turn and the pipeline runs steadily at the budget instead of in bursts
+class Budget
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+    
+    // Stages that take from the budget
+    // JOBS - FpgaCha jobs (one-time pad written by the cores, summation in software)
+    // SOFTWARE - one-time pad (or ciphertext) written by software workers
+    // CRYPTOR - plaintext and one-time pad read and ciphertext written by the cryptor
+    enum Point { JOBS, SOFTWARE, CRYPTOR, POINTS };
+    
+    // Unused budget is kept for this long, so a stage that was waiting for its input
+    // can catch up (a longer time allows longer bursts above the budget)
+    static constexpr std::chrono::milliseconds BURST { 50 };
+    
+    // Limits the pipeline to <mib> MiB/s of DRAM traffic and prints the achieved bandwidth
+    // when destroyed (nothing if <mib> is 0)
+    // Must outlive the workers and the cryptor
+    class Session
+    {
+    private:
+        const double mib;
+    
+    public:
+        Session(double mib) : mib(mib)
+        {
+            if (mib > 0) start(mib);
+        }
+        
+        ~Session()
+        {
+            if (mib > 0) report(std::cout);
+        }
+    };
+    
+    static bool enabled()
+    {
+        return state().rate > 0;
+    }
+    
+    // Starts limiting the pipeline to <mib> MiB/s (must be called before the workers are started)
+    static void start(double mib)
+    {
+        State& s = state();
+        s.rate = mib * (1 << 20);
+        s.capacity = s.rate * std::chrono::duration<double>(BURST).count();
+    }
+    
+    // Takes <bytes> of DRAM traffic of <task> at <point> from the budget
+    // Blocks while the budget is overdrawn
+    static void take(Point point, size_t bytes, uint32_t task = Trace::NO_TASK)
+    {
+        if (!enabled()) return;
+        
+        State& s = state();
+        Clock::time_point until;
+        
+        {
+            auto lock = std::lock_guard<std::mutex>(s.mutex);
+            const auto now = Clock::now();
+            
+            // The bucket starts empty, so the pipeline does not start with a burst
+            if (s.first == Clock::time_point())
+            {
+                s.first = now;
+                s.refilled = now;
+            }
+            
+            // Refill the bucket for the time since the last take
+            s.tokens = std::min(s.capacity, s.tokens + s.rate * std::chrono::duration<double>(now - s.refilled).count());
+            s.refilled = now;
+            s.tokens -= bytes;
+            s.bytes[point] += bytes;
+            
+            // The debt (with the debts of the threads already waiting) is paid off at the budget
+            until = now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(std::max(-s.tokens, 0.0) / s.rate));
+            s.last = std::max(s.last, until);
+            if (until <= now) return;
+            s.waited[point] += until - now;
+        }
+        
+        Trace::Span span("budget", task);
+        Metrics::Stalled stalled(Metrics::STALL_BUDGET);
+        std::this_thread::sleep_until(until);
+    }
+    
+    // Prints the achieved bandwidth against the budget and the traffic and wait time of every stage
+    // The bandwidth is measured from the first take until the last one is paid off
+    static void report(std::ostream& o)
+    {
+        static const char* names[POINTS] = { "FpgaCha jobs", "software workers", "cryptor" };
+        State& s = state();
+        auto lock = std::lock_guard<std::mutex>(s.mutex);
+        
+        uint64_t total = 0;
+        for(auto b : s.bytes) total += b;
+        
+        const double mib = 1 << 20;
+        const double run = std::chrono::duration<double>(s.last - s.first).count();
+        const double achieved = run > 0 ? total / run : 0;
+        
+        o << std::fixed << std::setprecision(1);
+        o << "DRAM budget " << s.rate / mib << " MiB/s, achieved " << achieved / mib << " MiB/s (";
+        o << 100 * achieved / s.rate << "%) in " << std::setprecision(2) << run << " s" << std::endl;
+        o << std::left << std::setw(20) << "stage" << std::right << std::setw(10) << "MiB";
+        o << std::setw(10) << "MiB/s" << std::setw(12) << "waited ms" << std::endl;
+        
+        for(size_t p = 0; p < POINTS; p++)
+        {
+            if (s.bytes[p] == 0) continue;
+            
+            o << std::left << std::setw(20) << names[p] << std::right << std::setprecision(1);
+            o << std::setw(10) << s.bytes[p] / mib << std::setw(10) << (run > 0 ? s.bytes[p] / run / mib : 0);
+            o << std::setw(12) << std::chrono::duration<double, std::milli>(s.waited[p]).count() << std::endl;
+        }
+    }
+
+private:
+    struct State
+    {
+        // Budget and size of the bucket in bytes per second and in bytes (0 - no budget)
+        double rate = 0;
+        double capacity = 0;
+        
+        // Protects the fields below
+        std::mutex mutex;
+        
+        // Bytes in the bucket (negative - debt) and time of the last refill
+        double tokens = 0;
+        Clock::time_point refilled;
+        
+        // Time of the first take and the time the last one is paid off
+        Clock::time_point first;
+        Clock::time_point last;
+        
+        // Bytes taken and time waited by every stage
+        std::array<uint64_t, POINTS> bytes {};
+        std::array<Clock::duration, POINTS> waited {};
+    };
+    
+    static State& state()
+    {
+        static State s;
+        return s;
+    }
+};
\ No newline at end of file
@@ -45,9 +45,10 @@ namespace ChaCha20
     public:
         State state;
     
-        // Computes ChaCha20 with encryption parameters <s>
+        // Computes 20 rounds of ChaCha20 (without the summation stage)
+        // with encryption parameters <s>
         // The result can be found in this->state
-        void compute(const State& s)
+        void computeRounds(const State& s)
         {
             state = s;
             
@@ -63,6 +64,13 @@ namespace ChaCha20
                 quaterRound(state, 2, 7,  8, 13);
                 quaterRound(state, 3, 4,  9, 14);
             }
+        }
+    
+        // Computes ChaCha20 with encryption parameters <s>
+        // The result can be found in this->state
+        void compute(const State& s)
+        {
+            computeRounds(s);
             
             // Do summation
             for (int i = 0; i < State::WORD_SIZE; i++)
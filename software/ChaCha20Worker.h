@@ -18,12 +18,19 @@
 #pragma once
 
 #include <thread>
+#include <algorithm>
 #include "TaskManager.h"
 #include "OtpTask.h"
+#include "FileMapper.h"
+#include "Trace.h"
+#include "Placement.h"
+#include "Budget.h"
 #include "ChaCha20/ChaCha20.h"
 #include "ChaCha20/State.h"
 
 // Worker that produces ChaCha20 OTP blocks using software
+// It can also encrypt the input file straight to the output file, so the keystream
+// never goes through the buffer of the task and the cryptor only tracks completion
 // N - number of tasks in the system (should match to that of TaskManager and Cryptor)
 template <size_t N>
 class ChaCha20Worker
@@ -32,13 +39,13 @@ private:
     // Thread to produce OTP blocks
     std::thread chacha20Thread;
     
-public:
-    // m - task manager
-    // s - encryption parameters
-    ChaCha20Worker(TaskManager<N>& m, const ChaCha20::State& s)
+    // Starts the thread (<in> and <out> are null unless the worker encrypts the file itself)
+    void start(TaskManager<N>& m, const ChaCha20::State& s, FileMapper* in, FileMapper* out)
     {
-        chacha20Thread = std::thread([&]()
+        chacha20Thread = std::thread([&m, &s, in, out]()
         {
+            Trace::nameThread("ChaCha20Worker");
+            Placement::place(Placement::WORKER);
             ChaCha20::State state = s;
             ChaCha20::ChaCha20 chacha20;
             
@@ -47,25 +54,59 @@ public:
             {
                 OtpTask task;
                 
-                // Get task from the queue
-                if (!m.performTask(task)) break;
+                // Get task from the queue (only of the stream of the file if it writes to the file)
+                if (!m.performTask(task, out != nullptr)) break;
                 
                 // Calculate block count
                 task.getBCount(s.bCount, state.bCount);
                 
                 // Compute ChaCha20 OTP blocks
-                for(int i = 0; i < task.length; i += ChaCha20::State::WORD_SIZE)
+                if (out == nullptr)
                 {
-                    // 20 rounds
-                    chacha20.compute(state);
+                    Budget::take(Budget::SOFTWARE, task.length * sizeof(uint32_t), task.id);
+                    Trace::Span span("chacha20", task.id);
                     
-                    // Summation
-                    for(int j = 0; j < ChaCha20::State::WORD_SIZE; j++)
+                    for(int i = 0; i < task.length; i += ChaCha20::State::WORD_SIZE)
                     {
-                        task.buffer[i + j] = chacha20.state[j];
+                        // 20 rounds
+                        chacha20.compute(state);
+                        
+                        // Summation
+                        for(int j = 0; j < ChaCha20::State::WORD_SIZE; j++)
+                        {
+                            task.buffer[i + j] = chacha20.state[j];
+                        }
+                        
+                        state.bCount[0]++;
                     }
+                }
+                
+                // Encrypt the part of the file covered by the task block by block
+                // (the rest of the task is past the end of the file)
+                else
+                {
+                    const size_t size = out->getWordSize();
+                    const size_t offset = std::min(task.id * task.length, size);
+                    const size_t count = std::min(size - offset, task.length);
+                    Budget::take(Budget::SOFTWARE, count * 2 * sizeof(uint32_t), task.id);
+                    Trace::Span span("encrypt", task.id);
+                    const uint32_t* plaintext = in->getContent() + offset;
+                    uint32_t* ciphertext = out->getContent() + offset;
                     
-                    state.bCount[0]++;
+                    for(size_t i = 0; i < count; i += ChaCha20::State::WORD_SIZE)
+                    {
+                        chacha20.compute(state);
+                        
+                        const size_t words = std::min<size_t>(count - i, ChaCha20::State::WORD_SIZE);
+                        for(size_t j = 0; j < words; j++)
+                        {
+                            ciphertext[i + j] = plaintext[i + j] ^ chacha20.state[j];
+                        }
+                        
+                        state.bCount[0]++;
+                    }
+                    
+                    task.written = true;
                 }
                 
                 // Report task completion
@@ -74,6 +115,23 @@ public:
         });
     }
     
+public:
+    // m - task manager
+    // s - encryption parameters
+    ChaCha20Worker(TaskManager<N>& m, const ChaCha20::State& s)
+    {
+        start(m, s, nullptr, nullptr);
+    }
+    
+    // m - task manager
+    // s - encryption parameters
+    // in - input file (task i covers words starting from i * task.length)
+    // out - output file, the ciphertext is written to it directly (needs FileCryptor)
+    ChaCha20Worker(TaskManager<N>& m, const ChaCha20::State& s, FileMapper& in, FileMapper& out)
+    {
+        start(m, s, &in, &out);
+    }
+    
     // Destroy
     ~ChaCha20Worker()
     {
@@ -26,6 +26,8 @@
 #include "QueueArray.h"
 #include "OtpTask.h"
 #include "TaskManager.h"
+#include "Trace.h"
+#include "Placement.h"
 
 // Consumes OPT blocks and discards them
 // Can be used to test performance of workers
@@ -44,6 +46,8 @@ public:
     {
         fakeThread = std::thread([&, length]()
         { 
+            Trace::nameThread("FakeCryptor");
+            Placement::place(Placement::CRYPTOR);
             size_t processed = 0;
             OtpTask task;
             
@@ -52,6 +56,7 @@ public:
             {
                 // Wait for the next otp task to be done
                 m.processTask(task);
+                m.waitTask(task, task.length);
                 
                 // Count how many bytes has been processed
                 processed += task.length * sizeof(uint32_t);
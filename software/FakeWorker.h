@@ -20,6 +20,8 @@
 #include <thread>
 #include "OtpTask.h"
 #include "TaskManager.h"
+#include "Trace.h"
+#include "Placement.h"
 
 // Generates fake OPT blocks
 // Can be used to test performance of cryptors
@@ -37,6 +39,8 @@ public:
     {
         fakeThread = std::thread([&]()
         { 
+            Trace::nameThread("FakeWorker");
+            Placement::place(Placement::WORKER);
             OtpTask task;
             
             // Main loop
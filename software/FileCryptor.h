@@ -20,10 +20,15 @@
 #include <array>
 #include <thread>
 #include <algorithm>
+#include <string>
+#include <stdexcept>
 #include "BlockingQueue.h"
 #include "QueueArray.h"
 #include "OtpTask.h"
 #include "TaskManager.h"
+#include "Trace.h"
+#include "Placement.h"
+#include "Budget.h"
 
 // Crypor that utilizes OTP blocks for file encryption
 // N - number of tasks in the system (should match to that of TaskManager and Workers)
@@ -40,8 +45,14 @@ public:
     // out - out file
     FileCryptor(TaskManager<N>& m, FileMapper& in, FileMapper& out)
     {
+        // Block counts past the limit belong to another stream (or wrap around), the pad would be reused
+        if (in.getSize() > m.limit())
+            throw std::runtime_error("File is longer than the " + std::to_string(m.limit() >> 30) + " GiB of one-time pad of its stream");
+        
         cryptorThread = std::thread([&]()
         { 
+            Trace::nameThread("FileCryptor");
+            Placement::place(Placement::CRYPTOR);
             OtpTask task;
             size_t fileOffset = 0;
             uint32_t* inContent = in.getContent();
@@ -55,15 +66,35 @@ public:
                 
                 const size_t jobSize = std::min(fileSize - fileOffset, task.length);
                 
-                // Do the cryption job
-                for(size_t i = 0; i < jobSize; i++)
+                // Consume the task part by part as workers complete it
+                for(size_t done = 0; done < jobSize;)
                 {
-                    outContent[fileOffset] = inContent[fileOffset] ^ task.buffer[i];
-                    fileOffset++;
+                    const size_t ready = std::min(m.waitTask(task, done + 1), jobSize);
+                    if (ready <= done) break;
+                    
+                    // XOR reads the plaintext and the one-time pad and writes the ciphertext
+                    if (!task.written) Budget::take(Budget::CRYPTOR, (ready - done) * sizeof(uint32_t) * 3, task.id);
+                    
+                    Trace::Span span(task.written ? "skip" : "xor", task.id);
+                    
+                    // Nothing to do if the worker wrote the result to the output itself
+                    if (task.written) fileOffset += ready - done;
+                    
+                    // Do the cryption job
+                    else for(size_t i = done; i < ready; i++)
+                    {
+                        outContent[fileOffset] = inContent[fileOffset] ^ task.buffer[i];
+                        fileOffset++;
+                    }
+                    
+                    done = ready;
                 }
                 
                 if (fileOffset >= fileSize - 1) break;
                 
+                // The buffer can be reused only when the worker is done with it
+                m.waitTask(task, task.length);
+                
                 // Schedule a new task
                 m.scheduleTask(task);
             }
@@ -0,0 +1,71 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <algorithm>
+
+namespace FpgaCha
+{
+    // Decides how long to poll the registers of a core before blocking on the interrupt
+    // The time spent polling follows the recent job durations: it grows while
+    // jobs finish during polling and shrinks while they do not
+    class AdaptiveSpin
+    {
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        // The budget never drops below 1/MIN_FRACTION of the limit,
+        // so polling resumes when jobs get shorter again
+        static constexpr int MIN_FRACTION = 16;
+
+        // Maximum and current polling time
+        Clock::duration limit = Clock::duration::zero();
+        Clock::duration budget = Clock::duration::zero();
+
+    public:
+        // Polls for up to <maxSpin> before blocking (0 - interrupts only)
+        void setLimit(std::chrono::microseconds maxSpin)
+        {
+            limit = budget = maxSpin;
+        }
+
+        // Tells whether the registers are polled
+        bool enabled() const
+        {
+            return limit != Clock::duration::zero();
+        }
+
+        // Calls <poll> until it returns non-zero or the budget is spent
+        // Returns the last value returned by <poll>
+        template <typename F>
+        uint32_t run(F poll)
+        {
+            const auto deadline = Clock::now() + budget;
+            uint32_t finished;
+
+            while((finished = poll()) == 0 && Clock::now() < deadline);
+
+            if (finished != 0) budget = std::min(limit, budget * 2);
+            else budget = std::max(limit / MIN_FRACTION, budget / 2);
+
+            return finished;
+        }
+    };
+}
\ No newline at end of file
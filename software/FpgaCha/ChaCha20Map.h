@@ -21,6 +21,7 @@
 #include <stdint.h>
 #include <iterator>
 #include <array>
+#include <algorithm>
 #include "../ChaCha20/State.h"
 
 namespace FpgaCha
@@ -33,16 +34,49 @@ namespace FpgaCha
         volatile uint32_t _padCount;
         volatile uint32_t _roundCount;
         volatile uint32_t _probe;
+        volatile uint32_t _features;
+        volatile uint32_t _jobBCount;
+        volatile uint32_t _jobPads;
+        volatile uint32_t _cycles;
+        volatile uint32_t _busyCycles;
+        volatile uint32_t _stallCycles;
+        volatile uint32_t _blocks;
+        
+        // Index of the block count word in the state
+        static const int BCOUNT_IDX = 12;
+        
+        // Value of the probe register
+        static const uint32_t PROBE = 0xfb7e03d9;
+        
+        // Feature bits
+        static const uint32_t SUMMATION = 1 << 0;
+        static const uint32_t JOB_QUEUE = 1 << 1;
+        static const uint32_t COUNTERS = 1 << 2;
+        static const uint32_t LANES_SHIFT = 8;
+        static const uint32_t ROUNDS_SHIFT = 16;
+        static const uint32_t JOB_DEPTH_SHIFT = 24;
+        
+        // Returns feature bits of the core
+        // (older cores return the probe constant for unknown registers)
+        uint32_t features() const volatile
+        {
+            const uint32_t f = _features;
+            return f == PROBE ? 0 : f;
+        }
     
     public:
         // Prints the content of registers
         void test() volatile
         {
             uint32_t p = _probe;
-            bool isOk = p == 0xfb7e03d9;
+            bool isOk = p == PROBE;
             std::cout << "Probe is " << (isOk ? "OK: " : "WRONG: ") << p << std::endl;
             std::cout << "Pad count: " << _padCount << std::endl;
             std::cout << "Round count: " << _roundCount << std::endl;
+            std::cout << "Features: " << features() << std::endl;
+            std::cout << "Lanes: " << lanes() << std::endl;
+            std::cout << "Rounds per cycle: " << roundsPerCycle() << std::endl;
+            std::cout << "Job queue depth: " << jobDepth() << std::endl;
             std::cout << "State: " << std::endl;
             _state.print();
         }
@@ -57,11 +91,93 @@ namespace FpgaCha
             }
         }
         
+        // Tells whether the core does the summation stage itself
+        bool hasSummation() const volatile
+        {
+            return features() & SUMMATION;
+        }
+        
+        // Returns the number of blocks the core computes in parallel
+        uint32_t lanes() const volatile
+        {
+            return std::max<uint32_t>((features() >> LANES_SHIFT) & 0xFF, 1);
+        }
+        
+        // Returns the number of rounds the core computes in one clock cycle
+        uint32_t roundsPerCycle() const volatile
+        {
+            return std::max<uint32_t>((features() >> ROUNDS_SHIFT) & 0xFF, 1);
+        }
+        
+        // Tells whether the probe register reads the expected constant
+        // (it does not if the core is gone or the bus does not answer)
+        bool probe() const volatile
+        {
+            return _probe == PROBE;
+        }
+        
+        // Returns the number of jobs the core can queue (0 if it cannot)
+        uint32_t jobDepth() const volatile
+        {
+            return features() & JOB_QUEUE ? (features() >> JOB_DEPTH_SHIFT) & 0xFF : 0;
+        }
+        
+        // Tells whether the core has performance counters
+        bool hasCounters() const volatile
+        {
+            return features() & COUNTERS;
+        }
+        
+        // Returns the number of clock cycles since reset (wraps around)
+        uint32_t cycles() const volatile
+        {
+            return _cycles;
+        }
+        
+        // Returns the number of cycles the core had blocks to compute or output (wraps around)
+        uint32_t busyCycles() const volatile
+        {
+            return _busyCycles;
+        }
+        
+        // Returns the number of cycles a computed block waited for the sink (wraps around)
+        uint32_t stallCycles() const volatile
+        {
+            return _stallCycles;
+        }
+        
+        // Returns the number of OTP blocks output (wraps around)
+        uint32_t blocks() const volatile
+        {
+            return _blocks;
+        }
+        
+        // Sets block count of the next OTP block
+        void setBCount(uint32_t bCount) volatile
+        {
+            _state[BCOUNT_IDX] = bCount;
+        }
+        
         // Starts pad computations
         // padCount - number of OTP blocks to compute
         void start(uint32_t padCount) volatile
         {
             _padCount = padCount;
         }
+        
+        // Drops the queued jobs and the blocks being computed
+        void stop() volatile
+        {
+            _padCount = 0;
+        }
+        
+        // Queues pad computations (the core must have a job queue)
+        // bCount - block count of the first OTP block
+        // padCount - number of OTP blocks to compute
+        void queue(uint32_t bCount, uint32_t padCount) volatile
+        {
+            _jobBCount = bCount;
+            _jobPads = padCount;
+        }
     };
 }
\ No newline at end of file
@@ -0,0 +1,174 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <deque>
+#include <vector>
+#include <string>
+#include <utility>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+#include "UDmaBuf.h"
+#include "EmuDmaBuf.h"
+
+namespace FpgaCha
+{
+    // Hands out DMA buffers from several memory regions
+    // Every buffer lies in one region, so it is physically contiguous,
+    // and has the physical address of that region
+    // Has the same interface as UDmaBuf, so workers can use it instead
+    // B - region type (UDmaBuf, or EmuDmaBuf for emulated cores and for
+    //     CPU-only workers, which do not need udmabuf at all)
+    template <typename B>
+    class DmaPool
+    {
+    private:
+        // Buffers start at this boundary in bytes relative to their region
+        static constexpr size_t ALIGNMENT = 4096;
+
+        // Buffers allocated in one region (offset and length in words)
+        typedef std::vector<std::pair<size_t, size_t>> Allocations;
+
+        // Regions (deque does not move them when growing)
+        std::deque<B> regions;
+        std::deque<Allocations> allocations;
+
+        // Protects the allocations (workers allocate buffers while the pipeline runs,
+        // see FpgaChaWorker), the regions are only added before it starts
+        mutable std::mutex mutex;
+
+        // Returns the index of the region that contains <buffer>
+        size_t find(const uint32_t* buffer) const
+        {
+            for(size_t i = 0; i < regions.size(); i++)
+            {
+                const B& r = regions[i];
+                if (buffer >= r.content && buffer < r.content + r.size) return i;
+            }
+
+            throw std::runtime_error("Buffer does not belong to the DMA pool");
+        }
+
+    public:
+        // Usage statistics of one region (sizes in bytes)
+        struct RegionStats
+        {
+            uint32_t physical;
+            size_t capacity;
+            size_t allocated;
+            size_t buffers;
+        };
+
+        DmaPool() = default;
+        DmaPool(const DmaPool&) = delete;
+
+        // Adds a region constructed from <args> (e.g. the udmabuf device name)
+        // Returns the region
+        template <typename... A>
+        B& add(A&&... args)
+        {
+            regions.emplace_back(std::forward<A>(args)...);
+            allocations.emplace_back();
+            return regions.back();
+        }
+
+        // Returns a buffer of <length> words from the first region that has room for it
+        uint32_t* allocate(size_t length)
+        {
+            const size_t alignment = ALIGNMENT / sizeof(uint32_t);
+            auto lock = std::lock_guard<std::mutex>(mutex);
+
+            for(size_t i = 0; i < regions.size(); i++)
+            {
+                Allocations& a = allocations[i];
+                size_t offset = 0;
+
+                // First fit between the allocated buffers (they are sorted by offset)
+                auto next = a.begin();
+                for(; next != a.end(); next++)
+                {
+                    if (offset + length <= next->first) break;
+                    offset = (next->first + next->second + alignment - 1) / alignment * alignment;
+                }
+
+                if (offset + length > regions[i].size) continue;
+
+                a.insert(next, std::make_pair(offset, length));
+                return regions[i].content + offset;
+            }
+
+            throw std::runtime_error("DMA pool has no room for a buffer of " +
+                std::to_string(length * sizeof(uint32_t)) + " bytes");
+        }
+
+        // Returns <buffer> to the pool
+        void release(uint32_t* buffer)
+        {
+            const size_t i = find(buffer);
+            const size_t offset = buffer - regions[i].content;
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            Allocations& a = allocations[i];
+
+            a.erase(std::remove_if(a.begin(), a.end(),
+                [&](const std::pair<size_t, size_t>& p){ return p.first == offset; }), a.end());
+        }
+
+        // Returns usage statistics of every region
+        std::vector<RegionStats> stats() const
+        {
+            std::vector<RegionStats> result;
+            auto lock = std::lock_guard<std::mutex>(mutex);
+
+            for(size_t i = 0; i < regions.size(); i++)
+            {
+                RegionStats s = { regions[i].physical, regions[i].size * sizeof(uint32_t), 0, 0 };
+
+                for(auto& p : allocations[i])
+                {
+                    s.allocated += p.second * sizeof(uint32_t);
+                    s.buffers++;
+                }
+
+                result.push_back(s);
+            }
+
+            return result;
+        }
+
+        void syncForCpu(uint32_t* buffer, size_t length) const
+        {
+            if (length != 0) regions[find(buffer)].syncForCpu(buffer, length);
+        }
+
+        void syncForDma(uint32_t* buffer, size_t length) const
+        {
+            if (length != 0) regions[find(buffer)].syncForDma(buffer, length);
+        }
+
+        uint32_t toPhysical(uint32_t* virt) const
+        {
+            return regions[find(virt)].toPhysical(virt);
+        }
+    };
+
+    typedef DmaPool<UDmaBuf> UDmaPool;
+    typedef DmaPool<EmuDmaBuf> EmuDmaPool;
+}
\ No newline at end of file
@@ -0,0 +1,217 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+
+namespace FpgaCha
+{
+    // Timing parameters of the emulated board
+    struct EmuTiming
+    {
+        // Clock frequency of FpgaCha cores in Hz
+        double clock = 50e6;
+
+        // Clock cycles needed by a core to compute one OTP block
+        uint32_t blockCycles = 20;
+
+        // Delay between the end of a job and the interrupt delivery
+        std::chrono::microseconds irqLatency{20};
+
+        // DRAM bandwidth shared by all cores in MiB/s (0 - unlimited)
+        double bandwidth = 0;
+    };
+
+    // Emulates udmabuf device using ordinary memory
+    // Has the same interface as UDmaBuf and serves as DRAM for EmuFpgaCha cores
+    class EmuDmaBuf
+    {
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        // Physical address given to the next emulated buffer
+        static uint32_t& nextPhysical()
+        {
+            static uint32_t address = 0x20000000;
+            return address;
+        }
+
+        // Emulated physical address space (all existing emulated buffers)
+        static std::vector<EmuDmaBuf*>& registry()
+        {
+            static std::vector<EmuDmaBuf*> buffers;
+            return buffers;
+        }
+
+        // Protects the registry
+        static std::mutex& registryMutex()
+        {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        // Allocates page aligned zeroed memory
+        static uint32_t* allocate(const std::string& name, size_t byteSize)
+        {
+            void* ptr = aligned_alloc(4096, byteSize);
+
+            if (ptr == nullptr)
+                throw std::runtime_error("Error when allocating memory for '" + name + "'");
+
+            memset(ptr, 0, byteSize);
+            return reinterpret_cast<uint32_t*>(ptr);
+        }
+
+        // Reserves a physical address range for a new buffer
+        static uint32_t reserve(size_t byteSize)
+        {
+            auto lock = std::lock_guard<std::mutex>(registryMutex());
+            const uint32_t address = nextPhysical();
+            nextPhysical() += (byteSize + 0xFFFFF) & ~0xFFFFF;
+            return address;
+        }
+
+        uint32_t getOffset(uint32_t* buffer) const
+        {
+            const auto b = reinterpret_cast<uint8_t*>(buffer);
+            const auto c = reinterpret_cast<uint8_t*>(content);
+            return (uint32_t)(b - c);
+        }
+
+        // Throws if <bytes> bytes at <offset> are not inside the buffer
+        // (the emulated cores would corrupt the heap instead of DRAM)
+        void check(size_t offset, size_t bytes) const
+        {
+            const size_t byteSize = size * sizeof(uint32_t);
+
+            if (offset > byteSize || bytes > byteSize - offset)
+            {
+                throw std::runtime_error("DMA of " + std::to_string(bytes) + " bytes at offset " +
+                    std::to_string(offset) + " is outside of '" + name + "'");
+            }
+        }
+
+        // Protects busyUntil
+        std::mutex busMutex;
+
+        // Time when DRAM finishes all transfers requested so far
+        Clock::time_point busyUntil;
+
+    public:
+        const std::string name;
+        const uint32_t physical;
+        const uint32_t size;
+        uint32_t* const content;
+        const EmuTiming timing;
+
+        // name - name of the emulated device (only used in messages)
+        // byteSize - size of the buffer in bytes
+        // timing - timing parameters of the emulated board
+        EmuDmaBuf(const std::string& name, size_t byteSize, const EmuTiming& timing = EmuTiming()) :
+                name(name),
+                physical(reserve(byteSize)),
+                size(byteSize / sizeof(uint32_t)),
+                content(allocate(name, byteSize)),
+                timing(timing)
+        {
+            auto lock = std::lock_guard<std::mutex>(registryMutex());
+            registry().push_back(this);
+        }
+
+        EmuDmaBuf(const EmuDmaBuf&) = delete;
+
+        // Finds the emulated buffer that contains <physical> address
+        // Returns nullptr if there is no such buffer
+        static EmuDmaBuf* find(uint32_t physical)
+        {
+            auto lock = std::lock_guard<std::mutex>(registryMutex());
+
+            for (auto b : registry())
+            {
+                if (physical >= b->physical && physical - b->physical < b->size * sizeof(uint32_t))
+                    return b;
+            }
+
+            return nullptr;
+        }
+
+        // Cache maintenance is not needed for ordinary memory
+        // (the range is still checked, as the driver of udmabuf does)
+        void syncForCpu(uint32_t* buffer, size_t length) const
+        {
+            check(getOffset(buffer), length * sizeof(uint32_t));
+        }
+
+        void syncForDma(uint32_t* buffer, size_t length) const
+        {
+            check(getOffset(buffer), length * sizeof(uint32_t));
+        }
+
+        uint32_t toPhysical(uint32_t* virt) const
+        {
+            return getOffset(virt) + physical;
+        }
+
+        // Returns the virtual address of <physical> address
+        // Throws if <bytes> bytes from there are not inside the buffer
+        uint32_t* toVirtual(uint32_t physical, size_t bytes = 0) const
+        {
+            check(physical - this->physical, bytes);
+            return content + (physical - this->physical) / sizeof(uint32_t);
+        }
+
+        // Blocks the calling core until DRAM can accept <bytes> more bytes
+        // DRAM bandwidth is shared among all cores writing to this buffer
+        void transfer(size_t bytes)
+        {
+            if (timing.bandwidth <= 0) return;
+
+            const auto duration = std::chrono::duration<double>(bytes / (timing.bandwidth * 1024 * 1024));
+            Clock::time_point finish;
+
+            {
+                auto lock = std::lock_guard<std::mutex>(busMutex);
+                busyUntil = std::max(busyUntil, Clock::now());
+                busyUntil += std::chrono::duration_cast<Clock::duration>(duration);
+                finish = busyUntil;
+            }
+
+            std::this_thread::sleep_until(finish);
+        }
+
+        ~EmuDmaBuf()
+        {
+            {
+                auto lock = std::lock_guard<std::mutex>(registryMutex());
+                auto& r = registry();
+                r.erase(std::remove(r.begin(), r.end(), this), r.end());
+            }
+
+            free(content);
+        }
+    };
+}
\ No newline at end of file
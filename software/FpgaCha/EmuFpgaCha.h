@@ -0,0 +1,650 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <string>
+#include <iostream>
+#include <array>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <stdexcept>
+#include "../ChaCha20/ChaCha20.h"
+#include "ChaCha20Map.h"
+#include "StToMemMap.h"
+#include "EmuDmaBuf.h"
+#include "AdaptiveSpin.h"
+#include "Utilization.h"
+
+namespace FpgaCha
+{
+    // Emulates FpgaCha IP-core in software
+    // Has the same interface as FpgaCha and the same register semantics
+    // Completion is signalled through an eventfd instead of UIO
+    class EmuFpgaCha
+    {
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        // Address offset for ChaCha20 accelerator
+        const uint32_t CHACHA20_OFF = 0x0000;
+
+        // Address offset for S2M adapter
+        const uint32_t ST2MEM_OFF = 0x0100;
+
+        // Word indexes of the emulated registers (see README)
+        static constexpr size_t BCOUNT_REG = 0x0C;
+        static constexpr size_t PAD_COUNTER_REG = 0x10;
+        static constexpr size_t PROBE_REG = 0x12;
+        static constexpr size_t FEATURES_REG = 0x13;
+        static constexpr size_t CYCLES_REG = 0x16;
+        static constexpr size_t BUSY_REG = 0x17;
+        static constexpr size_t STALL_REG = 0x18;
+        static constexpr size_t BLOCKS_REG = 0x19;
+        static constexpr size_t LENGTH_REG = 0x40;
+        static constexpr size_t ADDRESS_REG = 0x41;
+        static constexpr size_t HEAD_REG = 0x45;
+        static constexpr size_t DEPTH_REG = 0x47;
+        static constexpr size_t WRITE_REG = 0x48;
+        static constexpr size_t WAIT_REG = 0x49;
+        static constexpr size_t BEATS_REG = 0x4A;
+
+        // Number of jobs that can be queued in the emulated core
+        static constexpr uint32_t JOB_DEPTH = 16;
+
+        // Number of OTP blocks transferred between timing checks
+        static constexpr uint32_t CHUNK_BLOCKS = 64;
+
+        // Queued job
+        struct Job
+        {
+            uint32_t physical;
+            uint32_t bCount;
+            uint32_t otpCount;
+
+            // Physical address of the plaintext (inline mode only)
+            uint32_t source;
+        };
+
+        // Emulated register space (same size as the UIO mapping)
+        std::array<volatile uint32_t, 0x1000 / sizeof(uint32_t)> registers;
+
+        // Register maps of emulated hw devices
+        ChaCha20Map* const chacha20;
+        StToMemMap* const stToMem;
+
+        // Device name (only used in messages)
+        const std::string name;
+
+        // Emulate the summation stage in the core
+        const bool summation;
+
+        // Used to signal job completion
+        const int descriptor;
+
+        // Protects the fields below
+        std::mutex mutex;
+
+        // Used to wake up the emulated core when a job is queued
+        std::condition_variable cvJob;
+
+        // Used to tell reset() that the emulated core stopped its job
+        std::condition_variable cvIdle;
+
+        // Queued jobs
+        std::deque<Job> jobs;
+
+        // The core is processing a job
+        bool busy = false;
+
+        // The current job is dropped (see reset)
+        bool aborting = false;
+
+        // The core stopped at a job it could not do and ignores the queued ones until reset
+        // (the job is not reported, so the driver sees a hung core and fails it over)
+        bool faulted = false;
+
+        // Number of finished jobs and the last number seen by software
+        uint32_t head = 0;
+        uint32_t ackHead = 0;
+
+        // Number of finished jobs that raises the interrupt
+        uint32_t coalesce = 1;
+
+        // The core encrypts the plaintext read from memory
+        bool inlineMode = false;
+
+        // Interrupt enable flag (UIO disables interrupt after it fires)
+        bool irqEnabled = false;
+
+        bool stopped = false;
+
+        // Number of finished jobs already reported by wait()
+        uint32_t lastHead = 0;
+
+        // Time the emulated core was created, computed jobs and waited for DRAM
+        // and the number of OTP blocks it output (the performance counters are derived from them)
+        const Clock::time_point created = Clock::now();
+        double busyTime = 0;
+        double stallTime = 0;
+        uint32_t blocksDone = 0;
+
+        // Clock frequency of the emulated board
+        double clock = EmuTiming().clock;
+
+        // Polling time before blocking on the interrupt
+        AdaptiveSpin spin;
+
+        // Performance counters accumulated by sample()
+        Utilization utilization;
+
+        // Thread that emulates the core
+        std::thread coreThread;
+
+        static int openEventFd(const std::string& name)
+        {
+            int fd = eventfd(0, 0);
+
+            if (fd < 0)
+            {
+                std::string m = std::string("Error when creating eventfd for '");
+                throw std::runtime_error(m + name + "': " + strerror(errno));
+            }
+
+            return fd;
+        }
+
+        // State of the level-sensitive interrupt line (mutex must be held)
+        bool irqLine() const
+        {
+            const uint32_t pending = head - ackHead;
+            return pending >= coalesce || (pending != 0 && !busy && jobs.empty());
+        }
+
+        // Delivers the interrupt (mutex must be held)
+        void raiseIrq()
+        {
+            irqEnabled = false;
+            const uint64_t one = 1;
+            write(descriptor, &one, sizeof(one));
+        }
+
+        // Enables interrupts for S2M adapter
+        void enableIrq()
+        {
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            irqEnabled = true;
+            if (irqLine()) raiseIrq();
+        }
+
+        // Blocks current thread until ISR from S2M adapter happens
+        void waitForIrq() const
+        {
+            uint64_t result;
+
+            // Wait for interrupt by reading from eventfd
+            const ssize_t length = read(descriptor, &result, sizeof(result));
+
+            // If an error happened
+            if (length != (ssize_t)sizeof(result))
+            {
+                std::string m = "Error when waiting for interrupt from '";
+                throw std::runtime_error(m + name + "': " + strerror(errno));
+            }
+        }
+
+        // Blocks current thread until ISR from S2M adapter happens or <timeout> expires
+        // (microseconds::max() - no timeout)
+        // Returns false if the timeout expired
+        bool waitForIrq(std::chrono::microseconds timeout) const
+        {
+            pollfd p = { descriptor, POLLIN, 0 };
+            const int ms = timeout == std::chrono::microseconds::max() ? -1 : (timeout.count() + 999) / 1000;
+            const int result = ::poll(&p, 1, ms);
+
+            if (result < 0)
+            {
+                std::string m = "Error when waiting for interrupt from '";
+                throw std::runtime_error(m + name + "': " + strerror(errno));
+            }
+
+            if (result == 0) return false;
+            waitForIrq();
+            return true;
+        }
+
+        // Stops the core at the current job (see faulted)
+        // Returns no interrupt latency, the job is not reported
+        std::chrono::microseconds fault(const std::string& message)
+        {
+            std::cerr << name << ": " << message << ", the core stops until reset" << std::endl;
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            faulted = true;
+            return std::chrono::microseconds(0);
+        }
+
+        // Processes one job
+        // Returns the interrupt latency of the emulated board
+        std::chrono::microseconds runJob(const Job& job)
+        {
+            ChaCha20::ChaCha20 chacha20;
+            ChaCha20::State state;
+
+            // Latch the initial state
+            for(int i = 0; i < ChaCha20::State::WORD_SIZE; i++)
+            {
+                state[i] = registers[i];
+            }
+
+            state.bCount[0] = job.bCount;
+            registers[PAD_COUNTER_REG] = job.otpCount;
+            registers[ADDRESS_REG] = job.physical;
+            registers[LENGTH_REG] = job.otpCount * 2;
+
+            // Jobs of encrypt() need the inline mode and the ones of submit() must not have it
+            // (the stream of the hardware would stall or carry plain OTP blocks)
+            bool encrypting;
+            {
+                auto lock = std::lock_guard<std::mutex>(mutex);
+                encrypting = inlineMode;
+            }
+
+            if (job.source != 0 && !encrypting) return fault("encryption job without the inline mode");
+            if (job.source == 0 && encrypting) return fault("OTP job in the inline mode");
+
+            EmuDmaBuf* dram = EmuDmaBuf::find(job.physical);
+            if (dram == nullptr) return fault("DMA to unmapped address " + std::to_string(job.physical));
+
+            // Plaintext (inline mode only)
+            EmuDmaBuf* src = nullptr;
+            if (job.source != 0)
+            {
+                src = EmuDmaBuf::find(job.source);
+                if (src == nullptr) return fault("DMA from unmapped address " + std::to_string(job.source));
+            }
+
+            // The whole job must be inside the buffers
+            const size_t bytes = (size_t)job.otpCount * ChaCha20::State::BYTE_SIZE;
+            const uint32_t* in = nullptr;
+            uint32_t* out;
+
+            try
+            {
+                out = dram->toVirtual(job.physical, bytes);
+                if (src != nullptr) in = src->toVirtual(job.source, bytes);
+            }
+
+            catch (std::runtime_error e)
+            {
+                return fault(e.what());
+            }
+
+            const EmuTiming& timing = dram->timing;
+            const auto blockTime = std::chrono::duration<double>(timing.blockCycles / timing.clock);
+            auto deadline = Clock::now();
+
+            {
+                auto lock = std::lock_guard<std::mutex>(mutex);
+                clock = timing.clock;
+            }
+
+            // Each OTP block is transferred as two 256-bit chunks
+            for(uint32_t done = 0; done < job.otpCount;)
+            {
+                const uint32_t blocks = std::min(job.otpCount - done, CHUNK_BLOCKS);
+                const auto chunkStart = Clock::now();
+
+                for(uint32_t b = 0; b < blocks; b++)
+                {
+                    // 20 rounds with or without the summation stage
+                    if (summation) chacha20.compute(state);
+                    else chacha20.computeRounds(state);
+
+                    // The plaintext is read before the ciphertext is written
+                    // (source and destination can be the same)
+                    for(int j = 0; j < ChaCha20::State::WORD_SIZE; j++)
+                    {
+                        out[j] = in == nullptr ? chacha20.state[j] : chacha20.state[j] ^ in[j];
+                    }
+
+                    out += ChaCha20::State::WORD_SIZE;
+                    if (in != nullptr) in += ChaCha20::State::WORD_SIZE;
+                    state.bCount[0]++;
+                }
+
+                // Take compute time and DRAM bandwidth into account
+                // (the plaintext is read through the same DRAM port)
+                deadline += std::chrono::duration_cast<Clock::duration>(blockTime * blocks);
+                dram->transfer(blocks * ChaCha20::State::BYTE_SIZE * (in == nullptr ? 1 : 2));
+                std::this_thread::sleep_until(deadline);
+                done += blocks;
+
+                // The core waited for DRAM if the chunk took longer than its computation
+                {
+                    const double elapsed = std::chrono::duration<double>(Clock::now() - chunkStart).count();
+                    auto lock = std::lock_guard<std::mutex>(mutex);
+                    busyTime += elapsed;
+                    stallTime += std::max(elapsed - blockTime.count() * blocks, 0.0);
+                    blocksDone += blocks;
+
+                    // The adapter stops after the chunk it was writing
+                    if (aborting) return std::chrono::microseconds(0);
+                }
+
+                // Update registers the same way the hardware does
+                // (the data must be visible before the new address)
+                std::atomic_thread_fence(std::memory_order_release);
+                registers[BCOUNT_REG] = state.bCount[0];
+                registers[PAD_COUNTER_REG] = job.otpCount - done;
+                registers[ADDRESS_REG] = job.physical + done * ChaCha20::State::BYTE_SIZE;
+                registers[LENGTH_REG] = (job.otpCount - done) * 2;
+            }
+
+            return timing.irqLatency;
+        }
+
+    public:
+        // name - name of the emulated device (only used in messages)
+        // summation - emulate a core that does the summation stage
+        EmuFpgaCha(const std::string& name, bool summation = true) :
+                chacha20((ChaCha20Map*)((uint8_t*)registers.data() + CHACHA20_OFF)),
+                stToMem((StToMemMap*)((uint8_t*)registers.data() + ST2MEM_OFF)),
+                name(name),
+                summation(summation),
+                descriptor(openEventFd(name))
+        {
+            for(auto& r : registers) r = 0;
+            registers[PROBE_REG] = 0xfb7e03d9;
+            registers[FEATURES_REG] = (summation ? 1 : 0) | 2 | 4 | 1 << 8 | 1 << 16 | JOB_DEPTH << 24;
+            registers[DEPTH_REG] = JOB_DEPTH | 2 << 8 | 1 << 16 | 1 << 17;
+
+            coreThread = std::thread([this]()
+            {
+                while(true)
+                {
+                    Job job;
+
+                    // Wait for a queued job
+                    {
+                        auto lock = std::unique_lock<std::mutex>(mutex);
+                        cvJob.wait(lock, [&]{ return (!jobs.empty() && !faulted) || stopped; });
+                        if (stopped) break;
+                        job = jobs.front();
+                        jobs.pop_front();
+                        busy = true;
+                    }
+
+                    const auto irqLatency = runJob(job);
+
+                    // Report the finished job (polling sees it right away)
+                    // Aborted and failed jobs are not reported
+                    {
+                        auto lock = std::lock_guard<std::mutex>(mutex);
+                        busy = false;
+                        if (!aborting && !faulted) head++;
+                        registers[HEAD_REG] = head;
+                    }
+
+                    cvIdle.notify_all();
+
+                    // The interrupt arrives later
+                    std::this_thread::sleep_for(irqLatency);
+
+                    {
+                        auto lock = std::lock_guard<std::mutex>(mutex);
+                        if (irqEnabled && irqLine()) raiseIrq();
+                    }
+                }
+            });
+        }
+
+        EmuFpgaCha(const EmuFpgaCha&) = delete;
+
+        // Sets encryption parameters
+        void setState(ChaCha20::State& s) const
+        {
+            chacha20->setState(s);
+        }
+
+        // Tells whether OTP blocks are produced with the summation stage
+        bool hasSummation() const
+        {
+            return chacha20->hasSummation();
+        }
+
+        // Tells whether the core answers with the probe constant
+        bool probe() const
+        {
+            return chacha20->probe();
+        }
+
+        // Returns the number of jobs that can be submitted before waiting
+        uint32_t depth() const
+        {
+            return JOB_DEPTH;
+        }
+
+        // Stops the job in flight and drops the queued ones, so the core can be used again
+        // Returns false if the emulated core does not stop within <timeout>
+        // (it may still write to the buffers of the jobs in flight then)
+        bool reset(std::chrono::microseconds timeout)
+        {
+            auto lock = std::unique_lock<std::mutex>(mutex);
+            jobs.clear();
+            aborting = true;
+            if (!cvIdle.wait_for(lock, timeout, [&]{ return !busy; })) return false;
+
+            // Forget the jobs finished while the core was considered hung
+            // and the interrupt they raised
+            aborting = false;
+            faulted = false;
+            lastHead = ackHead = head;
+            registers[PAD_COUNTER_REG] = 0;
+            registers[LENGTH_REG] = 0;
+
+            pollfd p = { descriptor, POLLIN, 0 };
+            if (::poll(&p, 1, 0) > 0) waitForIrq();
+            return true;
+        }
+
+        // Switches between producing OTP blocks and encrypting the plaintext
+        // read from memory (should only be called if no jobs are in flight)
+        void setInline(bool enable)
+        {
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            inlineMode = enable;
+        }
+
+        // Asks the core to raise one interrupt per <jobs> finished jobs
+        // The interrupt is also raised when the core runs out of jobs
+        void setCoalesce(uint32_t jobs)
+        {
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            coalesce = std::max<uint32_t>(jobs, 1);
+        }
+
+        // Asks the core to generate <otpCount> OTP blocks starting from
+        // block count <bCount> and place them starting from emulated physical address <physical>
+        // At most depth() jobs can be in flight
+        void submit(uint32_t physical, uint32_t bCount, uint32_t otpCount)
+        {
+            {
+                auto lock = std::lock_guard<std::mutex>(mutex);
+                jobs.push_back(Job{ physical, bCount, otpCount, 0 });
+            }
+
+            cvJob.notify_one();
+        }
+
+        // Asks the core to encrypt <otpCount> OTP blocks worth of plaintext read from
+        // emulated physical address <source> using OTP blocks starting from block count <bCount>
+        // and place the ciphertext starting from emulated physical address <physical>
+        // Works only in the inline mode (the core stops otherwise, see faulted),
+        // at most depth() jobs can be in flight
+        void encrypt(uint32_t source, uint32_t physical, uint32_t bCount, uint32_t otpCount)
+        {
+            {
+                auto lock = std::lock_guard<std::mutex>(mutex);
+                jobs.push_back(Job{ physical, bCount, otpCount, source });
+            }
+
+            cvJob.notify_one();
+        }
+
+        // Makes wait() poll the registers for up to <maxSpin> before blocking
+        // on the interrupt (0 - interrupts only)
+        void setPolling(std::chrono::microseconds maxSpin)
+        {
+            spin.setLimit(maxSpin);
+        }
+
+        // Returns the file descriptor that becomes readable when the interrupt fires
+        // (lets one thread wait for several cores, see armIrq and handleIrq)
+        int irqDescriptor() const
+        {
+            return descriptor;
+        }
+
+        // Enables the interrupt, so irqDescriptor() becomes readable
+        // when jobs are finished (right away if they are already finished)
+        void armIrq()
+        {
+            enableIrq();
+        }
+
+        // Consumes the interrupt once irqDescriptor() is readable
+        // Returns the number of finished jobs (they finish in submission order)
+        uint32_t handleIrq()
+        {
+            waitForIrq();
+            return poll();
+        }
+
+        // Returns the number of finished jobs without blocking
+        // (they finish in submission order)
+        uint32_t poll()
+        {
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            const uint32_t finished = head - lastHead;
+            lastHead = ackHead = head;
+            return finished;
+        }
+
+        // Adds the emulated performance counters since the previous call to utilization
+        // (the adapter is busy and waits for DRAM together with the accelerator)
+        void sample()
+        {
+            {
+                auto lock = std::lock_guard<std::mutex>(mutex);
+                const double elapsed = std::chrono::duration<double>(Clock::now() - created).count();
+                const uint32_t busyCycles = (uint64_t)(busyTime * clock);
+                const uint32_t stallCycles = (uint64_t)(stallTime * clock);
+                registers[CYCLES_REG] = (uint32_t)(uint64_t)(elapsed * clock);
+                registers[BUSY_REG] = busyCycles;
+                registers[STALL_REG] = stallCycles;
+                registers[WRITE_REG] = busyCycles;
+                registers[WAIT_REG] = stallCycles;
+                registers[BLOCKS_REG] = blocksDone;
+                registers[BEATS_REG] = blocksDone * 2;
+            }
+
+            utilization.sample(chacha20, stToMem);
+        }
+
+        // Returns the performance counters accumulated by sample()
+        const Utilization& getUtilization() const
+        {
+            return utilization;
+        }
+
+        // Returns the number of OTP blocks of the oldest unfinished job that are
+        // already in memory (the job starts at emulated physical address <physical>)
+        uint32_t progress(uint32_t physical, uint32_t otpCount) const
+        {
+            const uint32_t address = registers[ADDRESS_REG];
+            const uint32_t bytes = otpCount * ChaCha20::State::BYTE_SIZE;
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            // The core may still point to the end of the previous job
+            // (it is the end of this buffer if the previous job used it too)
+            if (address < physical || address - physical >= bytes) return 0;
+            return (address - physical) / ChaCha20::State::BYTE_SIZE;
+        }
+
+        // Blocks current thread until at least one submitted job is finished
+        // or <timeout> expires (microseconds::max() - no timeout)
+        // Returns the number of finished jobs (they finish in submission order), 0 on timeout
+        uint32_t wait(std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            const auto start = Clock::now();
+
+            // Time left before the timeout expires
+            auto left = [&]()
+            {
+                if (timeout == std::chrono::microseconds::max()) return timeout;
+                const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+                return std::max(timeout - elapsed, std::chrono::microseconds(0));
+            };
+
+            if (spin.enabled())
+            {
+                const uint32_t finished = spin.run([&]{ return poll(); });
+                if (finished != 0) return finished;
+            }
+
+            while(true)
+            {
+                uint32_t finished;
+
+                // Report finished jobs and deassert the interrupt
+                {
+                    auto lock = std::lock_guard<std::mutex>(mutex);
+                    finished = head - lastHead;
+                    lastHead = ackHead = head;
+                }
+
+                if (finished != 0) return finished;
+
+                enableIrq();
+                if (!waitForIrq(left())) return 0;
+            }
+        }
+
+        ~EmuFpgaCha()
+        {
+            {
+                auto lock = std::lock_guard<std::mutex>(mutex);
+                stopped = true;
+            }
+
+            cvJob.notify_one();
+            coreThread.join();
+            close(descriptor);
+        }
+    };
+}
\ No newline at end of file
@@ -22,13 +22,20 @@
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 #include "LinuxDevice.h"
+#include "AdaptiveSpin.h"
 #include "ChaCha20Map.h"
 #include "StToMemMap.h"
+#include "MemToStMap.h"
+#include "Utilization.h"
 
 namespace FpgaCha
 {
@@ -42,12 +49,19 @@ namespace FpgaCha
         // Address offset for S2M adapter
         const uint32_t ST2MEM_OFF = 0x0100;
         
+        // Address offset for M2S adapter
+        const uint32_t MEM2ST_OFF = 0x0200;
+        
+        // Period of polling the adapters while they abort their jobs
+        static constexpr std::chrono::microseconds ABORT_INTERVAL{10};
+        
         // UIO device
         const LinuxDevice device;
         
         // Register maps of hw devices
         ChaCha20Map* const chacha20;
         StToMemMap* const stToMem;
+        MemToStMap* const memToSt;
         
         // Enables interrupts for S2M adapter
         void enableIrq() const
@@ -81,13 +95,78 @@ namespace FpgaCha
                 throw std::runtime_error(m + device.name + "': " + strerror(errno));
             } 
         }
+        
+        // Blocks current thread until ISR from S2M adapter happens or <timeout> expires
+        // (microseconds::max() - no timeout)
+        // Returns false if the timeout expired
+        bool waitForIrq(std::chrono::microseconds timeout) const
+        {
+            pollfd p = { device.descriptor, POLLIN, 0 };
+            const int ms = timeout == std::chrono::microseconds::max() ? -1 : (timeout.count() + 999) / 1000;
+            const int result = ::poll(&p, 1, ms);
+            
+            if (result < 0)
+            {
+                std::string m = "Error when waiting for interrupt from '";
+                throw std::runtime_error(m + device.name + "': " + strerror(errno));
+            }
+            
+            if (result == 0) return false;
+            waitForIrq();
+            return true;
+        }
+
+        // Returns the number of jobs that can be queued in the core
+        uint32_t readDepth() const
+        {
+            const uint32_t d = chacha20->jobDepth();
+            return d == 0 ? 1 : std::min(d, stToMem->depth());
+        }
+        
+        // Asks FpgaCha to generate <otpCount> OTP blocks and place
+        // them starting from physical address <physical>
+        // (used with cores that cannot queue jobs)
+        void start(uint32_t physical, uint32_t otpCount) const
+        {
+            stToMem->clearIrq();
+            chacha20->start(otpCount);
+            if (!spin.enabled()) enableIrq();
+            stToMem->start(physical, otpCount * 2);
+        }
+        
+        // Number of jobs that can be queued in the core (1 if there is no job queue)
+        uint32_t jobDepth;
+        
+        // The core encrypts the plaintext read from memory
+        bool inlineMode = false;
+        
+        // Number of finished jobs already reported by wait()
+        uint32_t lastHead = 0;
+        
+        // Polling time before blocking on the interrupt
+        // (the interrupt is only enabled while blocking in the polling mode)
+        AdaptiveSpin spin;
+        
+        // Performance counters accumulated by sample()
+        Utilization utilization;
 
     public:
         // name - UIO file name of FpgaCha device
         FpgaCha(const std::string& name) : 
                 device(LinuxDevice(name, "uio", "maps/map0/size")),
                 chacha20((ChaCha20Map*)((uint8_t*)device.mapping + CHACHA20_OFF)),
-                stToMem((StToMemMap*)((uint8_t*)device.mapping + ST2MEM_OFF)) { }
+                stToMem((StToMemMap*)((uint8_t*)device.mapping + ST2MEM_OFF)),
+                memToSt((MemToStMap*)((uint8_t*)device.mapping + MEM2ST_OFF)),
+                jobDepth(readDepth())
+        {
+            // Forget jobs finished before we started
+            if (jobDepth > 1)
+            {
+                lastHead = stToMem->head();
+                stToMem->acknowledge(lastHead);
+                stToMem->setCoalesce(1);
+            }
+        }
         
         // Sets encryption parameters
         void setState(ChaCha20::State& s) const
@@ -95,20 +174,251 @@ namespace FpgaCha
             chacha20->setState(s);
         }
         
-        // Asks FpgaCha to generate <otpCount> OTP blocks and place
-        // them starting from physical address <physical>
-        void start(uint32_t physical, uint32_t otpCount) const
+        // Tells whether OTP blocks are produced with the summation stage
+        bool hasSummation() const
+        {
+            return chacha20->hasSummation();
+        }
+        
+        // Tells whether the core answers with the probe constant
+        // (tells a hung job from a core that is gone)
+        bool probe() const
+        {
+            return chacha20->probe();
+        }
+        
+        // Stops the jobs in flight and drops the queued ones, so the core can be used again
+        // ChaCha20 accelerator stops at once, the adapters finish the DRAM bursts they started
+        // Returns false if the adapters cannot abort or do not stop within <timeout>
+        // (they may still write to the buffers of the jobs in flight then)
+        bool reset(std::chrono::microseconds timeout)
+        {
+            chacha20->stop();
+            if (!stToMem->canAbort()) return false;
+            
+            if (inlineMode) memToSt->abort();
+            stToMem->abort();
+            
+            const auto deadline = std::chrono::steady_clock::now() + timeout;
+            while(stToMem->aborting() || (inlineMode && memToSt->aborting()))
+            {
+                if (std::chrono::steady_clock::now() >= deadline) return false;
+                std::this_thread::sleep_for(ABORT_INTERVAL);
+            }
+            
+            // Forget the jobs finished while the core was considered hung
+            // and the interrupt they raised
+            if (jobDepth > 1)
+            {
+                lastHead = stToMem->head();
+                stToMem->acknowledge(lastHead);
+            }
+            
+            else stToMem->clearIrq();
+            
+            pollfd p = { device.descriptor, POLLIN, 0 };
+            if (::poll(&p, 1, 0) > 0) waitForIrq();
+            return true;
+        }
+        
+        // Returns the number of jobs that can be submitted before waiting
+        uint32_t depth() const
+        {
+            return jobDepth;
+        }
+        
+        // Switches between producing OTP blocks and encrypting the plaintext
+        // read from memory (should only be called if no jobs are in flight)
+        void setInline(bool enable)
+        {
+            if (enable && !memToSt->test())
+            {
+                std::string m = "FpgaCha device '";
+                throw std::runtime_error(m + device.name + "' cannot encrypt inline");
+            }
+            
+            if (enable || inlineMode) memToSt->setXor(enable);
+            inlineMode = enable;
+            jobDepth = readDepth();
+            
+            // The reader queues jobs the same way S2M adapter does
+            if (enable && jobDepth > 1) jobDepth = std::min(jobDepth, memToSt->depth());
+        }
+        
+        // Asks the core to raise one interrupt per <jobs> finished jobs
+        // The interrupt is also raised when the core runs out of jobs
+        void setCoalesce(uint32_t jobs)
+        {
+            if (jobDepth > 1) stToMem->setCoalesce(jobs);
+        }
+        
+        // Makes wait() poll the registers for up to <maxSpin> before blocking
+        // on the interrupt, which saves two syscalls and the wakeup delay per job
+        // (0 - interrupts only, should only be called if no jobs are in flight)
+        void setPolling(std::chrono::microseconds maxSpin)
+        {
+            spin.setLimit(maxSpin);
+        }
+        
+        // Asks FpgaCha to generate <otpCount> OTP blocks starting from
+        // block count <bCount> and place them starting from physical address <physical>
+        // At most depth() jobs can be in flight
+        void submit(uint32_t physical, uint32_t bCount, uint32_t otpCount)
+        {
+            if (jobDepth > 1)
+            {
+                chacha20->queue(bCount, otpCount);
+                stToMem->queue(physical, otpCount * 2);
+            }
+            
+            else
+            {
+                chacha20->setBCount(bCount);
+                start(physical, otpCount);
+            }
+        }
+        
+        // Asks FpgaCha to encrypt <otpCount> OTP blocks worth of plaintext read from
+        // physical address <source> using OTP blocks starting from block count <bCount>
+        // and place the ciphertext starting from physical address <physical>
+        // (<source> and <physical> can be the same)
+        // Works only in the inline mode, at most depth() jobs can be in flight
+        void encrypt(uint32_t source, uint32_t physical, uint32_t bCount, uint32_t otpCount)
+        {
+            if (jobDepth > 1) memToSt->queue(source, otpCount * 2);
+            else memToSt->start(source, otpCount * 2);
+            
+            submit(physical, bCount, otpCount);
+        }
+        
+        // Returns the file descriptor that becomes readable when the interrupt fires
+        // (lets one thread wait for several cores, see armIrq and handleIrq)
+        int irqDescriptor() const
+        {
+            return device.descriptor;
+        }
+        
+        // Enables the interrupt, so irqDescriptor() becomes readable
+        // when jobs are finished (right away if they are already finished)
+        void armIrq() const
         {
-            stToMem->clearIrq();
-            chacha20->start(otpCount);
             enableIrq();
-            stToMem->start(physical, otpCount * 2);
         }
         
-        // Blocks current thread until the computation is finished
-        void wait() const
+        // Consumes the interrupt once irqDescriptor() is readable
+        // Returns the number of finished jobs (they finish in submission order)
+        uint32_t handleIrq()
         {
             waitForIrq();
+            
+            if (jobDepth == 1)
+            {
+                stToMem->clearIrq();
+                return 1;
+            }
+            
+            return poll();
+        }
+        
+        // Returns the number of finished jobs without blocking
+        // (they finish in submission order)
+        uint32_t poll()
+        {
+            if (jobDepth == 1)
+            {
+                if (!stToMem->irqPending()) return 0;
+                
+                // Consume the interrupt of the finished job (if it was enabled)
+                if (!spin.enabled()) waitForIrq();
+                stToMem->clearIrq();
+                return 1;
+            }
+            
+            const uint32_t head = stToMem->head();
+            const uint32_t finished = head - lastHead;
+            
+            if (finished != 0)
+            {
+                lastHead = head;
+                stToMem->acknowledge(head);
+            }
+            
+            return finished;
+        }
+        
+        // Adds the performance counters of the core since the previous call to utilization
+        // (must be called more often than the counters wrap around, e.g. after every wait)
+        void sample()
+        {
+            utilization.sample(chacha20, stToMem);
+        }
+        
+        // Returns the performance counters accumulated by sample()
+        const Utilization& getUtilization() const
+        {
+            return utilization;
+        }
+        
+        // Returns the number of OTP blocks of the oldest unfinished job that are
+        // already in memory (the job starts at physical address <physical>)
+        // Writes of S2M adapter are followed through its ADDRESS register
+        uint32_t progress(uint32_t physical, uint32_t otpCount) const
+        {
+            const uint32_t address = stToMem->address();
+            const uint32_t bytes = otpCount * ChaCha20::State::BYTE_SIZE;
+            
+            // The adapter may still point to the end of the previous job
+            // (it is the end of this buffer if the previous job used it too)
+            if (address < physical || address - physical >= bytes) return 0;
+            return (address - physical) / ChaCha20::State::BYTE_SIZE;
+        }
+        
+        // Blocks current thread until at least one submitted job is finished
+        // or <timeout> expires (microseconds::max() - no timeout)
+        // Returns the number of finished jobs (they finish in submission order), 0 on timeout
+        uint32_t wait(std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            const auto start = std::chrono::steady_clock::now();
+            
+            // Time left before the timeout expires
+            auto left = [&]()
+            {
+                if (timeout == std::chrono::microseconds::max()) return timeout;
+                const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+                return std::max(timeout - elapsed, std::chrono::microseconds(0));
+            };
+            
+            if (spin.enabled())
+            {
+                const uint32_t finished = spin.run([&]{ return poll(); });
+                if (finished != 0) return finished;
+            }
+            
+            if (jobDepth == 1)
+            {
+                // The interrupt request stays asserted until the next job is started
+                if (spin.enabled()) enableIrq();
+                return waitForIrq(left()) ? 1 : 0;
+            }
+            
+            while(true)
+            {
+                const uint32_t head = stToMem->head();
+                
+                // Report finished jobs and deassert the interrupt
+                if (head != lastHead)
+                {
+                    const uint32_t finished = head - lastHead;
+                    lastHead = head;
+                    stToMem->acknowledge(head);
+                    return finished;
+                }
+                
+                // The interrupt is level-sensitive, so it fires right away
+                // if jobs were finished after reading the head
+                enableIrq();
+                if (!waitForIrq(left())) return 0;
+            }
         }
     };
 }
\ No newline at end of file
@@ -97,6 +97,22 @@ namespace FpgaCha
             }
         }
         
+        // Opens a property for writing it many times (see pwrite)
+        // The caller closes the returned descriptor
+        int openProperty(const std::string& property) const
+        {
+            const std::string fileName = "/sys/class/" + clazz + "/" + name + "/" + property;
+            int fd = open(fileName.c_str(), O_WRONLY);
+            
+            if (fd < 0)
+            {
+                std::string m = std::string("Error when opening '");
+                throw std::runtime_error(m + fileName + "': " + strerror(errno));
+            }
+            
+            return fd;
+        }
+        
         void writeProperty(const std::string& property, const std::string& content) const
         {
             const std::string fileName = "/sys/class/" + clazz + "/" + name + "/" + property;
@@ -0,0 +1,89 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+namespace FpgaCha
+{
+    // Register map of M2S adapter
+    struct MemToStMap
+    {
+    private:
+        volatile uint32_t _length;
+        volatile uint32_t _address;
+        volatile uint32_t _control;
+        volatile uint32_t _descAddress;
+        volatile uint32_t _descLength;
+        volatile uint32_t _depth;
+        volatile uint32_t _fifoDepth;
+        volatile uint32_t _probe;
+
+    public:
+        // Value of PROBE register
+        static const uint32_t PROBE = 0x3c5a96e1;
+        
+        // Tells whether the adapter is present
+        bool test() const volatile
+        {
+            return _probe == PROBE;
+        }
+        
+        // Enables or disables XOR of OTP blocks with the plaintext
+        // (OTP blocks are passed through if disabled)
+        void setXor(bool enable) volatile
+        {
+            _control = enable ? 1 : 0;
+        }
+        
+        // Drops the queued jobs and the plaintext once the requested bursts arrive
+        // (XOR stays enabled or disabled)
+        void abort() volatile
+        {
+            _control = (_control & 1) | 2;
+        }
+        
+        // Tells whether the adapter may still read for the aborted job
+        bool aborting() const volatile
+        {
+            return _control & 2;
+        }
+        
+        // Starts reading the plaintext from <address>
+        // Reads <length> 256-bit items
+        void start(uint32_t address, uint32_t length) volatile
+        {
+            _address = address;
+            _length = length;
+        }
+        
+        // Queues reading <length> 256-bit items from <address>
+        void queue(uint32_t address, uint32_t length) volatile
+        {
+            _descAddress = address;
+            _descLength = length;
+        }
+        
+        // Returns the number of jobs that can be queued
+        uint32_t depth() const volatile
+        {
+            return _depth;
+        }
+    };
+}
\ No newline at end of file
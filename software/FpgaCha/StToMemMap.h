@@ -32,6 +32,20 @@ namespace FpgaCha
         volatile uint32_t _length;
         volatile uint32_t _address;
         volatile uint32_t _irq;
+        volatile uint32_t _descAddress;
+        volatile uint32_t _descLength;
+        volatile uint32_t _head;
+        volatile uint32_t _coalesce;
+        volatile uint32_t _depth;
+        volatile uint32_t _busyCycles;
+        volatile uint32_t _waitCycles;
+        volatile uint32_t _beats;
+        volatile uint32_t _abort;
+        
+        // Bits of DEPTH register telling that the performance counters are present
+        // and that the jobs can be aborted
+        static const uint32_t COUNTERS = 1 << 16;
+        static const uint32_t ABORT = 1 << 17;
 
     public:
         // Starts moving data to <address>
@@ -42,10 +56,110 @@ namespace FpgaCha
             _length = length;
         }
         
+        // Returns the number of 256-bit items not yet written
+        uint32_t length() const volatile
+        {
+            return _length;
+        }
+        
+        // Returns the address of the next 256-bit item to be written
+        uint32_t address() const volatile
+        {
+            return _address;
+        }
+        
+        // Tells whether the interrupt request is asserted
+        bool irqPending() const volatile
+        {
+            return _irq & 1;
+        }
+        
         // Clears pending interrupt
         void clearIrq() volatile
         {
             _irq = 0;
         }
+        
+        // Queues moving <length> 256-bit items to <address>
+        void queue(uint32_t address, uint32_t length) volatile
+        {
+            _descAddress = address;
+            _descLength = length;
+        }
+        
+        // Returns the number of finished jobs (wraps around)
+        uint32_t head() const volatile
+        {
+            return _head;
+        }
+        
+        // Tells the adapter that software has seen <head> finished jobs
+        // Deasserts the coalesced interrupt
+        void acknowledge(uint32_t head) volatile
+        {
+            _irq = head;
+        }
+        
+        // Raise the interrupt once <jobs> jobs are finished
+        // or when the adapter runs out of jobs
+        void setCoalesce(uint32_t jobs) volatile
+        {
+            _coalesce = jobs;
+        }
+        
+        // Returns the number of jobs that can be queued
+        uint32_t depth() const volatile
+        {
+            return _depth & 0xFF;
+        }
+        
+        // Returns the number of 256-bit items written in one burst
+        uint32_t burstLength() const volatile
+        {
+            return (_depth >> 8) & 0xFF;
+        }
+        
+        // Tells whether the adapter has performance counters
+        bool hasCounters() const volatile
+        {
+            return _depth & COUNTERS;
+        }
+        
+        // Tells whether the jobs can be aborted (also by M2S adapter)
+        bool canAbort() const volatile
+        {
+            return _depth & ABORT;
+        }
+        
+        // Drops the queued jobs and the current one once its burst is written
+        // Aborted jobs are not counted in the head
+        void abort() volatile
+        {
+            _abort = 1;
+        }
+        
+        // Tells whether the adapter may still write the aborted job
+        bool aborting() const volatile
+        {
+            return _abort & 1;
+        }
+        
+        // Returns the number of cycles the adapter had a job to transfer (wraps around)
+        uint32_t busyCycles() const volatile
+        {
+            return _busyCycles;
+        }
+        
+        // Returns the number of cycles a write waited for DRAM (wraps around)
+        uint32_t waitCycles() const volatile
+        {
+            return _waitCycles;
+        }
+        
+        // Returns the number of 256-bit items written (wraps around)
+        uint32_t beats() const volatile
+        {
+            return _beats;
+        }
     };
 }
\ No newline at end of file
@@ -24,6 +24,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdio.h>
 #include <string>
 #include <fstream>
 #include <stdexcept>
@@ -36,12 +37,36 @@ namespace FpgaCha
     private:
         const LinuxDevice device;
         
+        // Sysfs files for cache maintenance (kept open, so a sync is one syscall)
+        const int syncForCpuFile;
+        const int syncForDmaFile;
+        
         uint32_t getOffset(uint32_t* buffer) const
         {
             const auto b = reinterpret_cast<uint8_t*>(buffer);
             const auto c = reinterpret_cast<uint8_t*>(content);
             return (uint32_t)(b - c);
         }
+        
+        // Asks udmabuf to sync <length> words starting from <buffer>
+        // direction - 1 for CPU, 2 for device
+        void sync(int file, uint32_t* buffer, size_t length, int direction) const
+        {
+            const uint32_t syncOffset = getOffset(buffer);
+            const uint32_t syncSize = length * sizeof(uint32_t);
+            
+            // Offset and size with flags as two 8-digit hex numbers
+            char command[24];
+            const int commandLength = snprintf(command, sizeof(command), "0x%08x%08x",
+                syncOffset, (syncSize & 0xFFFFFFF0) | (direction << 2) | 1);
+            
+            // Sysfs files are always written from the beginning
+            if (pwrite(file, command, commandLength, 0) != commandLength)
+            {
+                std::string m = "Error when syncing '";
+                throw std::runtime_error(m + device.name + "': " + strerror(errno));
+            }
+        }
 
     public:
         const uint32_t physical;
@@ -50,43 +75,33 @@ namespace FpgaCha
 
         UDmaBuf(const std::string& name) : 
                 device(LinuxDevice(name, "udmabuf", "size", false)),
+                syncForCpuFile(device.openProperty("sync_for_cpu")),
+                syncForDmaFile(device.openProperty("sync_for_device")),
                 physical(device.readProperty("phys_addr")),
                 size(device.size / sizeof(uint32_t)),
                 content(reinterpret_cast<uint32_t*>(device.mapping)) { }
-                
+        
+        UDmaBuf(const UDmaBuf&) = delete;
+        
         void syncForCpu(uint32_t* buffer, size_t length) const
         {
-            const int syncDirection = 1;
-            const uint32_t syncOffset = getOffset(buffer);
-            const uint32_t syncSize = length * sizeof(uint32_t);
-           
-            std::stringstream sstream;
-            sstream << "0x" << std::hex;
-            sstream << std::setw(8) << std::setfill('0') << syncOffset;
-            sstream << std::setw(8) << std::setfill('0');
-            sstream << ((syncSize & 0xFFFFFFF0) | (syncDirection << 2) | 1);
-            
-            device.writeProperty("sync_for_cpu", sstream.str());
+            sync(syncForCpuFile, buffer, length, 1);
         }
         
         void syncForDma(uint32_t* buffer, size_t length) const
         {
-            const int syncDirection = 2;
-            const uint32_t syncOffset = getOffset(buffer);
-            const uint32_t syncSize = length * sizeof(uint32_t);
-           
-            std::stringstream sstream;
-            sstream << "0x" << std::hex;
-            sstream << std::setw(8) << std::setfill('0') << syncOffset;
-            sstream << std::setw(8) << std::setfill('0');
-            sstream << ((syncSize & 0xFFFFFFF0) | (syncDirection << 2) | 1);
-            
-            device.writeProperty("sync_for_device", sstream.str());
+            sync(syncForDmaFile, buffer, length, 2);
         }
         
         uint32_t toPhysical(uint32_t* virt) const
         {
             return getOffset(virt) + physical;
         }
+        
+        ~UDmaBuf()
+        {
+            close(syncForCpuFile);
+            close(syncForDmaFile);
+        }
     };
 }
\ No newline at end of file
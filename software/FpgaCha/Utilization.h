@@ -0,0 +1,141 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include "ChaCha20Map.h"
+#include "StToMemMap.h"
+
+namespace FpgaCha
+{
+    // Utilization of a core accumulated from the performance counters of
+    // ChaCha20 accelerator and S2M adapter
+    // The counters are 32 bits wide and wrap around in about 85 seconds at 50 MHz,
+    // so they must be sampled more often than that (e.g. once per finished job)
+    class Utilization
+    {
+    public:
+        enum Counter
+        {
+            // All cycles, cycles ChaCha20 accelerator had work, cycles its output waited
+            CYCLES, BUSY, STALL,
+
+            // Cycles S2M adapter had a job, cycles a write waited for DRAM
+            WRITE, WAIT,
+
+            // OTP blocks output and 256-bit chunks written
+            BLOCKS, BEATS,
+
+            COUNTERS
+        };
+
+        // Counts since the first sample
+        std::array<uint64_t, COUNTERS> totals = {};
+
+    private:
+        // Counter values at the previous sample
+        std::array<uint32_t, COUNTERS> last = {};
+        bool sampled = false;
+
+        // Share of <part> in <whole> in percent
+        static double percent(uint64_t part, uint64_t whole)
+        {
+            return whole == 0 ? 0 : 100.0 * part / whole;
+        }
+
+    public:
+        // Tells whether the core has counters and was sampled
+        bool available() const
+        {
+            return sampled;
+        }
+
+        // Adds the counts since the previous sample (nothing if the core has no counters)
+        void sample(const volatile ChaCha20Map* chacha20, const volatile StToMemMap* stToMem)
+        {
+            if (!chacha20->hasCounters() || !stToMem->hasCounters()) return;
+
+            const std::array<uint32_t, COUNTERS> values
+            {{
+                chacha20->cycles(), chacha20->busyCycles(), chacha20->stallCycles(),
+                stToMem->busyCycles(), stToMem->waitCycles(),
+                chacha20->blocks(), stToMem->beats()
+            }};
+
+            // The difference is right when a counter wraps around once
+            if (sampled)
+            {
+                for(size_t i = 0; i < COUNTERS; i++) totals[i] += (uint32_t)(values[i] - last[i]);
+            }
+
+            last = values;
+            sampled = true;
+        }
+
+        Utilization& operator+=(const Utilization& u)
+        {
+            for(size_t i = 0; i < COUNTERS; i++) totals[i] += u.totals[i];
+            sampled = sampled || u.sampled;
+            return *this;
+        }
+
+        // Tells what limits the core: "compute" if the accelerator rarely waits for
+        // its output to be taken, "DRAM" if it does and the writes wait for DRAM,
+        // "S2M" if it does and the adapter is the bottleneck itself
+        std::string bound() const
+        {
+            if (totals[BUSY] == 0) return "idle";
+            if (totals[STALL] * 2 < totals[BUSY]) return "compute";
+            return totals[WAIT] * 4 >= totals[WRITE] ? "DRAM" : "S2M";
+        }
+
+        // Prints the header of the table printed by print()
+        static void printHeader(std::ostream& o)
+        {
+            o << std::left << std::setw(24) << "core" << std::right << std::setw(10) << "MiB";
+            o << std::setw(8) << "busy" << std::setw(10) << "stalled" << std::setw(12) << "DRAM wait";
+            o << std::setw(12) << "cycles/blk" << std::setw(10) << "bound" << std::endl;
+        }
+
+        // Prints one line of the table
+        // busy - share of all cycles the accelerator had work
+        // stalled - share of the busy cycles the accelerator output waited for the adapter
+        // DRAM wait - share of the cycles the adapter had a job that writes waited for DRAM
+        void print(std::ostream& o, const std::string& name) const
+        {
+            o << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(1);
+
+            if (!sampled)
+            {
+                o << std::setw(10) << "-" << "  the core has no performance counters" << std::endl;
+                return;
+            }
+
+            o << std::setw(10) << totals[BEATS] * 32 / (1024.0 * 1024);
+            o << std::setw(7) << percent(totals[BUSY], totals[CYCLES]) << "%";
+            o << std::setw(9) << percent(totals[STALL], totals[BUSY]) << "%";
+            o << std::setw(11) << percent(totals[WAIT], totals[WRITE]) << "%";
+            o << std::setw(12) << std::setprecision(2) << (totals[BLOCKS] == 0 ? 0 : (double)totals[BUSY] / totals[BLOCKS]);
+            o << std::setw(10) << bound() << std::endl;
+        }
+    };
+}
\ No newline at end of file
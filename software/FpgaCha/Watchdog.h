@@ -0,0 +1,84 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <algorithm>
+
+namespace FpgaCha
+{
+    // Decides how long to wait for the jobs of a core before they are considered hung
+    // The timeout follows the time per OTP block measured while the control thread waited
+    // for the core, so it scales with the jobs waited for and with the speed of the core
+    class Watchdog
+    {
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        // Jobs may take this many times longer than expected (DRAM contention, preemption)
+        static constexpr double SLACK = 8;
+
+        // Timeout before the time per block is measured and the shortest timeout
+        static constexpr std::chrono::microseconds FIRST_TIMEOUT{1000000};
+        static constexpr std::chrono::microseconds MIN_TIMEOUT{50000};
+
+        // Time per block assumed at least (64 MB/s, well below a core writing to busy DRAM),
+        // so a few fast jobs do not make the timeout of long jobs too short
+        static constexpr double MIN_PER_BLOCK = 1;
+
+        // Shorter waits are not measured (the jobs were mostly finished before the wait)
+        static constexpr std::chrono::microseconds MIN_SAMPLE{100};
+
+        // Recent time per block in microseconds (0 - not measured yet)
+        double perBlock = 0;
+
+        // Time of the last completion and of the start of the current wait
+        // The core is only known to work on the finished jobs since the later of them
+        // (the control thread may have been blocked while the core was idle)
+        Clock::time_point since;
+        Clock::time_point waitStart;
+
+    public:
+        // Tells that the control thread starts waiting for jobs
+        void waiting()
+        {
+            waitStart = Clock::now();
+        }
+
+        // Tells that jobs of <blocks> OTP blocks in total were finished
+        void finished(uint64_t blocks)
+        {
+            const auto now = Clock::now();
+            const auto elapsed = now - std::max(since, waitStart);
+            since = now;
+            if (blocks == 0 || elapsed < MIN_SAMPLE) return;
+
+            const double time = std::chrono::duration<double, std::micro>(elapsed).count() / blocks;
+            perBlock = perBlock == 0 ? time : perBlock + (time - perBlock) / 8;
+        }
+
+        // Returns how long to wait for jobs of <blocks> OTP blocks in total
+        // (grows with the blocks even before the time per block is measured)
+        std::chrono::microseconds timeout(uint64_t blocks) const
+        {
+            const std::chrono::microseconds expected((int64_t)(std::max(perBlock, MIN_PER_BLOCK) * blocks * SLACK));
+            return std::max(expected, perBlock == 0 ? FIRST_TIMEOUT : MIN_TIMEOUT);
+        }
+    };
+}
\ No newline at end of file
@@ -0,0 +1,526 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+#include "BlockingQueue.h"
+#include "ChaCha20/ChaCha20.h"
+#include "ChaCha20/BCount.h"
+#include "ChaCha20/State.h"
+#include "FpgaCha/FpgaCha.h"
+#include "FpgaCha/UDmaBuf.h"
+#include "FpgaCha/EmuFpgaCha.h"
+#include "FpgaCha/EmuDmaBuf.h"
+#include "FpgaCha/DmaPool.h"
+#include "FpgaCha/Watchdog.h"
+#include "OtpTask.h"
+#include "TaskManager.h"
+#include "Trace.h"
+#include "Profile.h"
+#include "Placement.h"
+#include "Budget.h"
+
+// Drives several FpgaCha IP-cores from one thread
+// The thread waits for the interrupts of all cores with epoll and gives
+// the next task to whichever core finishes a job
+// Does the same work as one FpgaChaWorker per core with fewer threads
+// N - number of tasks in the system (should match to that of TaskManager and Cryptor)
+// T - number of threads to do the summation stage in software for all cores (1 is enough)
+//     (not used if every core does the summation stage itself)
+// C - interface to the cores (FpgaCha::FpgaCha or FpgaCha::EmuFpgaCha)
+// B - DMA buffer type (FpgaCha::UDmaPool or FpgaCha::EmuDmaPool)
+//     (should have room for a few more tasks, in case a core hangs and does not stop)
+template <size_t N, size_t T, typename C = FpgaCha::FpgaCha, typename B = FpgaCha::UDmaPool>
+class FpgaChaReactor
+{
+private:
+    typedef std::chrono::steady_clock Clock;
+    
+    // Period of checking for new tasks while some cores have free job slots (ms)
+    static constexpr int REFILL_INTERVAL = 1;
+    
+    // A core is not used anymore after it did not finish its jobs in time this many times
+    static constexpr size_t MAX_HANGS = 3;
+    
+    // Time a core has to stop its jobs when it is reset
+    static constexpr std::chrono::microseconds RESET_TIMEOUT{10000};
+    
+    // One FpgaCha core and its jobs
+    struct Core
+    {
+        // UIO device file name
+        const std::string name;
+        
+        // Interface to FpgaCha core
+        C fpgaCha;
+        
+        // Tasks submitted to the core (they finish in this order)
+        std::deque<OtpTask> inFlight;
+        
+        // Number of jobs that can be in flight
+        size_t depth;
+        
+        // Number of jobs that raise one interrupt
+        size_t coalesce;
+        
+        // The core does the summation stage itself
+        bool hasSummation;
+        
+        // The interrupt is enabled and not handled yet
+        bool armed = false;
+        
+        // Time from finished jobs to the next submitted one
+        Placement::Resubmission resubmission;
+        
+        // Time limit for the jobs in flight, the time it expires and whether it is running
+        FpgaCha::Watchdog watchdog;
+        std::chrono::microseconds timeout;
+        Clock::time_point deadline;
+        bool timed = false;
+        
+        // Number of times the core did not finish its jobs in time
+        size_t hangs = 0;
+        
+        // The core is not used anymore
+        bool retired = false;
+        
+        Core(const std::string& devFile) :
+                name(devFile),
+                fpgaCha(devFile),
+                depth(fpgaCha.depth()),
+                coalesce(std::max<size_t>(depth / 2, 1)),
+                hasSummation(fpgaCha.hasSummation()),
+                resubmission("FpgaChaReactor " + devFile) { }
+        
+        // Returns the number of OTP blocks of the oldest <jobs> jobs in flight
+        uint64_t blocksInFlight(size_t jobs)
+        {
+            uint64_t blocks = 0;
+            for(size_t i = 0; i < jobs; i++) blocks += inFlight[i].getOtpCount();
+            return blocks;
+        }
+    };
+    
+    // Cores (deque does not move them when growing)
+    std::deque<Core> cores;
+    
+    // Queue to connect the reactor thread to the summation threads
+    BlockingQueue<OtpTask, N> queue;
+    
+    // Waits for the interrupts of all cores
+    int epollDescriptor;
+    
+    // Threads
+    std::thread reactorThread;
+    std::thread summationThread[T];
+    
+    static int createEpoll()
+    {
+        const int fd = epoll_create1(0);
+        
+        if (fd < 0)
+        {
+            std::string m = "Error when creating epoll instance: ";
+            throw std::runtime_error(m + strerror(errno));
+        }
+        
+        return fd;
+    }
+    
+    // Adds the interrupt of core <i> to the epoll set
+    void watch(size_t i)
+    {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        
+        if (epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, cores[i].fpgaCha.irqDescriptor(), &event) != 0)
+        {
+            std::string m = "Error when waiting for interrupts of '";
+            throw std::runtime_error(m + cores[i].name + "': " + strerror(errno));
+        }
+    }
+
+public:
+    // m - task manager
+    // s - encryption parameters
+    // devFiles - FpgaCha UIO device file full names
+    // uDmaBuff - DMA buffers that are used as storage in tasks (new ones are taken
+    //            from it if a core does not stop, see FpgaCha::reset)
+    FpgaChaReactor(
+        TaskManager<N>& m,
+        const ChaCha20::State& s,
+        const std::vector<std::string>& devFiles,
+        B& uDmaBuff) :
+        epollDescriptor(createEpoll())
+    {
+        bool needsSummation = false;
+        
+        try
+        {
+            for(size_t i = 0; i < devFiles.size(); i++)
+            {
+                cores.emplace_back(devFiles[i]);
+                watch(i);
+                needsSummation |= !cores[i].hasSummation;
+            }
+        }
+        
+        catch (...)
+        {
+            close(epollDescriptor);
+            throw;
+        }
+        
+        // Thread controlling all cores
+        reactorThread = std::thread([&]()
+        {
+            Trace::nameThread("FpgaChaReactor");
+            Placement::place(Placement::CONTROL);
+            OtpTask task;
+            ChaCha20::State state = s;
+            std::vector<epoll_event> events(cores.size());
+            
+            // Hands <finished> finished jobs of core <c> over
+            // Returns false on shutdown
+            auto complete = [&](Core& c, uint32_t finished)
+            {
+                c.watchdog.finished(c.blocksInFlight(finished));
+                c.timed = false;
+                c.resubmission.finished();
+                
+                for(uint32_t n = finished; n > 0; n--)
+                {
+                    task = c.inFlight.front();
+                    c.inFlight.pop_front();
+                    Trace::endJob("FpgaCha job", task.id);
+                    
+                    // Transfer ownership of the buffer to CPU
+                    {
+                        Trace::Span span("syncForCpu", task.id);
+                        uDmaBuff.syncForCpu(task.buffer, task.length);
+                    }
+                    
+                    // The task is complete if the core did the summation stage
+                    // Otherwise send the result to the summation threads
+                    if (c.hasSummation ? !m.finishTask(task) : !queue.push(task)) return false;
+                }
+                
+                return true;
+            };
+            
+            // Handles the jobs of core <c> that did not finish in time (see FpgaCha::Watchdog)
+            // The core is reset and the tasks it has not finished are reissued, so another core
+            // or a software worker takes them. If the core did not stop, they are moved to new
+            // buffers from the DMA pool first, the old ones may still be written and are never used again
+            // The core is used again if it stopped and answers the probe, until it hangs MAX_HANGS times
+            // Returns false on shutdown
+            auto failover = [&](Core& c)
+            {
+                const bool quiet = c.fpgaCha.reset(RESET_TIMEOUT);
+                const bool probed = c.fpgaCha.probe();
+                c.retired = !(quiet && probed && ++c.hangs < MAX_HANGS);
+                c.timed = false;
+                c.armed = false;
+                
+                std::cerr << "FpgaCha core '" << c.name << "' did not finish task " << c.inFlight.front().id;
+                std::cerr << " in " << c.timeout.count() / 1000 << " ms (" << (probed ? "probe OK" : "probe failed");
+                std::cerr << (quiet ? ", reset" : ", did not stop") << "), its tasks are reissued";
+                std::cerr << (c.retired ? " and it is not used anymore" : "") << std::endl;
+                
+                // A retired core does not wake the reactor up anymore
+                if (c.retired) epoll_ctl(epollDescriptor, EPOLL_CTL_DEL, c.fpgaCha.irqDescriptor(), nullptr);
+                
+                for(; !c.inFlight.empty(); c.inFlight.pop_front())
+                {
+                    OtpTask& t = c.inFlight.front();
+                    Trace::endJob("FpgaCha job", t.id);
+                    
+                    if (!quiet)
+                    {
+                        try
+                        {
+                            t.buffer = uDmaBuff.allocate(t.length);
+                        }
+                        
+                        catch (const std::runtime_error& e)
+                        {
+                            throw std::runtime_error("FpgaCha core '" + c.name + "' did not stop and its tasks cannot be moved: " + e.what());
+                        }
+                        
+                        Placement::lock(t.buffer, t.length * sizeof(uint32_t));
+                    }
+                    
+                    if (!m.reissueTask(t)) return false;
+                }
+                
+                return true;
+            };
+            
+            // Key and nonce are shared by all jobs, block count is set per job
+            // Get an interrupt when half of the job queue is free to refill it in time
+            for(auto& c : cores)
+            {
+                c.fpgaCha.setState(state);
+                c.fpgaCha.setCoalesce(c.coalesce);
+                
+                // Hardware counters are sampled after every wait, so they do not wrap around unnoticed
+                if (Profile::enabled()) c.fpgaCha.sample();
+            }
+            
+            // Main loop
+            while(true)
+            {
+                bool stopped = false;
+                bool starving = false;
+                
+                // Compute the tasks in software until shutdown once no core is used
+                if (std::all_of(cores.begin(), cores.end(), [](const Core& k){ return k.retired; }))
+                {
+                    ChaCha20::ChaCha20 chacha20;
+                    
+                    while(m.performTask(task))
+                    {
+                        Trace::Span span("chacha20", task.id);
+                        task.getBCount(s.bCount, state.bCount);
+                        
+                        for(size_t i = 0; i < task.length; i += ChaCha20::State::WORD_SIZE)
+                        {
+                            chacha20.compute(state);
+                            
+                            for(int j = 0; j < ChaCha20::State::WORD_SIZE; j++)
+                            {
+                                task.buffer[i + j] = chacha20.state[j];
+                            }
+                            
+                            state.bCount[0]++;
+                        }
+                        
+                        if (!m.finishTask(task)) break;
+                    }
+                    
+                    queue.shutdown();
+                    break;
+                }
+                
+                // Keep the job queues of all cores full
+                // Block waiting for a task only if no core has anything to do
+                for(auto& c : cores)
+                {
+                    while(c.inFlight.size() < c.depth && !starving && !c.retired)
+                    {
+                        const bool idle = std::all_of(cores.begin(), cores.end(),
+                            [](const Core& k){ return k.inFlight.empty(); });
+                        
+                        if (idle)
+                        {
+                            // Waiting for a task does not count as resubmission latency
+                            if (!m.tryPerformTask(task))
+                            {
+                                for(auto& k : cores) k.resubmission.cancel();
+                                
+                                // Exit on shutdown condition
+                                stopped = !m.performTask(task);
+                                if (stopped) break;
+                            }
+                        }
+                        
+                        else if (!m.tryPerformTask(task)) starving = true;
+                        
+                        if (starving) break;
+                        
+                        // Calculate block count
+                        task.getBCount(s.bCount, state.bCount);
+                        
+                        // Transfer ownership of the buffer to hardware
+                        {
+                            Trace::Span span("syncForDma", task.id);
+                            uDmaBuff.syncForDma(task.buffer, task.length);
+                        }
+                        
+                        // Queue FpgaCha computation (written by the core and by the summation thread)
+                        Budget::take(Budget::JOBS, task.length * sizeof(uint32_t) * (c.hasSummation ? 1 : 3), task.id);
+                        const uint32_t physical = uDmaBuff.toPhysical(task.buffer);
+                        c.fpgaCha.submit(physical, state.bCount[0], task.getOtpCount());
+                        c.resubmission.submitted();
+                        c.inFlight.push_back(task);
+                        Trace::beginJob("FpgaCha job", task.id);
+                    }
+                    
+                    if (stopped) break;
+                }
+                
+                // Ask busy cores for an interrupt and start their watchdogs
+                // (again after every completion, with the jobs that raise the next interrupt)
+                for(auto& c : cores)
+                {
+                    if (stopped || c.inFlight.empty()) continue;
+                    
+                    if (!c.timed)
+                    {
+                        c.timeout = c.watchdog.timeout(c.blocksInFlight(std::min(c.inFlight.size(), c.coalesce)));
+                        c.watchdog.waiting();
+                        c.deadline = Clock::now() + c.timeout;
+                        c.timed = true;
+                    }
+                    
+                    if (c.armed) continue;
+                    c.fpgaCha.armIrq();
+                    c.armed = true;
+                }
+                
+                // Sleep until some of the jobs are finished or the first watchdog expires
+                // Wake up from time to time if there may be new tasks for idle job slots
+                int ready = 0;
+                
+                if (!stopped)
+                {
+                    int wait = starving ? REFILL_INTERVAL : -1;
+                    const auto now = Clock::now();
+                    
+                    for(auto& c : cores)
+                    {
+                        if (!c.timed) continue;
+                        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(c.deadline - now + std::chrono::microseconds(999));
+                        const int ms = std::max<int>(left.count(), 0);
+                        wait = wait < 0 ? ms : std::min(wait, ms);
+                    }
+                    
+                    Trace::Span span("epoll_wait");
+                    ready = epoll_wait(epollDescriptor, events.data(), events.size(), wait);
+                    
+                    if (ready < 0 && errno != EINTR)
+                    {
+                        std::string m = "Error when waiting for interrupts: ";
+                        throw std::runtime_error(m + strerror(errno));
+                    }
+                }
+                
+                if (Profile::enabled())
+                {
+                    for(auto& c : cores) c.fpgaCha.sample();
+                }
+                
+                for(int e = 0; e < ready && !stopped; e++)
+                {
+                    Core& c = cores[events[e].data.u32];
+                    c.armed = false;
+                    
+                    const uint32_t finished = c.fpgaCha.handleIrq();
+                    if (finished > 0) stopped = !complete(c, finished);
+                }
+                
+                // Check the watchdogs of the cores that did not report their jobs
+                const auto now = Clock::now();
+                for(auto& c : cores)
+                {
+                    if (stopped || !c.timed || now < c.deadline) continue;
+                    
+                    // The interrupt may be lost or held back by coalescing, otherwise the core hangs
+                    const uint32_t finished = c.fpgaCha.poll();
+                    c.armed = c.armed && finished == 0;
+                    stopped = finished > 0 ? !complete(c, finished) : !failover(c);
+                }
+                
+                // Exit on shutdown condition
+                if (stopped)
+                {
+                    queue.shutdown();
+                    break;
+                }
+            }
+            
+            if (Profile::enabled())
+            {
+                for(auto& c : cores) Profile::addCore(c.name, c.fpgaCha.getUtilization());
+            }
+        });
+        
+        // Summation thread
+        auto summationRoutine = [&]()
+        {
+            Trace::nameThread("FpgaChaReactor summation");
+            Placement::place(Placement::SUMMATION);
+            OtpTask task;
+            ChaCha20::State state = s;
+            
+            // Main loop
+            while(true)
+            {
+                // Wait for a task to arrive
+                // Exit on shutdown condition
+                if (!queue.pop(task)) break;
+                
+                // Calculate block count
+                task.getBCount(s.bCount, state.bCount);
+                
+                // Do the summation stage
+                {
+                    Trace::Span span("summation", task.id);
+                    
+                    for(int i = 0; i < task.length; i += ChaCha20::State::WORD_SIZE)
+                    {
+                        for(int j = 0; j < ChaCha20::State::WORD_SIZE; j++)
+                        {
+                            task.buffer[i + j] += state[j];
+                        }
+                        
+                        state.bCount[0]++;
+                    }
+                }
+                
+                // Send the result to the queue of finished tasks
+                // Exit on shutdown condition
+                if (!m.finishTask(task))
+                {
+                    queue.shutdown();
+                    break;
+                }
+            }
+        };
+        
+        // Start T summation threads if some core does not do the summation stage
+        for(int i = 0; i < T && needsSummation; i++)
+        {
+            summationThread[i] = std::thread(summationRoutine);
+        }
+    }
+    
+    // Destroy
+    ~FpgaChaReactor()
+    {
+        reactorThread.join();
+        for(int i = 0; i < T; i++)
+        {
+            if (summationThread[i].joinable()) summationThread[i].join();
+        }
+        
+        close(epollDescriptor);
+    }
+};
\ No newline at end of file
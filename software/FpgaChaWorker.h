@@ -18,122 +18,551 @@
 #pragma once
 
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <algorithm>
 #include <iostream>
+#include <stdexcept>
 #include "BlockingQueue.h"
 #include "ChaCha20/BCount.h"
 #include "ChaCha20/State.h"
 #include "FpgaCha/FpgaCha.h"
+#include "FpgaCha/UDmaBuf.h"
+#include "FpgaCha/EmuFpgaCha.h"
+#include "FpgaCha/EmuDmaBuf.h"
+#include "FpgaCha/DmaPool.h"
+#include "FpgaCha/Watchdog.h"
 #include "OtpTask.h"
 #include "TaskManager.h"
+#include "Trace.h"
+#include "Profile.h"
+#include "Placement.h"
+#include "Verify.h"
+#include "Budget.h"
 
 // Worker that produces ChaCha20 OTP blocks using FpgaCha IP-core
 // N - number of tasks in the system (should match to that of TaskManager and Cryptor)
 // T - number of threads to do the summation stage in software (1 is enough)
-template <size_t N, size_t T>
+//     (not used if the core does the summation stage itself)
+// C - interface to the core (FpgaCha::FpgaCha or FpgaCha::EmuFpgaCha)
+// B - DMA buffer type (FpgaCha::UDmaPool or FpgaCha::EmuDmaPool)
+//     (should have room for a few more tasks, in case the core hangs and does not stop)
+template <size_t N, size_t T, typename C = FpgaCha::FpgaCha, typename B = FpgaCha::UDmaPool>
 class FpgaChaWorker
 {
 private: 
+    // The first part of a task is passed to the cryptor when 1/PROGRESS_PARTS of it is complete
+    static constexpr size_t PROGRESS_PARTS = 8;
+    
+    // The core is not used anymore after it did not finish its jobs in time this many times
+    static constexpr size_t MAX_HANGS = 3;
+    
+    // Time the core has to stop its jobs when it is reset
+    static constexpr std::chrono::microseconds RESET_TIMEOUT{10000};
+    
+    // Period of polling the progress of the current job
+    static constexpr std::chrono::microseconds PROGRESS_INTERVAL{100};
+    
+    // Words <from> to <to> of a task handed from the control thread to the summation
+    // or verifier thread (the parts of a task arrive in order)
+    // verify - the words were written by the core, so they are checked (see Verify)
+    struct Part
+    {
+        OtpTask task;
+        size_t from;
+        size_t to;
+        bool verify;
+    };
+    
     // Interface to FpgaCha core
-    FpgaCha::FpgaCha fpgaCha;
+    C fpgaCha;
     
-    // Queue to connect the FpgaCha control thread to the summation thread
-    BlockingQueue<OtpTask, 1> queue;
+    // Queue to connect the FpgaCha control thread to the summation or verifier threads
+    // (it holds every part of all tasks, so the control thread does not wait for them)
+    BlockingQueue<Part, N * (PROGRESS_PARTS + 1)> queue;
     
     // Encryption parameters
     ChaCha20::State state;
     
+    // The core does the summation stage itself
+    const bool hasSummation;
+    
+    // Jobs are checked by the summation or verifier threads before they are passed on
+    const bool verifying;
+    
+    // A wrong block was found, the control thread stops using the core
+    std::atomic<bool> faulty { false };
+    
     // Thread
     std::thread roundsThread;
     std::thread summationThread[T];
     
+    // Blocks until some of the jobs are finished or <timeout> expires
+    // Meanwhile passes complete parts of the current job (<task>) to the cryptor
+    // published - number of words of <task> already passed to the cryptor
+    // Returns the number of finished jobs (they finish in submission order), 0 on timeout
+    uint32_t waitWithProgress(TaskManager<N>& m, const B& uDmaBuff, OtpTask& task, size_t& published, std::chrono::microseconds timeout)
+    {
+        const size_t part = std::max<size_t>(task.length / PROGRESS_PARTS, ChaCha20::State::WORD_SIZE);
+        const uint32_t physical = uDmaBuff.toPhysical(task.buffer);
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        
+        // Block on the interrupt when there is no part left to pass before the end of the job
+        while(published + part < task.length)
+        {
+            const uint32_t finished = fpgaCha.poll();
+            if (finished != 0) return finished;
+            
+            // Words that S2M adapter has already written
+            const size_t ready = fpgaCha.progress(physical, task.getOtpCount()) * ChaCha20::State::WORD_SIZE;
+            
+            if (ready < published + part)
+            {
+                if (std::chrono::steady_clock::now() >= deadline) return 0;
+                std::this_thread::sleep_for(PROGRESS_INTERVAL);
+                continue;
+            }
+            
+            // Transfer ownership of the complete part to CPU
+            {
+                Trace::Span span("syncForCpu", task.id);
+                uDmaBuff.syncForCpu(task.buffer + published, ready - published);
+            }
+            
+            // The job will be finished anyway, shutdown is handled when it is reported
+            // (if jobs are verified, the verifier thread passes the part on once it is checked)
+            Part p { task, published, ready, true };
+            published = ready;
+            if (!(verifying ? queue.push(p) : m.publishTask(task, published))) break;
+        }
+        
+        const auto now = std::chrono::steady_clock::now();
+        return fpgaCha.wait(now < deadline ? std::chrono::duration_cast<std::chrono::microseconds>(deadline - now) : std::chrono::microseconds(0));
+    }
+    
 public:
     // m - task manager
     // s - encryption parameters
     // devFile - FpgaCha UIO device file full name
-    // uDmaBuff - uDmaBuff that is used as storage in tasks
+    // uDmaBuff - DMA buffers that are used as storage in tasks (new ones are taken
+    //            from it if the core does not stop, see FpgaCha::reset)
+    // spin - time to poll the core for finished jobs before blocking on the interrupt
+    //        (0 - interrupts only, see FpgaCha::setPolling)
     FpgaChaWorker(
         TaskManager<N>& m, 
         const ChaCha20::State& s, 
         const std::string& devFile,
-        const FpgaCha::UDmaBuf& uDmaBuff) : 
-        fpgaCha(FpgaCha::FpgaCha(devFile))
+        B& uDmaBuff,
+        std::chrono::microseconds spin = std::chrono::microseconds(0)) : 
+        fpgaCha(devFile),
+        hasSummation(fpgaCha.hasSummation()),
+        verifying(Verify::share() > 0)
     { 
+        fpgaCha.setPolling(spin);
+        
+        // Name of the threads in the trace (devFile may not outlive the constructor)
+        const std::string traceName = "FpgaChaWorker " + devFile;
+        const std::string coreName = devFile;
+        
         // FpgaCha controlling thread
-        roundsThread = std::thread([&]()
+        roundsThread = std::thread([&, traceName, coreName]()
         {
+            Trace::nameThread(traceName);
+            Placement::place(Placement::CONTROL);
             OtpTask task;
             ChaCha20::State state = s;
             
+            // Tasks submitted to the core (they finish in this order)
+            std::deque<OtpTask> inFlight;
+            const size_t depth = fpgaCha.depth();
+            
+            // Number of words of the oldest task in flight already passed to the cryptor
+            size_t published = 0;
+            
+            // Task prepared while the core is busy, so it can be submitted right
+            // after the interrupt (its buffer is already owned by hardware)
+            OtpTask staged;
+            uint32_t stagedBCount = 0;
+            bool hasStaged = false;
+            
+            // Calculates block count of <t> and transfers ownership of its buffer to hardware
+            // Returns the block count
+            auto prepare = [&](OtpTask& t)
+            {
+                Trace::Span span("syncForDma", t.id);
+                t.getBCount(s.bCount, state.bCount);
+                uDmaBuff.syncForDma(t.buffer, t.length);
+                return state.bCount[0];
+            };
+            
+            // Time from finished jobs to the next submitted one
+            Placement::Resubmission resubmission(traceName);
+            
+            // Time limit for the jobs in flight
+            FpgaCha::Watchdog watchdog;
+            
+            // Returns the number of OTP blocks of the oldest <jobs> jobs in flight
+            auto blocksInFlight = [&](size_t jobs)
+            {
+                uint64_t blocks = 0;
+                for(size_t i = 0; i < jobs; i++) blocks += inFlight[i].getOtpCount();
+                return blocks;
+            };
+            
+            // Queues FpgaCha computation
+            // The core writes the task once, the summation thread reads and writes it again
+            auto submit = [&](OtpTask& t, uint32_t bCount)
+            {
+                Budget::take(Budget::JOBS, t.length * sizeof(uint32_t) * (hasSummation ? 1 : 3), t.id);
+                const uint32_t physical = uDmaBuff.toPhysical(t.buffer);
+                fpgaCha.submit(physical, bCount, t.getOtpCount());
+                resubmission.submitted();
+                inFlight.push_back(t);
+                Trace::beginJob("FpgaCha job", t.id);
+            };
+            
+            // Hands the words of <t> from <from> on over to the summation or verifier thread
+            // (after the parts handed over before), or completes <t> if there is none
+            // fromCore - the words were written by the core (they are checked if jobs are verified)
+            // Returns false on shutdown
+            auto deliver = [&](OtpTask& t, size_t from, bool fromCore)
+            {
+                if (hasSummation && !verifying) return m.finishTask(t);
+                Part p { t, from, t.length, fromCore && verifying };
+                return queue.push(p);
+            };
+            
+            // Computes the blocks of <t> from word <from> on in software the same way the core does
+            // (the checks are done by the summation or verifier threads, this one only computes)
+            Verify::Checker software(coreName);
+            
+            auto recompute = [&](OtpTask& t, size_t from)
+            {
+                Trace::Span span("chacha20", t.id);
+                ChaCha20::State v = s;
+                t.getBCount(s.bCount, v.bCount);
+                v.bCount[0] += from / ChaCha20::State::WORD_SIZE;
+                software.recompute(t.buffer + from, (t.length - from) / ChaCha20::State::WORD_SIZE, v, hasSummation);
+            };
+            
+            // Computes all tasks in software until shutdown (once the core is not used)
+            auto computeInSoftware = [&]()
+            {
+                while(m.performTask(task))
+                {
+                    recompute(task, 0);
+                    if (!deliver(task, 0, false)) return;
+                }
+            };
+            
+            // Number of times the core did not finish its jobs in time
+            size_t hangs = 0;
+            
+            // Moves <t> to a new buffer from the DMA pool, because the core that did not stop
+            // may still write to the old one, which is never used again
+            auto relocate = [&](OtpTask& t)
+            {
+                try
+                {
+                    t.buffer = uDmaBuff.allocate(t.length);
+                }
+                
+                catch (const std::runtime_error& e)
+                {
+                    throw std::runtime_error("FpgaCha core '" + coreName + "' did not stop and its tasks cannot be moved: " + e.what());
+                }
+                
+                Placement::lock(t.buffer, t.length * sizeof(uint32_t));
+            };
+            
+            // Stops using the core after a summation or verifier thread found a wrong block
+            // (that thread recomputes the parts it already has)
+            // The core is reset, the rest of the jobs in flight and the staged task are recomputed
+            // in software, and so are all tasks until shutdown
+            // If the core did not stop, the unfinished jobs are moved to new buffers (see relocate),
+            // except the oldest one if part of it is with the cryptor already (see failover)
+            auto quarantine = [&]()
+            {
+                const bool quiet = fpgaCha.reset(RESET_TIMEOUT);
+                if (hasStaged) inFlight.push_back(staged);
+                hasStaged = false;
+                
+                for(; !inFlight.empty(); inFlight.pop_front())
+                {
+                    OtpTask& t = inFlight.front();
+                    Trace::endJob("FpgaCha job", t.id);
+                    uDmaBuff.syncForCpu(t.buffer + published, t.length - published);
+                    
+                    if (!quiet && published > 0)
+                    {
+                        OtpTask moved = t;
+                        relocate(moved);
+                        m.retireBuffer(t, moved.buffer);
+                    }
+                    
+                    else if (!quiet) relocate(t);
+                    
+                    const size_t from = published;
+                    published = 0;
+                    recompute(t, from);
+                    if (!deliver(t, from, false)) return;
+                }
+                
+                computeInSoftware();
+            };
+            
+            // Handles the jobs that did not finish within <timeout> (see FpgaCha::Watchdog)
+            // The core is reset and re-probed to tell a hung job from a core that is gone
+            // The tasks it has not finished and the staged task are reissued, so another core or
+            // a software worker takes them. If the core did not stop, its unfinished tasks are
+            // moved to new buffers first (see relocate)
+            // The core is used again if it stopped and answers the probe, until it hangs MAX_HANGS times
+            // Returns false if the core is not used anymore (this thread computes tasks
+            // in software until shutdown then) or on shutdown
+            auto failover = [&](std::chrono::microseconds timeout)
+            {
+                const bool quiet = fpgaCha.reset(RESET_TIMEOUT);
+                const bool probed = fpgaCha.probe();
+                const bool reuse = quiet && probed && ++hangs < MAX_HANGS;
+                
+                std::cerr << "FpgaCha core '" << coreName << "' did not finish task " << inFlight.front().id;
+                std::cerr << " in " << timeout.count() / 1000 << " ms (" << (probed ? "probe OK" : "probe failed");
+                std::cerr << (quiet ? ", reset" : ", did not stop") << "), its tasks are reissued";
+                std::cerr << (reuse ? "" : " and computed in software from now on") << std::endl;
+                
+                // The first part of the oldest task may be with the cryptor already, so it is completed here
+                // (in the same buffer, the core can only write the same blocks to it)
+                if (published > 0)
+                {
+                    OtpTask t = inFlight.front();
+                    inFlight.pop_front();
+                    Trace::endJob("FpgaCha job", t.id);
+                    uDmaBuff.syncForCpu(t.buffer + published, t.length - published);
+                    const size_t from = published;
+                    published = 0;
+                    recompute(t, from);
+                    
+                    // The cryptor schedules the task again with a new buffer
+                    if (!quiet)
+                    {
+                        OtpTask moved = t;
+                        relocate(moved);
+                        m.retireBuffer(t, moved.buffer);
+                    }
+                    
+                    if (!deliver(t, from, false)) return false;
+                }
+                
+                for(; !inFlight.empty(); inFlight.pop_front())
+                {
+                    OtpTask& t = inFlight.front();
+                    Trace::endJob("FpgaCha job", t.id);
+                    if (!quiet) relocate(t);
+                    if (!m.reissueTask(t)) return false;
+                }
+                
+                // The staged task was not submitted yet
+                if (hasStaged && !m.reissueTask(staged)) return false;
+                hasStaged = false;
+                
+                if (reuse) return true;
+                computeInSoftware();
+                return false;
+            };
+            
+            // Key and nonce are shared by all jobs, block count is set per job
+            fpgaCha.setState(state);
+            
+            // Get an interrupt when half of the job queue is free to refill it in time
+            const size_t coalesce = std::max<size_t>(depth / 2, 1);
+            fpgaCha.setCoalesce(coalesce);
+            
+            // Hardware counters are sampled after every wait, so they do not wrap around unnoticed
+            if (Profile::enabled()) fpgaCha.sample();
+            
             // Main loop
             while(true)
             {
-                // Wait for a task to arrive
-                // Exit on shutdown condition
-                if (!m.performTask(task))
+                bool stopped = false;
+                
+                // Keep the job queue of the core full (the staged task goes first)
+                // Block waiting for a task only if the core has nothing to do
+                while(inFlight.size() < depth)
                 {
-                    queue.shutdown();
-                    break;
+                    if (hasStaged)
+                    {
+                        submit(staged, stagedBCount);
+                        hasStaged = false;
+                        continue;
+                    }
+                    
+                    if (inFlight.empty())
+                    {
+                        // Waiting for a task does not count as resubmission latency
+                        if (!m.tryPerformTask(task))
+                        {
+                            resubmission.cancel();
+                            
+                            // Exit on shutdown condition
+                            stopped = !m.performTask(task);
+                            if (stopped) break;
+                        }
+                    }
+                    
+                    else if (!m.tryPerformTask(task)) break;
+                    
+                    submit(task, prepare(task));
                 }
                 
-                // Calculate block count
-                task.getBCount(s.bCount, state.bCount);
+                // Prepare the next task while the core is busy
+                if (!stopped && !hasStaged && m.tryPerformTask(staged))
+                {
+                    stagedBCount = prepare(staged);
+                    hasStaged = true;
+                }
                 
-                // Transfer ownership of the buffer to hardware
-                uDmaBuff.syncForDma(task.buffer, task.length);
+                // Sleep until some of the jobs are finished or the watchdog expires
+                // If the core does the summation stage, the oldest job is consumed while it is running
+                uint32_t n = 0;
+                if (!stopped)
+                {
+                    Trace::Span span("wait");
+                    const auto timeout = watchdog.timeout(blocksInFlight(std::min(inFlight.size(), coalesce)));
+                    watchdog.waiting();
+                    n = hasSummation ? waitWithProgress(m, uDmaBuff, inFlight.front(), published, timeout) : fpgaCha.wait(timeout);
+                    if (n > 0) watchdog.finished(blocksInFlight(n));
+                    
+                    // The interrupt may be lost or held back by coalescing, otherwise the core hangs
+                    if (n == 0) n = fpgaCha.poll();
+                    if (n == 0) stopped = !failover(timeout);
+                }
+                
+                if (Profile::enabled()) fpgaCha.sample();
+                if (n > 0) resubmission.finished();
+                
+                // Keep the core busy while the finished jobs are handed over
+                if (hasStaged && n > 0 && inFlight.size() - n < depth)
+                {
+                    submit(staged, stagedBCount);
+                    hasStaged = false;
+                }
                 
-                // Start FpgaCha computation and sleep until it is finished
-                const uint32_t physical = uDmaBuff.toPhysical(task.buffer);
-                fpgaCha.setState(state);
-                fpgaCha.start(physical, task.getOtpCount());
-                fpgaCha.wait();
+                for(; n > 0 && !stopped; n--)
+                {
+                    task = inFlight.front();
+                    inFlight.pop_front();
+                    Trace::endJob("FpgaCha job", task.id);
+                    
+                    // Transfer ownership of the rest of the buffer to CPU
+                    if (published < task.length)
+                    {
+                        Trace::Span span("syncForCpu", task.id);
+                        uDmaBuff.syncForCpu(task.buffer + published, task.length - published);
+                    }
+                    
+                    const size_t from = published;
+                    published = 0;
+                    
+                    // The task is complete if the core did the summation stage and jobs are not verified
+                    // Otherwise send the rest of it to the summation or verifier thread
+                    stopped = !deliver(task, from, true);
+                }
                 
-                // Transfer ownership of the buffer to CPU
-                uDmaBuff.syncForCpu(task.buffer, task.length);
+                // The core is not used anymore once a sampled block is wrong
+                if (!stopped && faulty)
+                {
+                    quarantine();
+                    stopped = true;
+                }
                 
-                // Send the result to the summation thread
-                if (!queue.push(task)) break;
+                // Exit on shutdown condition
+                if (stopped)
+                {
+                    queue.shutdown();
+                    break;
+                }
             }
+            
+            if (Profile::enabled()) Profile::addCore(coreName, fpgaCha.getUtilization());
         });
         
-        // Summation thread
-        auto summationRoutine = [&]()
+        // Summation and verifier thread
+        // Checks a random sample of the blocks of the parts written by the core (see Verify)
+        // and does the summation stage if the core does not, then passes the parts on
+        // Once a block is wrong, the parts written by the core are recomputed in software
+        auto summationRoutine = [&, traceName, coreName]()
         {
-            OtpTask task;
+            Trace::nameThread(traceName + (hasSummation ? " verifier" : " summation"));
+            Placement::place(Placement::SUMMATION);
+            Part part;
             ChaCha20::State state = s;
+            Verify::Checker checker(coreName);
             
             // Main loop
             while(true)
             {
-                // Wait for a task to arrive
+                // Wait for a part to arrive
                 // Exit on shutdown condition
-                if (!queue.pop(task)) break;
+                if (!queue.pop(part)) break;
+                OtpTask& task = part.task;
+                const size_t blocks = (part.to - part.from) / ChaCha20::State::WORD_SIZE;
                 
-                // Calculate block count
+                // Calculate block count of the first block of the part
                 task.getBCount(s.bCount, state.bCount);
+                state.bCount[0] += part.from / ChaCha20::State::WORD_SIZE;
                 
-                // Do the summation stage
-                for(int i = 0; i < task.length; i += ChaCha20::State::WORD_SIZE)
+                // Check the part and stop using the core if a block is wrong
+                if (part.verify)
                 {
-                    for(int j = 0; j < ChaCha20::State::WORD_SIZE; j++)
+                    Trace::Span span("verify", task.id);
+                    if (part.to == task.length && !faulty) checker.stats.tasks++;
+                    
+                    if (faulty || !checker.check(task.buffer + part.from, blocks, state, hasSummation))
                     {
-                        task.buffer[i + j] += state[j];
+                        if (!faulty.exchange(true))
+                        {
+                            checker.stats.quarantined = true;
+                            std::cerr << "FpgaCha core '" << coreName << "' produced a wrong block in task " << task.id;
+                            std::cerr << ", its jobs are computed in software from now on" << std::endl;
+                        }
+                        
+                        checker.recompute(task.buffer + part.from, blocks, state, hasSummation);
                     }
+                }
+                
+                // Do the summation stage
+                if (!hasSummation)
+                {
+                    Trace::Span span("summation", task.id);
                     
-                    state.bCount[0]++;
+                    for(size_t i = part.from; i < part.to; i += ChaCha20::State::WORD_SIZE)
+                    {
+                        for(int j = 0; j < ChaCha20::State::WORD_SIZE; j++)
+                        {
+                            task.buffer[i + j] += state[j];
+                        }
+                        
+                        state.bCount[0]++;
+                    }
                 }
                 
-                // Send the result to the queue of finished tasks
+                // Send the part to the cryptor (the task is finished with its last part)
                 // Exit on shutdown condition
-                if (!m.finishTask(task))
+                if (!m.publishTask(task, part.to))
                 {
                     queue.shutdown();
                     break;
                 }
             }
+            
+            if (verifying) Verify::add(checker);
         };
         
-        // Start T summation threads
-        for(int i = 0; i < T; i++)
+        // Start T summation threads if the core does not do the summation stage,
+        // otherwise one verifier thread if jobs are verified (it keeps the parts in order)
+        const size_t threads = hasSummation ? (verifying ? 1 : 0) : T;
+        for(size_t i = 0; i < threads; i++)
         {
             summationThread[i] = std::thread(summationRoutine);
         }
@@ -145,7 +574,7 @@ public:
         roundsThread.join();
         for(int i = 0; i < T; i++)
         {
-            summationThread[i].join();
+            if (summationThread[i].joinable()) summationThread[i].join();
         }
     }
 };
\ No newline at end of file
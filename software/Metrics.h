@@ -0,0 +1,449 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <array>
+#include <deque>
+#include <map>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+// Live metrics of the pipeline: throughput per worker and per backend,
+// occupancy of the queue of scheduled tasks and of the reorder slots,
+// time threads are blocked on queues and a histogram of task latency
+// Threads update relaxed atomics of their own, a reporter thread samples them,
+// prints a line of statistics and writes a snapshot file periodically
+// Update points cost one branch while metrics are not started
+class Metrics
+{
+public:
+    // Reasons for a thread to be blocked
+    enum Stall
+    {
+        // A worker waits for a task to be scheduled (the queue is empty)
+        STALL_TASK,
+        
+        // A worker waits for its reorder slot to be consumed (the slot is full)
+        STALL_SLOT,
+        
+        // The cryptor waits for a result
+        STALL_RESULT,
+        
+        // A thread waits for the DRAM bandwidth budget (see Budget)
+        STALL_BUDGET,
+        
+        STALLS
+    };
+    
+    // Period of printing statistics and writing the snapshot
+    static constexpr std::chrono::milliseconds PERIOD { 1000 };
+    
+    // Period of sampling queue occupancy
+    static constexpr std::chrono::milliseconds SAMPLE_PERIOD { 10 };
+    
+    // Reorder slots that are tracked (tasks beyond it share the slots modulo this)
+    static constexpr size_t MAX_SLOTS = 64;
+    
+    // Histogram buckets of task latency: [0, 1 us), [1, 2 us), [2, 4 us) ... [2^(B-2) us, inf)
+    static constexpr size_t BUCKETS = 26;
+    
+    // Starts metrics and the reporter thread, stops them when destroyed
+    // (nothing if <fileName> is empty)
+    // Must be created by the main thread and outlive the threads that are measured
+    class Session
+    {
+    private:
+        const std::string fileName;
+        std::thread reporter;
+        std::mutex mutex;
+        std::condition_variable cvStop;
+        bool stopped = false;
+    
+    public:
+        // fileName - snapshot file (rewritten every period)
+        Session(const std::string& fileName) : fileName(fileName)
+        {
+            if (fileName.empty()) return;
+            
+            start();
+            reporter = std::thread([this](){ report(); });
+        }
+        
+        ~Session()
+        {
+            if (fileName.empty()) return;
+            
+            {
+                auto lock = std::lock_guard<std::mutex>(mutex);
+                stopped = true;
+            }
+            
+            cvStop.notify_all();
+            reporter.join();
+            state().enabled = false;
+        }
+    
+    private:
+        void report()
+        {
+            typedef std::chrono::steady_clock Clock;
+            
+            const auto start = Clock::now();
+            auto next = start + PERIOD;
+            Snapshot previous = snapshot();
+            Occupancy occupancy;
+            
+            while(true)
+            {
+                {
+                    auto lock = std::unique_lock<std::mutex>(mutex);
+                    if (cvStop.wait_for(lock, SAMPLE_PERIOD, [&]{ return stopped; })) break;
+                }
+                
+                occupancy.sample();
+                if (Clock::now() < next) continue;
+                
+                const Snapshot current = snapshot();
+                const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+                const double period = std::chrono::duration<double>(current.time - previous.time).count();
+                
+                std::cout << line(seconds, period, previous, current, occupancy) << std::endl;
+                write(fileName, period, previous, current, occupancy);
+                
+                previous = current;
+                occupancy = Occupancy();
+                next += PERIOD;
+            }
+            
+            // Keep the totals of the whole run
+            const Snapshot current = snapshot();
+            const double period = std::chrono::duration<double>(current.time - previous.time).count();
+            write(fileName, std::max(period, 1e-3), previous, current, occupancy);
+        }
+    };
+    
+    // Measures the time from construction to destruction as a stall of the current thread
+    class Stalled
+    {
+    private:
+        const Stall reason;
+        const bool measured;
+        std::chrono::steady_clock::time_point start;
+    
+    public:
+        Stalled(Stall reason) : reason(reason), measured(enabled())
+        {
+            if (measured) start = std::chrono::steady_clock::now();
+        }
+        
+        ~Stalled()
+        {
+            if (!measured) return;
+            const auto stall = std::chrono::steady_clock::now() - start;
+            thread().stalls[reason].fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(stall).count(), std::memory_order_relaxed);
+        }
+    };
+    
+    static bool enabled()
+    {
+        return state().enabled.load(std::memory_order_relaxed);
+    }
+    
+    static void start()
+    {
+        state().enabled = true;
+    }
+    
+    // Names the current thread (the part before the first space is the backend)
+    static void nameThread(const std::string& name)
+    {
+        if (!enabled()) return;
+        
+        Thread& t = thread();
+        auto lock = std::lock_guard<std::mutex>(state().mutex);
+        t.name = name;
+    }
+    
+    // Sets the number of tasks in the system (the number of reorder slots)
+    static void setTaskCount(size_t n)
+    {
+        state().tasks = n;
+    }
+    
+    // Reports that a task was scheduled or taken by a worker
+    static void scheduled(int delta)
+    {
+        if (enabled()) state().scheduled.fetch_add(delta, std::memory_order_relaxed);
+    }
+    
+    // Reports that the reorder slot of task <id> was filled or consumed
+    // (the order of the reports of one slot does not matter)
+    static void slot(uint32_t id, bool full)
+    {
+        if (!enabled()) return;
+        
+        const size_t i = id % std::max<size_t>(state().tasks, 1) % MAX_SLOTS;
+        state().slots[i].fetch_add(full ? 1 : -1, std::memory_order_relaxed);
+    }
+    
+    // Reports that the current thread finished a task of <bytes> bytes with <latency>
+    static void finished(size_t bytes, std::chrono::steady_clock::duration latency)
+    {
+        if (!enabled()) return;
+        
+        Thread& t = thread();
+        t.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        t.tasks.fetch_add(1, std::memory_order_relaxed);
+        
+        const uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+        size_t bucket = 0;
+        while(bucket + 1 < BUCKETS && us >= (uint64_t(1) << bucket)) bucket++;
+        state().latency[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    // Counters of one thread
+    struct Thread
+    {
+        std::string name;
+        std::atomic<uint64_t> bytes { 0 };
+        std::atomic<uint64_t> tasks { 0 };
+        std::array<std::atomic<uint64_t>, STALLS> stalls {};
+    };
+    
+    struct State
+    {
+        std::atomic<bool> enabled { false };
+        
+        // Threads that were measured (deque does not move them when growing)
+        std::mutex mutex;
+        std::deque<Thread> threads;
+        
+        // Number of tasks in the system
+        std::atomic<size_t> tasks { 0 };
+        
+        // Scheduled tasks not taken by workers and tasks in every reorder slot
+        std::atomic<int> scheduled { 0 };
+        std::array<std::atomic<int>, MAX_SLOTS> slots {};
+        
+        std::array<std::atomic<uint64_t>, BUCKETS> latency {};
+    };
+    
+    // Copy of all counters
+    struct Snapshot
+    {
+        std::chrono::steady_clock::time_point time;
+        
+        // Per thread: name, bytes, tasks, stalls in ns
+        struct Counters
+        {
+            std::string name;
+            uint64_t bytes;
+            uint64_t tasks;
+            std::array<uint64_t, STALLS> stalls;
+        };
+        
+        std::deque<Counters> threads;
+        std::array<uint64_t, BUCKETS> latency;
+    };
+    
+    // Averages of queue occupancy over a period
+    struct Occupancy
+    {
+        size_t samples = 0;
+        double scheduled = 0;
+        std::array<size_t, MAX_SLOTS> slots {};
+        
+        void sample()
+        {
+            scheduled += std::max(state().scheduled.load(std::memory_order_relaxed), 0);
+            for(size_t i = 0; i < MAX_SLOTS; i++) slots[i] += state().slots[i].load(std::memory_order_relaxed) > 0;
+            samples++;
+        }
+        
+        double average() const
+        {
+            return samples == 0 ? 0 : scheduled / samples;
+        }
+        
+        double slot(size_t i) const
+        {
+            return samples == 0 ? 0 : double(slots[i]) / samples;
+        }
+    };
+    
+    static State& state()
+    {
+        static State s;
+        return s;
+    }
+    
+    // Returns the counters of the current thread (registered on the first update)
+    static Thread& thread()
+    {
+        thread_local Thread* t = nullptr;
+        if (t != nullptr) return *t;
+        
+        auto lock = std::lock_guard<std::mutex>(state().mutex);
+        state().threads.emplace_back();
+        t = &state().threads.back();
+        t->name = "thread " + std::to_string(state().threads.size() - 1);
+        return *t;
+    }
+    
+    static Snapshot snapshot()
+    {
+        Snapshot s;
+        s.time = std::chrono::steady_clock::now();
+        
+        auto lock = std::lock_guard<std::mutex>(state().mutex);
+        for(auto& t : state().threads)
+        {
+            Snapshot::Counters c { t.name, t.bytes.load(std::memory_order_relaxed), t.tasks.load(std::memory_order_relaxed), {} };
+            for(size_t i = 0; i < STALLS; i++) c.stalls[i] = t.stalls[i].load(std::memory_order_relaxed);
+            s.threads.push_back(c);
+        }
+        
+        for(size_t i = 0; i < BUCKETS; i++) s.latency[i] = state().latency[i].load(std::memory_order_relaxed);
+        return s;
+    }
+    
+    static std::string backend(const std::string& name)
+    {
+        return name.substr(0, name.find(' '));
+    }
+    
+    // Latency (upper bound of the bucket) below which <p> of the tasks finished, in us
+    static uint64_t percentile(const std::array<uint64_t, BUCKETS>& histogram, double p)
+    {
+        uint64_t total = 0;
+        for(auto n : histogram) total += n;
+        
+        uint64_t count = 0;
+        for(size_t i = 0; i < BUCKETS; i++)
+        {
+            count += histogram[i];
+            if (total != 0 && count >= p * total) return uint64_t(1) << i;
+        }
+        
+        return 0;
+    }
+    
+    // Returns the line of statistics of the last period
+    static std::string line(double seconds, double period, const Snapshot& previous,
+        const Snapshot& current, const Occupancy& occupancy)
+    {
+        std::map<std::string, uint64_t> backends;
+        std::array<uint64_t, STALLS> stalls {};
+        std::array<uint64_t, BUCKETS> latency;
+        uint64_t bytes = 0;
+        
+        for(size_t i = 0; i < current.threads.size(); i++)
+        {
+            const auto& c = current.threads[i];
+            const bool old = i < previous.threads.size();
+            const uint64_t b = c.bytes - (old ? previous.threads[i].bytes : 0);
+            
+            bytes += b;
+            if (b != 0) backends[backend(c.name)] += b;
+            for(size_t s = 0; s < STALLS; s++) stalls[s] += c.stalls[s] - (old ? previous.threads[i].stalls[s] : 0);
+        }
+        
+        for(size_t i = 0; i < BUCKETS; i++) latency[i] = current.latency[i] - previous.latency[i];
+        
+        const double mib = period * (1 << 20);
+        const size_t tasks = std::min<size_t>(std::max<size_t>(state().tasks, 1), MAX_SLOTS);
+        double slots = 0;
+        for(size_t i = 0; i < tasks; i++) slots += occupancy.slot(i);
+        
+        std::ostringstream o;
+        o << std::fixed << std::setprecision(1);
+        o << "[" << seconds << " s] " << bytes / mib << " MiB/s |";
+        for(auto& b : backends) o << " " << b.first << " " << b.second / mib;
+        o << " | queue " << occupancy.average() << "/" << tasks << " reorder " << slots << "/" << tasks;
+        
+        // Stall time in percent of the period of one thread
+        o << " | stalls task " << stalls[STALL_TASK] / period / 1e7 << "% slot " << stalls[STALL_SLOT] / period / 1e7;
+        o << "% result " << stalls[STALL_RESULT] / period / 1e7 << "% budget " << stalls[STALL_BUDGET] / period / 1e7 << "%";
+        o << " | latency p50 <" << percentile(latency, 0.5) << " us p99 <" << percentile(latency, 0.99) << " us";
+        
+        return o.str();
+    }
+    
+    // Writes the counters in Prometheus text format (totals since the start and averages of the last period)
+    // The file is replaced atomically, so it can be read at any time
+    static void write(const std::string& fileName, double period, const Snapshot& previous,
+        const Snapshot& current, const Occupancy& occupancy)
+    {
+        const std::string temporary = fileName + ".tmp";
+        std::ofstream file(temporary);
+        file << std::fixed << std::setprecision(3);
+        
+        for(size_t i = 0; i < current.threads.size(); i++)
+        {
+            const auto& c = current.threads[i];
+            const uint64_t old = i < previous.threads.size() ? previous.threads[i].bytes : 0;
+            const std::string labels = "{thread=\"" + c.name + "\",backend=\"" + backend(c.name) + "\"}";
+            
+            file << "chacha20_bytes_total" << labels << " " << c.bytes << std::endl;
+            file << "chacha20_tasks_total" << labels << " " << c.tasks << std::endl;
+            file << "chacha20_throughput_mib" << labels << " " << (c.bytes - old) / period / (1 << 20) << std::endl;
+            
+            const char* reasons[STALLS] = { "task", "slot", "result", "budget" };
+            for(size_t s = 0; s < STALLS; s++)
+            {
+                file << "chacha20_stall_seconds_total{thread=\"" << c.name << "\",reason=\"" << reasons[s] << "\"} ";
+                file << c.stalls[s] / 1e9 << std::endl;
+            }
+        }
+        
+        const size_t tasks = std::min<size_t>(std::max<size_t>(state().tasks, 1), MAX_SLOTS);
+        file << "chacha20_tasks " << state().tasks << std::endl;
+        file << "chacha20_scheduled_tasks " << occupancy.average() << std::endl;
+        for(size_t i = 0; i < tasks; i++)
+        {
+            file << "chacha20_reorder_slot_occupancy{slot=\"" << i << "\"} " << occupancy.slot(i) << std::endl;
+        }
+        
+        uint64_t count = 0;
+        for(size_t i = 0; i < BUCKETS; i++)
+        {
+            count += current.latency[i];
+            file << "chacha20_task_latency_us_bucket{le=\"";
+            if (i + 1 < BUCKETS) file << (uint64_t(1) << i);
+            else file << "+Inf";
+            file << "\"} " << count << std::endl;
+        }
+        
+        file << "chacha20_task_latency_us_count " << count << std::endl;
+        file.close();
+        
+        if (file) rename(temporary.c_str(), fileName.c_str());
+    }
+};
\ No newline at end of file
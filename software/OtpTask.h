@@ -27,12 +27,21 @@ struct OtpTask
     // Sequence number of OTP block
     size_t id;
     
+    // Index of the stream in TaskScheduler (0 if the workers serve one stream)
+    // and the block count of its first OTP block relative to that of the workers
+    size_t stream;
+    uint32_t firstBlock;
+    
     // Buffer to store OTP block
     uint32_t* buffer;
     
     // Size of the buffer in words
     size_t length;
     
+    // The worker wrote the ciphertext of the matching part of the input to the output
+    // itself, so the buffer is not used (see ChaCha20Worker)
+    bool written;
+    
     // Returns the number of OTP blocks that can fit the buffer
     uint32_t getOtpCount()
     {
@@ -43,6 +52,6 @@ struct OtpTask
     // block count and the ID
     void getBCount(const ChaCha20::BCount& base, ChaCha20::BCount& result)
     {
-        result[0] = base[0] + getOtpCount() * id;
+        result[0] = base[0] + firstBlock + getOtpCount() * id;
     }
 };
\ No newline at end of file
@@ -0,0 +1,307 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <mutex>
+#include <array>
+#include <vector>
+#include <map>
+#include <string>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+
+// Placement of pipeline threads on CPU cores
+// Every thread tells its role when it starts (see place), and a role can be pinned
+// to a set of CPUs, so e.g. the cryptor cannot preempt the FpgaCha control threads
+// In the real-time mode the control threads run under SCHED_FIFO and the task buffers
+// are locked in memory, so job resubmission does not wait for the scheduler or page faults
+class Placement
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+    
+    // Roles of pipeline threads
+    // CONTROL - threads that submit jobs to FpgaCha cores
+    // SUMMATION - software summation threads of FpgaCha workers
+    // WORKER - threads that compute OTP blocks in software
+    // CRYPTOR - threads that consume OTP blocks
+    enum Role { CONTROL, SUMMATION, WORKER, CRYPTOR, ROLES };
+    
+    // Prints the placement and the resubmission latencies when destroyed (nothing if not <enabled>)
+    // Must outlive the threads that are placed
+    class Session
+    {
+    private:
+        const bool enabled;
+    
+    public:
+        Session(bool enabled) : enabled(enabled)
+        {
+            if (enabled) state().enabled = true;
+        }
+        
+        ~Session()
+        {
+            if (enabled) report(std::cout);
+        }
+    };
+    
+    // Measures the time from finished jobs to the next submission of a control thread
+    // (how long a core may run out of jobs because its thread was not running)
+    class Resubmission
+    {
+    private:
+        const std::string name;
+        Clock::time_point woken;
+        bool pending = false;
+        std::vector<uint32_t> latencies;
+    
+    public:
+        // name - name of the control thread in the report
+        Resubmission(const std::string& name) : name(name) { }
+        
+        // Jobs were reported finished
+        void finished()
+        {
+            if (!enabled()) return;
+            woken = Clock::now();
+            pending = true;
+        }
+        
+        // The thread blocks waiting for a task, so the time until the next submission
+        // depends on the cryptor and is not counted
+        void cancel()
+        {
+            pending = false;
+        }
+        
+        // The next job was submitted
+        void submitted()
+        {
+            if (!pending) return;
+            latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - woken).count());
+            pending = false;
+        }
+        
+        ~Resubmission()
+        {
+            if (latencies.empty()) return;
+            
+            auto lock = std::lock_guard<std::mutex>(state().mutex);
+            auto& l = state().latencies[name];
+            l.insert(l.end(), latencies.begin(), latencies.end());
+        }
+    };
+    
+    static bool enabled()
+    {
+        return state().enabled;
+    }
+    
+    // Pins threads of a role to CPUs
+    // spec - "<role>=<cpus>", e.g. "control=1" or "worker=0-1" or "cryptor=0,2"
+    // Must be called before the threads are started
+    static void pin(const std::string& spec)
+    {
+        const auto& names = roleNames();
+        const size_t eq = spec.find('=');
+        const auto name = std::find(names.begin(), names.end(), spec.substr(0, eq));
+        if (eq == std::string::npos || name == names.end())
+            throw std::runtime_error("Placement should look like <control|summation|worker|cryptor>=<cpus>: '" + spec + "'");
+        
+        cpu_set_t& set = state().cpus[name - names.begin()];
+        std::string list = spec.substr(eq + 1);
+        
+        // Comma separated CPUs or ranges
+        for(size_t begin = 0; begin <= list.size();)
+        {
+            size_t end = std::min(list.find(',', begin), list.size());
+            const std::string item = list.substr(begin, end - begin);
+            const size_t dash = item.find('-');
+            
+            try
+            {
+                const int first = std::stoi(item.substr(0, dash));
+                const int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+                if (first < 0 || last < first || last >= CPU_SETSIZE) throw std::out_of_range(item);
+                for(int cpu = first; cpu <= last; cpu++) CPU_SET(cpu, &set);
+            }
+            
+            catch (std::logic_error e)
+            {
+                throw std::runtime_error("Wrong CPU list in placement '" + spec + "'");
+            }
+            
+            begin = end + 1;
+        }
+    }
+    
+    // Runs the control threads under SCHED_FIFO with <priority> (1 to 99)
+    // and locks the task buffers in memory (must be called before the buffers are created)
+    static void setRealtime(int priority)
+    {
+        if (priority < sched_get_priority_min(SCHED_FIFO) || priority > sched_get_priority_max(SCHED_FIFO))
+            throw std::runtime_error("SCHED_FIFO priority should be 1 to 99");
+        
+        state().priority = priority;
+    }
+    
+    // Applies the placement of <role> to the current thread
+    static void place(Role role)
+    {
+        State& s = state();
+        const bool pinned = CPU_COUNT(&s.cpus[role]) != 0;
+        const bool realtime = role == CONTROL && s.priority != 0;
+        if (!pinned && !realtime) return;
+        
+        if (pinned)
+        {
+            const int result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &s.cpus[role]);
+            if (result != 0) error(std::string("Pinning a thread: ") + strerror(result));
+        }
+        
+        if (realtime)
+        {
+            sched_param param;
+            param.sched_priority = s.priority;
+            
+            const int result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+            if (result != 0) error(std::string("SCHED_FIFO: ") + strerror(result));
+        }
+    }
+    
+    // Locks <bytes> bytes at <address> in memory in the real-time mode
+    // (the buffers are touched by control threads right before jobs are submitted)
+    static void lock(const void* address, size_t bytes)
+    {
+        if (state().priority == 0) return;
+        if (mlock(address, bytes) != 0) error(std::string("Locking task buffers: ") + strerror(errno));
+    }
+    
+    // Prints the placement of the roles and the resubmission latencies of control threads
+    static void report(std::ostream& o)
+    {
+        const auto& names = roleNames();
+        auto lock = std::lock_guard<std::mutex>(state().mutex);
+        
+        o << "Placement:";
+        for(size_t r = 0; r < ROLES; r++)
+        {
+            o << " " << names[r] << "=";
+            const cpu_set_t& set = state().cpus[r];
+            const char* separator = "";
+            
+            if (CPU_COUNT(&set) == 0) o << "any";
+            
+            for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            {
+                if (!CPU_ISSET(cpu, &set)) continue;
+                o << separator << cpu;
+                separator = ",";
+            }
+        }
+        
+        if (state().priority != 0) o << ", control threads under SCHED_FIFO " << state().priority;
+        o << std::endl;
+        
+        for(auto& e : state().errors) o << e.first << " failed " << e.second << " time(s)" << std::endl;
+        
+        if (state().latencies.empty())
+        {
+            o << "No job was resubmitted right after others finished (control threads waited for tasks)" << std::endl;
+            return;
+        }
+        
+        // Jitter is the spread between the median and the 99th percentile
+        o << std::left << std::setw(32) << "resubmission latency, us" << std::right << std::setw(8) << "jobs";
+        o << std::setw(10) << "mean" << std::setw(10) << "p50" << std::setw(10) << "p99";
+        o << std::setw(10) << "max" << std::setw(10) << "jitter" << std::endl;
+        
+        for(auto& p : state().latencies)
+        {
+            std::vector<uint32_t> l = p.second;
+            std::sort(l.begin(), l.end());
+            
+            double sum = 0;
+            for(auto v : l) sum += v;
+            
+            const double p50 = l[l.size() / 2] / 1e3;
+            const double p99 = l[std::min(l.size() - 1, l.size() * 99 / 100)] / 1e3;
+            
+            o << std::left << std::setw(32) << p.first << std::right << std::setw(8) << l.size();
+            o << std::fixed << std::setprecision(1) << std::setw(10) << sum / l.size() / 1e3;
+            o << std::setw(10) << p50 << std::setw(10) << p99 << std::setw(10) << l.back() / 1e3;
+            o << std::setw(10) << p99 - p50 << std::endl;
+        }
+    }
+
+private:
+    struct State
+    {
+        bool enabled = false;
+        
+        // CPUs of every role (empty - not pinned)
+        std::array<cpu_set_t, ROLES> cpus;
+        
+        // SCHED_FIFO priority of control threads (0 - normal scheduling)
+        int priority = 0;
+        
+        // Protects the fields below
+        std::mutex mutex;
+        
+        // Failed placement calls by error message
+        std::map<std::string, size_t> errors;
+        
+        // Resubmission latencies in nanoseconds by control thread
+        std::map<std::string, std::vector<uint32_t>> latencies;
+        
+        State()
+        {
+            for(auto& set : cpus) CPU_ZERO(&set);
+        }
+    };
+    
+    static State& state()
+    {
+        static State s;
+        return s;
+    }
+    
+    // Names of the roles in options and in the report
+    static const std::array<const char*, ROLES>& roleNames()
+    {
+        static const std::array<const char*, ROLES> names {{ "control", "summation", "worker", "cryptor" }};
+        return names;
+    }
+    
+    // Counts a failed placement call (the thread keeps running without it)
+    static void error(const std::string& message)
+    {
+        auto lock = std::lock_guard<std::mutex>(state().mutex);
+        state().errors[message]++;
+    }
+};
\ No newline at end of file
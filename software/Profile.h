@@ -0,0 +1,290 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <array>
+#include <deque>
+#include <map>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include "FpgaCha/Utilization.h"
+
+// Performance counters of the CPU per pipeline stage (perf_event_open)
+// Every thread counts its own task clock, cycles, instructions, cache misses
+// and DTLB misses; the counts between the start and the end of a stage
+// (see Trace::Span) are added to the totals of the stage
+// Reading the counters is a system call, so profiling is opt-in
+// FpgaCha cores report their own performance counters per core (see addCore)
+class Profile
+{
+public:
+    // Task clock (ns), cycles, instructions, cache misses, DTLB read misses
+    static constexpr size_t COUNTERS = 5;
+    typedef std::array<uint64_t, COUNTERS> Counters;
+    
+    // Starts profiling and prints the report when destroyed (nothing if not <enabled>)
+    // Must outlive the threads that are profiled
+    class Session
+    {
+    private:
+        const bool enabled;
+        const size_t bytes;
+    
+    public:
+        // bytes - bytes processed by the run (the report is per byte)
+        Session(bool enabled, size_t bytes) : enabled(enabled), bytes(bytes)
+        {
+            if (enabled) start();
+        }
+        
+        ~Session()
+        {
+            if (enabled) report(std::cout, bytes);
+        }
+    };
+    
+    static bool enabled()
+    {
+        return state().enabled.load(std::memory_order_relaxed);
+    }
+    
+    // Starts counting in stages
+    static void start()
+    {
+        state().enabled = true;
+    }
+    
+    // Reads the counters of the current thread
+    // Returns false if the thread has no counters
+    static bool read(Counters& c)
+    {
+        Thread& t = thread();
+        if (t.group < 0) return false;
+        
+        // Number of counters and their values in the order they were opened
+        uint64_t values[COUNTERS + 1];
+        if (::read(t.group, values, sizeof(values)) < (ssize_t)sizeof(uint64_t)) return false;
+        
+        c.fill(0);
+        for(size_t i = 0, v = 1; i < COUNTERS; i++)
+        {
+            if (t.available[i]) c[i] = values[v++];
+        }
+        
+        return true;
+    }
+    
+    // Adds the counts since <begin> to the totals of <stage> of the current thread
+    static void add(const char* stage, const Counters& begin)
+    {
+        Counters end;
+        if (!read(end)) return;
+        
+        Stage& s = thread().stages[stage];
+        for(size_t i = 0; i < COUNTERS; i++) s.counts[i] += end[i] - begin[i];
+        s.calls++;
+    }
+    
+    // Adds the performance counters of FpgaCha core <name> (called when its worker stops)
+    static void addCore(const std::string& name, const FpgaCha::Utilization& u)
+    {
+        auto lock = std::lock_guard<std::mutex>(state().mutex);
+        state().cores[name] += u;
+    }
+    
+    // Prints the totals of every stage per byte and the utilization of every FpgaCha core
+    static void report(std::ostream& o, size_t bytes)
+    {
+        state().enabled = false;
+        auto lock = std::lock_guard<std::mutex>(state().mutex);
+        
+        if (!state().cores.empty())
+        {
+            o << "Utilization of FpgaCha cores (hardware counters)" << std::endl;
+            FpgaCha::Utilization::printHeader(o);
+            for(auto& p : state().cores) p.second.print(o, p.first);
+        }
+        
+        std::map<std::string, Stage> stages;
+        std::array<bool, COUNTERS> available = {};
+        
+        for(auto& t : state().threads)
+        {
+            // The threads are finished
+            for(auto fd : t.fds) close(fd);
+            t.fds.clear();
+            t.group = -1;
+            
+            for(size_t i = 0; i < COUNTERS; i++) available[i] = available[i] || t.available[i];
+            
+            for(auto& p : t.stages)
+            {
+                Stage& s = stages[p.first];
+                for(size_t i = 0; i < COUNTERS; i++) s.counts[i] += p.second.counts[i];
+                s.calls += p.second.calls;
+            }
+        }
+        
+        if (!available[0])
+        {
+            o << "Profile: performance counters are not available (";
+            o << (state().error.empty() ? "no stage was run" : state().error) << ")" << std::endl;
+            return;
+        }
+        
+        const double b = std::max<size_t>(bytes, 1);
+        const double kib = b / 1024;
+        
+        o << "Profile of " << bytes << " bytes (CPU time and counters of the threads, not wall time;" << std::endl;
+        o << "stages of a thread may contain each other, e.g. wait and syncForCpu)" << std::endl;
+        o << std::left << std::setw(14) << "stage" << std::right << std::setw(10) << "calls";
+        o << std::setw(12) << "CPU ns/B" << std::setw(12) << "cycles/B" << std::setw(10) << "instr/B" << std::setw(8) << "IPC";
+        o << std::setw(16) << "cache miss/KiB" << std::setw(16) << "DTLB miss/KiB" << std::endl;
+        
+        for(auto& p : stages)
+        {
+            const Counters& c = p.second.counts;
+            auto column = [&](size_t i, double value, int width)
+            {
+                if (available[i]) o << std::setw(width) << value;
+                else o << std::setw(width) << "-";
+            };
+            
+            o << std::left << std::setw(14) << p.first << std::right << std::setw(10) << p.second.calls;
+            o << std::fixed << std::setprecision(2);
+            column(0, c[0] / b, 12);
+            column(1, c[1] / b, 12);
+            column(2, c[2] / b, 10);
+            column(2, c[1] == 0 ? 0 : (double)c[2] / c[1], 8);
+            column(3, c[3] / kib, 16);
+            column(4, c[4] / kib, 16);
+            o << std::endl;
+        }
+    }
+
+private:
+    struct Stage
+    {
+        Counters counts = {};
+        uint64_t calls = 0;
+    };
+    
+    // Counters and stages of one thread
+    struct Thread
+    {
+        // Group of counters (task clock leads the group), -1 if it cannot be opened
+        int group = -1;
+        std::array<bool, COUNTERS> available = {};
+        std::vector<int> fds;
+        std::map<std::string, Stage> stages;
+    };
+    
+    struct State
+    {
+        std::atomic<bool> enabled { false };
+        
+        // Threads that were profiled (deque does not move them when growing)
+        std::mutex mutex;
+        std::deque<Thread> threads;
+        
+        // Why the first counter that failed could not be opened
+        std::string error;
+        
+        // Counters of FpgaCha cores by name
+        std::map<std::string, FpgaCha::Utilization> cores;
+    };
+    
+    static State& state()
+    {
+        static State s;
+        return s;
+    }
+    
+    // Opens counter <config> of <type> for the current thread in <group> (-1 opens the group)
+    static int open(uint32_t type, uint64_t config, int group)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+        
+        // Count user space only if the kernel is not allowed to be counted
+        if (fd < 0 && errno == EACCES)
+        {
+            attr.exclude_kernel = 1;
+            fd = syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+        }
+        
+        return fd;
+    }
+    
+    // Returns the counters of the current thread (opened on the first stage)
+    static Thread& thread()
+    {
+        thread_local Thread* t = nullptr;
+        if (t != nullptr) return *t;
+        
+        auto lock = std::lock_guard<std::mutex>(state().mutex);
+        state().threads.emplace_back();
+        t = &state().threads.back();
+        
+        const std::array<std::pair<uint32_t, uint64_t>, COUNTERS> events
+        {{
+            { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) }
+        }};
+        
+        for(size_t i = 0; i < COUNTERS; i++)
+        {
+            const int fd = open(events[i].first, events[i].second, t->group);
+            
+            if (fd < 0)
+            {
+                if (state().error.empty()) state().error = strerror(errno);
+                if (i == 0) break;
+                continue;
+            }
+            
+            if (i == 0) t->group = fd;
+            t->available[i] = true;
+            t->fds.push_back(fd);
+        }
+        
+        return *t;
+    }
+};
\ No newline at end of file
@@ -18,10 +18,19 @@
 #pragma once
 
 #include <array>
+#include <mutex>
+#include <vector>
 #include <thread>
+#include <chrono>
+#include <stdexcept>
 #include "BlockingQueue.h"
 #include "QueueArray.h"
 #include "OtpTask.h"
+#include "TaskProgress.h"
+#include "Trace.h"
+#include "Placement.h"
+#include "Metrics.h"
+#include "TaskScheduler.h"
 
 // Class for coordinating workers and cryptor
 // N - number of tasks circulating in the system
@@ -35,55 +44,271 @@ private:
      // Queue of finished tasks (ready-to-use one-time pad blocks)
     QueueArray<OtpTask, N> finishedTasks;
     
+    // Progress of tasks (task i uses the <i mod N> element)
+    std::array<TaskProgress, N> progress;
+    
     // Id of the next scheduleTask
     uint32_t nextTaskId = 0;
+    
+    // Time when tasks were scheduled (task i uses the <i mod N> element)
+    std::array<std::chrono::steady_clock::time_point, N> scheduleTime;
+    
+    // Buffers that tasks get when they are scheduled again (see retireBuffer)
+    // (task i uses the <i mod N> element, nullptr - the task keeps its buffer)
+    std::array<uint32_t*, N> replacements {};
+    
+    // Latencies of finished tasks in microseconds (see collectLatencies)
+    std::mutex latencyMutex;
+    std::vector<double> latencies;
+    bool latencyEnabled = false;
+    
+    // Queue shared with other streams (see attach), index of this stream in it
+    // and the block count of its first OTP block
+    TaskScheduler<N>* scheduler = nullptr;
+    size_t stream = 0;
+    uint32_t firstBlock = 0;
+    
+    // Returns the stream a worker takes tasks of (TaskScheduler::MAX_STREAMS - any)
+    size_t only(bool own) const
+    {
+        return own ? stream : TaskScheduler<N>::MAX_STREAMS;
+    }
+    
+    // Returns the task manager of the stream <task> belongs to
+    TaskManager& owner(const OtpTask& task)
+    {
+        return scheduler == nullptr || task.stream == stream ? *this : *scheduler->manager(task.stream);
+    }
 
 public:
     // base - buffer for tasks (it will be split in N chunks)
     // length - the length of the buffer
     TaskManager(uint32_t* base, size_t length)
     {
+        Metrics::setTaskCount(N);
+        
         // Schedule tasks for all available sub-buffers
-        OtpTask task;
+        OtpTask task {};
         const size_t bufferLength = length / N;
         for(int i = 0; i < N; i++)
         {
             task.buffer = base + i * bufferLength;
             task.length = bufferLength;
+            Placement::lock(task.buffer, task.length * sizeof(uint32_t));
+            scheduleTask(task);
+        }
+    }
+    
+    // pool - DMA pool to take N buffers for tasks from (see FpgaCha::DmaPool)
+    // length - the length of each buffer in words
+    template <typename P>
+    TaskManager(P& pool, size_t length)
+    {
+        Metrics::setTaskCount(N);
+        
+        // Schedule tasks for all buffers
+        OtpTask task {};
+        for(int i = 0; i < N; i++)
+        {
+            task.buffer = pool.allocate(length);
+            task.length = length;
+            Placement::lock(task.buffer, task.length * sizeof(uint32_t));
             scheduleTask(task);
         }
     }
 
+    // Makes this stream share the workers with other streams through <s>
+    // index - index of the stream, it selects the block counts of the stream
+    //         (a file has to be decrypted by a stream with the same index)
+    // priority - priority class of the stream
+    // quota - maximum number of tasks given to workers at once (0 - N)
+    // The workers can be given any of the task managers
+    // Must be called before workers and cryptor are started
+    void attach(TaskScheduler<N>& s, size_t index, typename TaskScheduler<N>::Class priority, size_t quota = 0)
+    {
+        if (scheduler != nullptr) throw std::runtime_error("Task manager is attached twice");
+        s.attach(this, index, priority, quota);
+        scheduler = &s;
+        stream = index;
+        firstBlock = stream * TaskScheduler<N>::STREAM_BLOCKS;
+        
+        // Move the tasks scheduled by the constructor
+        OtpTask task;
+        size_t moved = 0;
+        for(; scheduledTasks.tryPop(task); moved++)
+        {
+            task.stream = stream;
+            task.firstBlock = firstBlock;
+            scheduler->push(task);
+        }
+        
+        // A task taken by a worker would not be routed to this stream
+        if (moved != N) throw std::runtime_error("Task manager is attached after workers were started");
+    }
+    
+    // Tells whether the workers are shared with other streams
+    bool shared() const
+    {
+        return scheduler != nullptr;
+    }
+    
+    // Returns how many bytes of one-time pad the stream can use before it runs out
+    // of its block counts and would reuse those of another stream
+    uint64_t limit() const
+    {
+        return shared() ? TaskScheduler<N>::STREAM_BYTES : (1ull << 32) * ChaCha20::State::BYTE_SIZE;
+    }
+    
     // Sends the shutdown signal to all underlying queues
+    // A stream that shares the workers stops only them if it is the last one
     void shutdown()
     {
         // Shutdown queues to release waiting worker threads
-        scheduledTasks.shutdown();
+        if (scheduler != nullptr) scheduler->detach(stream);
+        else scheduledTasks.shutdown();
         finishedTasks.shutdown();
+        for(auto& p : progress) p.shutdown();
     }
     
     // Requests the next OTP block (called by cryptor)
     void scheduleTask(OtpTask& task)
     {
+        // The worker may have retired the buffer of the previous task
+        uint32_t*& replacement = replacements[task.id % N];
+        if (replacement != nullptr) task.buffer = replacement;
+        replacement = nullptr;
+        
         task.id = nextTaskId++;
-        scheduledTasks.push(task);
+        task.stream = stream;
+        task.firstBlock = firstBlock;
+        task.written = false;
+        scheduleTime[task.id % N] = std::chrono::steady_clock::now();
+        progress[task.id % N].reset();
+        Trace::instant("scheduleTask", task.id);
+        Metrics::scheduled(1);
+        if (scheduler != nullptr) scheduler->push(task);
+        else scheduledTasks.push(task);
     }
     
-    // Gets the next complete OTP block (called by cryptor)
+    // Gets the next OTP block once its first part is complete (called by cryptor)
+    // Use waitTask to find out which part can be used
     void processTask(OtpTask& task)
     {
+        Trace::Span span("processTask");
+        Metrics::Stalled stalled(Metrics::STALL_RESULT);
         finishedTasks.next(task);
+        Metrics::slot(task.id, false);
+        span.task = task.id;
+    }
+    
+    // Blocks until at least <words> words of <task> are complete (called by cryptor)
+    // Returns the number of complete words
+    // The task must be complete before it is scheduled again
+    size_t waitTask(const OtpTask& task, size_t words)
+    {
+        Trace::Span span("waitTask", task.id);
+        Metrics::Stalled stalled(Metrics::STALL_RESULT);
+        return progress[task.id % N].wait(words);
     }
  
     // Gets the next request for OTP block (called by workers)
-    bool performTask(OtpTask& task)
+    // own - take only tasks of this stream if the workers are shared (for workers that
+    //       write the output file of the stream themselves)
+    bool performTask(OtpTask& task, bool own = false)
+    {
+        Trace::Span span("performTask");
+        Metrics::Stalled stalled(Metrics::STALL_TASK);
+        const bool result = scheduler != nullptr ? scheduler->pop(task, only(own)) : scheduledTasks.pop(task);
+        if (result) Metrics::scheduled(-1);
+        span.task = task.id;
+        return result;
+    }
+    
+    // Returns a task the worker could not complete to the scheduled tasks,
+    // so any worker can perform it (called by workers)
+    // The task must not have been passed to the cryptor yet
+    bool reissueTask(OtpTask& task)
+    {
+        Trace::instant("reissueTask", task.id);
+        Metrics::scheduled(1);
+        if (scheduler == nullptr) return scheduledTasks.push(task);
+        
+        scheduler->reissue(task);
+        return scheduler->running();
+    }
+    
+    // Makes <task> use <buffer> (of the same length) from the next time it is scheduled,
+    // because its current buffer must not be used anymore (called by workers)
+    // Must be called before the task is finished
+    void retireBuffer(const OtpTask& task, uint32_t* buffer)
+    {
+        if (&owner(task) != this) return owner(task).retireBuffer(task, buffer);
+        replacements[task.id % N] = buffer;
+    }
+    
+    // Gets the next request for OTP block if there is one (called by workers)
+    // own - take only tasks of this stream (see performTask)
+    bool tryPerformTask(OtpTask& task, bool own = false)
+    {
+        const bool result = scheduler != nullptr ? scheduler->tryPop(task, only(own)) : scheduledTasks.tryPop(task);
+        if (result) Metrics::scheduled(-1);
+        return result;
+    }
+    
+    // Reports that the first <words> words of <task> are complete (called by workers)
+    // The first report passes the task to the cryptor
+    // Returns false on shutdown (of all streams if the workers are shared)
+    bool publishTask(OtpTask& task, size_t words)
+    {
+        // The task may belong to another stream that shares the workers
+        if (&owner(task) != this) return owner(task).publishTask(task, words);
+        
+        // A worker may report the whole task before it finishes it, the task is counted once
+        const bool completes = words >= task.length && progress[task.id % N].complete() < task.length;
+        if (completes && scheduler != nullptr) scheduler->finished(stream);
+        
+        if (completes && (latencyEnabled || Metrics::enabled()))
+        {
+            const auto latency = std::chrono::steady_clock::now() - scheduleTime[task.id % N];
+            Metrics::finished(task.length * sizeof(uint32_t), latency);
+            
+            if (latencyEnabled)
+            {
+                auto lock = std::lock_guard<std::mutex>(latencyMutex);
+                latencies.push_back(std::chrono::duration<double, std::micro>(latency).count());
+            }
+        }
+        
+        if (!progress[task.id % N].publish(words)) return true;
+        
+        // Blocks while the previous task of the slot is not consumed
+        Trace::Span span("finishTask", task.id);
+        Metrics::Stalled stalled(Metrics::STALL_SLOT);
+        
+        // Other streams keep the workers busy when this one is shut down
+        if (!finishedTasks.put(task, task.id)) return scheduler != nullptr && scheduler->running();
+        
+        Metrics::slot(task.id, true);
+        return true;
+    }
+    
+    // Starts keeping the time from scheduling to completion of every task
+    // Must be called before workers and cryptor are started
+    void collectLatencies()
+    {
+        latencyEnabled = true;
+    }
+    
+    // Returns the collected latencies in microseconds (in completion order)
+    std::vector<double> getLatencies()
     {
-        return scheduledTasks.pop(task);
+        auto lock = std::lock_guard<std::mutex>(latencyMutex);
+        return latencies;
     }
     
     // Saves the next complete OTP block (called by workers)
     bool finishTask(OtpTask& task)
     {
-        return finishedTasks.put(task, task.id);
+        return publishTask(task, task.length);
     }
 };
\ No newline at end of file
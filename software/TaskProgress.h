@@ -0,0 +1,89 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <mutex>
+#include <algorithm>
+#include <condition_variable>
+
+// Number of complete words at the beginning of a task's buffer
+// Lets the cryptor use the first part of a task while a worker produces the rest
+// Updated by one worker, read by the cryptor
+class TaskProgress
+{
+private:
+    std::mutex mutex;
+    std::condition_variable cvReady;
+    size_t ready = 0;
+    bool published = false;
+    bool stopped = false;
+
+public:
+    // Enables the shutdown mode
+    void shutdown()
+    {
+        {
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            stopped = true;
+        }
+        
+        cvReady.notify_all();
+    }
+    
+    // Forgets the progress of the previous task
+    void reset()
+    {
+        auto lock = std::lock_guard<std::mutex>(mutex);
+        ready = 0;
+        published = false;
+    }
+    
+    // Reports that the first <words> words are complete
+    // Returns true if it is the first report since reset
+    bool publish(size_t words)
+    {
+        bool first;
+        
+        {
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            ready = std::max(ready, words);
+            first = !published;
+            published = true;
+        }
+        
+        cvReady.notify_all();
+        
+        return first;
+    }
+    
+    // Returns the number of complete words
+    size_t complete()
+    {
+        auto lock = std::lock_guard<std::mutex>(mutex);
+        return ready;
+    }
+    
+    // Blocks until at least <words> words are complete
+    // Returns the number of complete words (may be less if the shutdown mode was enabled)
+    size_t wait(size_t words)
+    {
+        auto lock = std::unique_lock<std::mutex>(mutex);
+        cvReady.wait(lock, [&]{ return ready >= words || stopped; });
+        return ready;
+    }
+};
\ No newline at end of file
@@ -0,0 +1,275 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+#include <condition_variable>
+#include <array>
+#include <deque>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include "ChaCha20/State.h"
+#include "OtpTask.h"
+
+template <size_t N>
+class TaskManager;
+
+// Queue of scheduled tasks shared by several streams (TaskManager instances, each with
+// its own cryptor and buffers) and by the workers that serve all of them (see TaskManager::attach)
+// Every stream belongs to a priority class. The classes are served by weighted-fair dequeue
+// (stride scheduling), the streams of one class in turn, and a stream has at most <quota>
+// tasks given to workers and not finished, so a bulk stream cannot fill the job queues of
+// the cores while an interactive one waits behind it
+// N - number of tasks of every stream (should match to that of TaskManager)
+template <size_t N>
+class TaskScheduler
+{
+public:
+    // Priority classes
+    enum Class { INTERACTIVE, NORMAL, BULK, CLASSES };
+    
+    // Maximum number of streams
+    // The streams share the key and the nonce of the workers, so every stream gets
+    // its own range of block counts (2^32 / MAX_STREAMS blocks, 32 GiB of one-time pad)
+    // chosen by its index, which is why the index is given explicitly
+    static constexpr size_t MAX_STREAMS = 8;
+    static constexpr uint32_t STREAM_BLOCKS = (1ull << 32) / MAX_STREAMS;
+    static constexpr uint64_t STREAM_BYTES = (uint64_t)STREAM_BLOCKS * ChaCha20::State::BYTE_SIZE;
+
+private:
+    // Pass of a class grows by STRIDE / weight per dequeued task
+    static constexpr uint64_t STRIDE = 1 << 20;
+    
+    struct Stream
+    {
+        TaskManager<N>* manager = nullptr;
+        Class priority = BULK;
+        size_t quota = 0;
+        
+        // Tasks given to workers and not finished yet
+        size_t inFlight = 0;
+        
+        // Scheduled tasks (reissued ones go first)
+        std::deque<OtpTask> queued;
+        
+        // The stream was shut down
+        bool detached = false;
+    };
+    
+    std::mutex mutex;
+    std::condition_variable cvEligible;
+    std::array<Stream, MAX_STREAMS> streams;
+    bool stopped = false;
+    
+    // Weights, passes and the next stream to serve of every class
+    std::array<uint32_t, CLASSES> weights {{ 16, 4, 1 }};
+    std::array<uint64_t, CLASSES> passes {};
+    std::array<size_t, CLASSES> nextStream {};
+    
+    // Pass of the last served class (an idle class does not save up its share)
+    uint64_t virtualTime = 0;
+    
+    // Tells whether a task of <s> can be given to a worker (mutex must be held)
+    bool eligible(const Stream& s) const
+    {
+        return !s.queued.empty() && s.inFlight < s.quota;
+    }
+    
+    // Returns the index of the next eligible stream of class <c> or MAX_STREAMS (mutex must be held)
+    // only - the only stream to look at (MAX_STREAMS - any)
+    size_t findStream(Class c, size_t only = MAX_STREAMS) const
+    {
+        if (only != MAX_STREAMS)
+        {
+            const Stream& s = streams[only];
+            return s.manager != nullptr && s.priority == c && eligible(s) ? only : MAX_STREAMS;
+        }
+        
+        for(size_t i = 0; i < MAX_STREAMS; i++)
+        {
+            const size_t index = (nextStream[c] + i) % MAX_STREAMS;
+            const Stream& s = streams[index];
+            if (s.manager != nullptr && s.priority == c && eligible(s)) return index;
+        }
+        
+        return MAX_STREAMS;
+    }
+    
+    // Takes the next task by weighted-fair dequeue (mutex must be held)
+    // only - take a task of this stream only (MAX_STREAMS - of any stream)
+    // Returns false if no stream has an eligible task
+    bool take(OtpTask& task, size_t only)
+    {
+        size_t best = MAX_STREAMS;
+        Class bestClass = CLASSES;
+        
+        for(int c = 0; c < CLASSES; c++)
+        {
+            const size_t index = findStream((Class)c, only);
+            if (index == MAX_STREAMS) continue;
+            if (bestClass == CLASSES || passes[c] < passes[bestClass])
+            {
+                best = index;
+                bestClass = (Class)c;
+            }
+        }
+        
+        if (bestClass == CLASSES) return false;
+        
+        Stream& s = streams[best];
+        task = s.queued.front();
+        s.queued.pop_front();
+        s.inFlight++;
+        
+        virtualTime = passes[bestClass];
+        passes[bestClass] += STRIDE / weights[bestClass];
+        nextStream[bestClass] = (best + 1) % MAX_STREAMS;
+        return true;
+    }
+    
+    // Queues <task> of its stream (mutex must be held)
+    // <front> - the task goes before the other tasks of the stream
+    void queue(const OtpTask& task, bool front)
+    {
+        Stream& s = streams[task.stream];
+        if (s.detached) return;
+        
+        // A class that had nothing to do starts from the current pass
+        const Class c = s.priority;
+        if (findStream(c) == MAX_STREAMS) passes[c] = std::max(passes[c], virtualTime);
+        
+        if (front) s.queued.push_front(task);
+        else s.queued.push_back(task);
+    }
+    
+    // Tells whether a worker taking tasks of stream <only> (MAX_STREAMS - any) should stop (mutex must be held)
+    bool closed(size_t only) const
+    {
+        return stopped || (only != MAX_STREAMS && streams[only].detached);
+    }
+
+public:
+    // Sets the share of class <c> relative to the other classes
+    // (16, 4 and 1 by default, must be called before streams are attached)
+    void setWeight(Class c, uint32_t weight)
+    {
+        if (weight == 0) throw std::runtime_error("Weight of a priority class should be positive");
+        weights[c] = weight;
+    }
+    
+    // Adds stream <manager> with <index> (0 to MAX_STREAMS - 1) of class <priority>
+    // with at most <quota> tasks in flight (0 - N, as many as the stream has)
+    void attach(TaskManager<N>* manager, size_t index, Class priority, size_t quota)
+    {
+        auto lock = std::lock_guard<std::mutex>(mutex);
+        if (index >= MAX_STREAMS) throw std::runtime_error("Index of a stream should be less than " + std::to_string(MAX_STREAMS));
+        if (streams[index].manager != nullptr) throw std::runtime_error("Stream " + std::to_string(index) + " is attached twice");
+        
+        Stream& s = streams[index];
+        s.manager = manager;
+        s.priority = priority;
+        s.quota = quota == 0 ? N : quota;
+    }
+    
+    // Returns the task manager of stream <index>
+    TaskManager<N>* manager(size_t index)
+    {
+        auto lock = std::lock_guard<std::mutex>(mutex);
+        return streams[index].manager;
+    }
+    
+    // Queues a scheduled task of stream <task.stream>
+    void push(const OtpTask& task)
+    {
+        {
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            queue(task, false);
+        }
+        
+        // Some workers may wait for tasks of their own stream only
+        cvEligible.notify_all();
+    }
+    
+    // Returns a task a worker could not complete to the front of its stream
+    void reissue(const OtpTask& task)
+    {
+        {
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            streams[task.stream].inFlight--;
+            queue(task, true);
+        }
+        
+        cvEligible.notify_all();
+    }
+    
+    // Tells that a task of stream <index> is finished, so the stream may get another one
+    void finished(size_t index)
+    {
+        {
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            streams[index].inFlight--;
+        }
+        
+        cvEligible.notify_all();
+    }
+    
+    // Blocks until a task can be given to a worker
+    // only - take a task of this stream only (MAX_STREAMS - of any stream),
+    //        for workers that write the output of one stream themselves
+    // Returns false if the shutdown mode was enabled (or stream <only> was detached)
+    bool pop(OtpTask& task, size_t only = MAX_STREAMS)
+    {
+        auto lock = std::unique_lock<std::mutex>(mutex);
+        cvEligible.wait(lock, [&]{ return closed(only) || take(task, only); });
+        return !closed(only);
+    }
+    
+    // Gets a task if one can be given to a worker right away
+    // only - take a task of this stream only (MAX_STREAMS - of any stream)
+    // Returns false if there is none or the shutdown mode was enabled (or stream <only> was detached)
+    bool tryPop(OtpTask& task, size_t only = MAX_STREAMS)
+    {
+        auto lock = std::lock_guard<std::mutex>(mutex);
+        return !closed(only) && take(task, only);
+    }
+    
+    // Drops the tasks of stream <index> that are not given to workers yet
+    // Enables the shutdown mode when all streams are detached
+    void detach(size_t index)
+    {
+        {
+            auto lock = std::lock_guard<std::mutex>(mutex);
+            streams[index].detached = true;
+            streams[index].queued.clear();
+            
+            stopped = true;
+            for(auto& s : streams) stopped = stopped && (s.manager == nullptr || s.detached);
+        }
+        
+        cvEligible.notify_all();
+    }
+    
+    // Tells whether the workers still have streams to serve
+    bool running()
+    {
+        auto lock = std::lock_guard<std::mutex>(mutex);
+        return !stopped;
+    }
+};
\ No newline at end of file
@@ -0,0 +1,255 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include "Profile.h"
+#include "Metrics.h"
+
+// Timeline of pipeline stages in Chrome trace format
+// (open the file in chrome://tracing or ui.perfetto.dev)
+// Every thread writes events to its own ring buffer, so trace points do not
+// synchronize threads; the oldest events of a thread are overwritten when its ring is full
+// Trace points cost two branches while tracing and profiling are not started
+class Trace
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+    
+    // Events kept per thread
+    static constexpr size_t CAPACITY = 1 << 16;
+    
+    // Task id of events that do not belong to a task
+    static constexpr uint32_t NO_TASK = UINT32_MAX;
+    
+    struct Event
+    {
+        // Stage name (must be a string literal)
+        const char* name;
+        
+        // 'X' - stage of a thread, 'i' - instant, 'b'/'e' - begin/end of a job of a core
+        char phase;
+        
+        uint32_t task;
+        
+        // Time since the start of the trace and duration in nanoseconds
+        int64_t start;
+        int64_t duration;
+    };
+    
+    // Records the time from construction to destruction as a stage of the current thread
+    // Also counts the stage in the profile if profiling is started (see Profile)
+    class Span
+    {
+    private:
+        const char* name;
+        int64_t start;
+        Profile::Counters counters;
+        bool profiled;
+    
+    public:
+        // Task of the stage (can be set when it becomes known, e.g. after a queue pop)
+        uint32_t task;
+        
+        Span(const char* name, uint32_t task = NO_TASK) :
+            name(name),
+            start(enabled() ? now() : -1),
+            profiled(Profile::enabled() && Profile::read(counters)),
+            task(task) { }
+        
+        ~Span()
+        {
+            if (start >= 0) add({ name, 'X', task, start, now() - start });
+            if (profiled) Profile::add(name, counters);
+        }
+    };
+    
+    // Starts tracing and writes the trace to <fileName> when destroyed (nothing if <fileName> is empty)
+    // Must be created by the main thread and outlive the threads that are traced
+    class Session
+    {
+    private:
+        const std::string fileName;
+    
+    public:
+        Session(const std::string& fileName) : fileName(fileName)
+        {
+            if (fileName.empty()) return;
+            
+            start();
+            nameThread("main");
+        }
+        
+        ~Session()
+        {
+            if (fileName.empty()) return;
+            
+            try
+            {
+                write(fileName);
+            }
+            
+            catch (std::runtime_error e)
+            {
+                std::cout << e.what() << std::endl;
+            }
+        }
+    };
+    
+    static bool enabled()
+    {
+        return state().enabled.load(std::memory_order_relaxed);
+    }
+    
+    // Starts recording events
+    static void start()
+    {
+        state().origin = Clock::now();
+        state().enabled = true;
+    }
+    
+    // Names the current thread in the trace and in the metrics
+    static void nameThread(const std::string& name)
+    {
+        if (enabled()) ring().name = name;
+        Metrics::nameThread(name);
+    }
+    
+    // Records an event without duration
+    static void instant(const char* name, uint32_t task = NO_TASK)
+    {
+        if (enabled()) add({ name, 'i', task, now(), 0 });
+    }
+    
+    // Records the start and the end of a job that runs on a core while the thread does other things
+    static void beginJob(const char* name, uint32_t task)
+    {
+        if (enabled()) add({ name, 'b', task, now(), 0 });
+    }
+    
+    static void endJob(const char* name, uint32_t task)
+    {
+        if (enabled()) add({ name, 'e', task, now(), 0 });
+    }
+    
+    // Stops recording events and writes them to <fileName>
+    static void write(const std::string& fileName)
+    {
+        state().enabled = false;
+        
+        auto lock = std::lock_guard<std::mutex>(state().mutex);
+        std::ofstream file(fileName);
+        file << std::fixed << std::setprecision(3);
+        const char* separator = "\n";
+        
+        file << "{\"traceEvents\": [";
+        
+        for(size_t t = 0; t < state().rings.size(); t++)
+        {
+            const Ring& r = state().rings[t];
+            
+            file << separator << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << t;
+            file << ", \"args\": {\"name\": \"" << (r.name.empty() ? "thread " + std::to_string(t) : r.name) << "\"}}";
+            separator = ",\n";
+            
+            // Oldest events first
+            const size_t count = r.written < CAPACITY ? r.written : CAPACITY;
+            for(size_t i = r.written - count; i < r.written; i++)
+            {
+                const Event& e = r.events[i % CAPACITY];
+                
+                file << ",\n{\"name\": \"" << e.name << "\", \"ph\": \"" << e.phase << "\", \"pid\": 1, \"tid\": " << t;
+                file << ", \"ts\": " << e.start / 1e3;
+                
+                if (e.phase == 'X') file << ", \"dur\": " << e.duration / 1e3;
+                if (e.phase == 'i') file << ", \"s\": \"t\"";
+                if (e.phase == 'b' || e.phase == 'e') file << ", \"cat\": \"job\", \"id\": " << e.task;
+                if (e.task != NO_TASK) file << ", \"args\": {\"task\": " << e.task << "}";
+                
+                file << "}";
+            }
+        }
+        
+        file << "\n]}\n";
+        
+        if (!file) throw std::runtime_error("Error when writing to '" + fileName + "'");
+    }
+
+private:
+    // Events of one thread
+    struct Ring
+    {
+        std::string name;
+        std::vector<Event> events;
+        size_t written = 0;
+    };
+    
+    struct State
+    {
+        std::atomic<bool> enabled { false };
+        Clock::time_point origin;
+        
+        // Rings of all threads that recorded events (deque does not move them when growing)
+        std::mutex mutex;
+        std::deque<Ring> rings;
+    };
+    
+    static State& state()
+    {
+        static State s;
+        return s;
+    }
+    
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - state().origin).count();
+    }
+    
+    // Returns the ring of the current thread (created on the first event)
+    static Ring& ring()
+    {
+        thread_local Ring* r = nullptr;
+        
+        if (r == nullptr)
+        {
+            auto lock = std::lock_guard<std::mutex>(state().mutex);
+            state().rings.emplace_back();
+            r = &state().rings.back();
+            r->events.resize(CAPACITY);
+        }
+        
+        return *r;
+    }
+    
+    static void add(const Event& e)
+    {
+        Ring& r = ring();
+        r.events[r.written % CAPACITY] = e;
+        r.written++;
+    }
+};
\ No newline at end of file
@@ -0,0 +1,223 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+#include <map>
+#include <string>
+#include <random>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include "ChaCha20/ChaCha20.h"
+#include "ChaCha20/State.h"
+
+// Sampled verification of the OTP blocks produced by FpgaCha cores
+// Before a part of a job is passed to the cryptor, a thread of its worker recomputes a random
+// share of its blocks with the software kernel and compares them with what the core wrote,
+// so DMA and cache maintenance bugs do not corrupt the ciphertext silently
+// The share bounds the overhead: it is the part of the software kernel's work that is done
+class Verify
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+    
+    // Starts verification and prints the report when destroyed (nothing if <share> is 0)
+    // Must outlive the workers
+    class Session
+    {
+    private:
+        const double share;
+    
+    public:
+        // share - share of the blocks recomputed in software (0 to 1)
+        Session(double share) : share(share)
+        {
+            if (share > 0) start(share);
+        }
+        
+        ~Session()
+        {
+            if (share > 0) report(std::cout);
+        }
+    };
+    
+    // Verification results of one core
+    // (tasks are counted by the caller, which may check a task in parts)
+    struct Stats
+    {
+        uint64_t tasks = 0;
+        uint64_t blocks = 0;
+        uint64_t checked = 0;
+        uint64_t mismatches = 0;
+        
+        // Time spent recomputing blocks
+        Clock::duration time = Clock::duration::zero();
+        
+        // The core produced a wrong block and its jobs were recomputed in software
+        bool quarantined = false;
+    };
+    
+    // Checks the jobs of one core (owned by one thread, a core may have several)
+    class Checker
+    {
+    private:
+        ChaCha20::ChaCha20 kernel;
+        std::minstd_rand random;
+        std::uniform_real_distribution<double> uniform { 0, 1 };
+        
+        // Computes block <s> the way the core does (with or without the summation stage)
+        void compute(const ChaCha20::State& s, bool summation)
+        {
+            if (summation) kernel.compute(s);
+            else kernel.computeRounds(s);
+        }
+    
+    public:
+        // Name of the core in the report
+        const std::string name;
+        
+        Stats stats;
+        
+        Checker(const std::string& name) : random(std::random_device()()), name(name) { }
+        
+        // Recomputes a random sample of <blocks> blocks in <buffer> that start from <state>
+        // and compares them (summation - the blocks contain the summation stage)
+        // Returns false if a block differs
+        bool check(const uint32_t* buffer, size_t blocks, const ChaCha20::State& state, bool summation)
+        {
+            const auto start = Clock::now();
+            
+            // Rounding at random keeps the expected share exact for short jobs
+            const size_t count = blocks == 0 ? 0 : (size_t)(share() * blocks + uniform(random));
+            std::uniform_int_distribution<size_t> pick(0, blocks - 1);
+            ChaCha20::State s = state;
+            bool correct = true;
+            size_t checked = 0;
+            
+            for(; checked < count && correct; checked++)
+            {
+                const size_t b = pick(random);
+                s.bCount[0] = state.bCount[0] + b;
+                compute(s, summation);
+                
+                const uint32_t* block = buffer + b * ChaCha20::State::WORD_SIZE;
+                for(int i = 0; i < ChaCha20::State::WORD_SIZE; i++)
+                {
+                    if (block[i] != kernel.state[i]) correct = false;
+                }
+            }
+            
+            stats.blocks += blocks;
+            stats.checked += checked;
+            if (!correct) stats.mismatches++;
+            stats.time += Clock::now() - start;
+            
+            return correct;
+        }
+        
+        // Computes <blocks> blocks that start from <state> into <buffer> in software
+        // (used instead of the core once it is quarantined)
+        void recompute(uint32_t* buffer, size_t blocks, const ChaCha20::State& state, bool summation)
+        {
+            ChaCha20::State s = state;
+            
+            for(size_t b = 0; b < blocks; b++)
+            {
+                compute(s, summation);
+                
+                for(int i = 0; i < ChaCha20::State::WORD_SIZE; i++)
+                {
+                    buffer[b * ChaCha20::State::WORD_SIZE + i] = kernel.state[i];
+                }
+                
+                s.bCount[0]++;
+            }
+        }
+    };
+    
+    // Share of the blocks recomputed in software (0 - verification is off)
+    static double share()
+    {
+        return state().share;
+    }
+    
+    // Starts verifying <share> of the blocks (must be called before the workers are started)
+    static void start(double share)
+    {
+        state().share = share;
+        state().started = Clock::now();
+    }
+    
+    // Adds the results of <checker> (called when its worker stops)
+    static void add(const Checker& checker)
+    {
+        auto lock = std::lock_guard<std::mutex>(state().mutex);
+        Stats& s = state().cores[checker.name];
+        
+        s.tasks += checker.stats.tasks;
+        s.blocks += checker.stats.blocks;
+        s.checked += checker.stats.checked;
+        s.mismatches += checker.stats.mismatches;
+        s.time += checker.stats.time;
+        s.quarantined = s.quarantined || checker.stats.quarantined;
+    }
+    
+    // Prints the results of every core
+    // The overhead is the time spent recomputing blocks per run time (of one CPU)
+    static void report(std::ostream& o)
+    {
+        auto lock = std::lock_guard<std::mutex>(state().mutex);
+        const double run = std::chrono::duration<double>(Clock::now() - state().started).count();
+        
+        o << "Verification of " << std::fixed << std::setprecision(2) << 100 * state().share << "% of the blocks" << std::endl;
+        o << std::left << std::setw(16) << "core" << std::right << std::setw(8) << "tasks" << std::setw(12) << "blocks";
+        o << std::setw(12) << "checked" << std::setw(12) << "mismatches" << std::setw(10) << "CPU ms";
+        o << std::setw(10) << "overhead" << std::setw(14) << "state" << std::endl;
+        
+        for(auto& p : state().cores)
+        {
+            const Stats& s = p.second;
+            const double time = std::chrono::duration<double>(s.time).count();
+            
+            o << std::left << std::setw(16) << p.first << std::right << std::setw(8) << s.tasks;
+            o << std::setw(12) << s.blocks << std::setw(12) << s.checked << std::setw(12) << s.mismatches;
+            o << std::setw(10) << std::setprecision(1) << time * 1e3;
+            o << std::setw(9) << std::setprecision(2) << (run > 0 ? 100 * time / run : 0) << "%";
+            o << std::setw(14) << (s.quarantined ? "quarantined" : "ok") << std::endl;
+        }
+    }
+
+private:
+    struct State
+    {
+        double share = 0;
+        Clock::time_point started;
+        
+        // Results of the cores by name
+        std::mutex mutex;
+        std::map<std::string, Stats> cores;
+    };
+    
+    static State& state()
+    {
+        static State s;
+        return s;
+    }
+};
\ No newline at end of file
@@ -0,0 +1,563 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+// Runs every combination of workers, cryptors, number of tasks and task size,
+// writes throughput, task latency and CPU utilization as JSON and compares
+// the throughput with a baseline (a JSON file of a previous run)
+// Usage: benchmark [--emu] [--bytes n] [--repeats n] [--file name] [--out name] [--baseline name] [--tolerance percent]
+//   --emu - use emulated FpgaCha cores and DMA memory
+//   --bytes - bytes of one-time pad per run (64 MiB by default)
+//   --repeats - runs of every combination, the median one is reported (3 by default)
+//   --file - input file created for FileCryptor runs (benchmark.in by default)
+//   --out - JSON file to write (benchmark.json by default)
+//   --baseline - JSON file to compare with
+//   --tolerance - throughput drop in percent that counts as a regression (5 by default)
+//     (a larger drop is tolerated if the repeats of either run differ more)
+// The output of every FileCryptor run (except with FakeWorker) is compared with
+// the output of a ChaCha20Worker run
+// Returns 2 if a regression was found, 3 if an output was wrong
+
+#include <sys/resource.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include "ChaCha20/State.h"
+#include "FpgaCha/FpgaCha.h"
+#include "FpgaCha/EmuFpgaCha.h"
+#include "TaskManager.h"
+#include "FakeCryptor.h"
+#include "FakeWorker.h"
+#include "FileMapper.h"
+#include "FileCryptor.h"
+#include "ChaCha20Worker.h"
+#include "FpgaChaWorker.h"
+#include "Autotuner.h"
+
+// Numbers of tasks and task sizes in bytes to measure
+const std::vector<uint32_t> taskCounts { 4, 8, 16 };
+const std::vector<size_t> taskSizes { 64 * 1024, 256 * 1024, 1024 * 1024 };
+
+// Encryption parameters of every run (the same as in chacha20.cpp)
+const ChaCha20::State state
+{
+    ChaCha20::DEFAULT_CONSTS,
+
+    // Key from an example in RFC8439 (see page 10)
+    ChaCha20::Key
+    {
+        0x03020100, 0x07060504, 0x0b0a0908, 0x0f0e0d0c,
+        0x13121110, 0x17161514, 0x1b1a1918, 0x1f1e1d1c
+    },
+
+    // Block count from an example in RFC8439 (see page 10)
+    ChaCha20::BCount{ 0x00000001 },
+
+    // Nonce from an example in RFC8439 (see page 10)
+    ChaCha20::Nonce{ 0x09000000, 0x4a000000, 0x00000000 }
+};
+
+// Worker mix of one run
+struct Workers
+{
+    std::string name;
+    uint32_t fake;
+    uint32_t cpu;
+    uint32_t fpga;
+};
+
+// Result of one run (throughput in MiB/s, latency in us, CPU in percent of one CPU)
+// spread - difference between the fastest and the slowest repeat in percent of the throughput
+struct Result
+{
+    std::string name;
+    std::string error;
+    double throughput = 0;
+    double spread = 0;
+    double p50 = 0;
+    double p90 = 0;
+    double p99 = 0;
+    double cpu = 0;
+    double baseline = 0;
+    bool regression = false;
+    bool wrong = false;
+};
+
+struct Options
+{
+    bool emu = false;
+    size_t bytes = 64 * 1024 * 1024;
+    uint32_t repeats = 3;
+    std::string file = "benchmark.in";
+    std::string out = "benchmark.json";
+    std::string baseline;
+    double tolerance = 5;
+};
+
+// CPU time consumed by the process in seconds
+double processTime()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+}
+
+// Runs the pipeline with cryptor K constructed from <args>
+// Returns the latencies of the tasks
+template <typename C, size_t N, template <size_t> class K, typename... A>
+std::vector<double> runWith(const Workers& w, size_t taskSize, A&... args)
+{
+    typedef TunedBoard<C> Board;
+    typename Board::Pool pool;
+    Board::addRegions(pool, N * taskSize * sizeof(uint32_t));
+
+    TaskManager<N> m(pool, taskSize);
+    m.collectLatencies();
+
+    {
+        K<N> cryptor(m, args...);
+        std::deque<FakeWorker<N>> fakeWorkers;
+        std::deque<ChaCha20Worker<N>> cpuWorkers;
+        std::deque<FpgaChaWorker<N, 1, C, typename Board::Pool>> fpgaWorkers;
+
+        try
+        {
+            for(uint32_t i = 0; i < w.fake; i++) fakeWorkers.emplace_back(m);
+            for(uint32_t i = 0; i < w.cpu; i++) cpuWorkers.emplace_back(m, state);
+            for(uint32_t i = 0; i < w.fpga; i++) fpgaWorkers.emplace_back(m, state, Board::core(i), pool);
+        }
+
+        // Let the cryptor and the started workers finish
+        catch (...)
+        {
+            m.shutdown();
+            throw;
+        }
+    }
+
+    return m.getLatencies();
+}
+
+template <typename C, template <size_t> class K, typename... A>
+std::vector<double> run(uint32_t tasks, const Workers& w, size_t taskSize, A&... args)
+{
+    switch(tasks)
+    {
+        case 4: return runWith<C, 4, K>(w, taskSize, args...);
+        case 8: return runWith<C, 8, K>(w, taskSize, args...);
+        case 16: return runWith<C, 16, K>(w, taskSize, args...);
+        default: throw std::runtime_error("Unsupported number of tasks: " + std::to_string(tasks));
+    }
+}
+
+// Creates the input file of FileCryptor runs (the same content every time)
+void createInput(const std::string& name, size_t bytes)
+{
+    std::ofstream file(name, std::ios::binary);
+    std::mt19937 random(2020);
+    std::vector<uint32_t> block(1024 * 1024);
+
+    for(size_t written = 0; written < bytes; written += block.size() * sizeof(uint32_t))
+    {
+        for(auto& word : block) word = random();
+        file.write((const char*)block.data(), std::min(bytes - written, block.size() * sizeof(uint32_t)));
+    }
+
+    if (!file) throw std::runtime_error("Error when writing to '" + name + "'");
+}
+
+// Tells whether files <a> and <b> have the same content
+bool sameContent(const std::string& a, const std::string& b)
+{
+    std::ifstream fileA(a, std::ios::binary);
+    std::ifstream fileB(b, std::ios::binary);
+    if (!fileA || !fileB) return false;
+
+    std::vector<char> blockA(1 << 20);
+    std::vector<char> blockB(1 << 20);
+
+    while(fileA && fileB)
+    {
+        fileA.read(blockA.data(), blockA.size());
+        fileB.read(blockB.data(), blockB.size());
+        if (fileA.gcount() != fileB.gcount()) return false;
+        if (!std::equal(blockA.begin(), blockA.begin() + fileA.gcount(), blockB.begin())) return false;
+    }
+
+    return !fileA && !fileB;
+}
+
+// Returns <s> as a quoted JSON string
+std::string quote(const std::string& s)
+{
+    std::ostringstream q;
+    q << '"';
+
+    for(char c : s)
+    {
+        if (c == '"' || c == '\\') q << '\\' << c;
+        else if ((unsigned char)c < 0x20) q << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec;
+        else q << c;
+    }
+
+    q << '"';
+    return q.str();
+}
+
+// Reads the JSON string that starts at <begin> of <line> (after the opening quote)
+// Only the escapes written by quote() are supported
+std::string unquote(const std::string& line, size_t begin)
+{
+    std::string s;
+
+    for(size_t i = begin; i < line.size() && line[i] != '"'; i++)
+    {
+        if (line[i] != '\\' || i + 1 >= line.size()) s += line[i];
+        else if (line[++i] != 'u') s += line[i];
+
+        else
+        {
+            s += (char)std::stoi(line.substr(i + 1, 4), nullptr, 16);
+            i += 4;
+        }
+    }
+
+    return s;
+}
+
+// Reads the throughput and its spread of every run from a JSON file written by this benchmark
+std::map<std::string, Result> loadBaseline(const std::string& name)
+{
+    std::ifstream file(name);
+    if (!file) throw std::runtime_error("Cannot open baseline '" + name + "'");
+
+    std::map<std::string, Result> baseline;
+    std::string line;
+
+    // Every run is written on its own line
+    while(getline(file, line))
+    {
+        const size_t n = line.find("\"name\": \"");
+        const size_t t = line.find("\"throughput\": ");
+        const size_t s = line.find("\"spread\": ");
+        if (n == std::string::npos || t == std::string::npos) continue;
+
+        Result& r = baseline[unquote(line, n + 9)];
+        r.throughput = std::stod(line.substr(t + 14));
+        if (s != std::string::npos) r.spread = std::stod(line.substr(s + 10));
+    }
+
+    return baseline;
+}
+
+// Returns the <p> percentile of sorted <values>
+double percentile(const std::vector<double>& values, double p)
+{
+    if (values.empty()) return 0;
+    return values[std::min(values.size() - 1, (size_t)(p * values.size()))];
+}
+
+// Runs workers <w> with cryptor <cryptor> ("fake" or "file") once
+// Throws if the pipeline cannot run
+template <typename C>
+Result measure(const Options& o, const Workers& w, const std::string& cryptor, uint32_t tasks, size_t taskSize)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    Result r;
+    std::vector<double> latencies;
+    const double cpuStart = processTime();
+    const auto start = Clock::now();
+
+    if (cryptor == "fake")
+    {
+        size_t length = o.bytes;
+        latencies = run<C, FakeCryptor>(tasks, w, taskSize, length);
+    }
+
+    else
+    {
+        FileMapper in(o.file);
+        FileMapper out(o.file + ".out", in.getSize());
+        latencies = run<C, FileCryptor>(tasks, w, taskSize, in, out);
+    }
+
+    const double wall = std::chrono::duration<double>(Clock::now() - start).count();
+    std::sort(latencies.begin(), latencies.end());
+
+    r.throughput = o.bytes / wall / (1 << 20);
+    r.p50 = percentile(latencies, 0.5);
+    r.p90 = percentile(latencies, 0.9);
+    r.p99 = percentile(latencies, 0.99);
+    r.cpu = 100 * (processTime() - cpuStart) / wall;
+
+    // FakeWorker does not compute the one-time pad
+    r.wrong = cryptor == "file" && w.fake == 0 && !sameContent(o.file + ".out", o.file + ".ref");
+    return r;
+}
+
+template <typename C>
+std::vector<Result> benchmark(const Options& o)
+{
+    typedef TunedBoard<C> Board;
+
+    const uint32_t cores = Board::cores();
+    const uint32_t cpus = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<Workers> workers { { "fake", 1, 0, 0 }, { "cpu1", 0, 1, 0 } };
+    if (cpus > 1) workers.push_back({ "cpu" + std::to_string(cpus), 0, cpus, 0 });
+
+    if (cores > 0)
+    {
+        workers.push_back({ "fpga" + std::to_string(cores), 0, 0, cores });
+        workers.push_back({ "fpga" + std::to_string(cores) + "+cpu1", 0, 1, cores });
+    }
+
+    std::cout << "Board '" << Autotuner<C>::board() << "': " << cores << " FpgaCha core(s), " << cpus << " CPU(s)" << std::endl;
+    std::cout << std::left << std::setw(36) << "run" << std::right;
+    std::cout << std::setw(10) << "MiB/s" << std::setw(10) << "p50, us" << std::setw(10) << "p90, us";
+    std::cout << std::setw(10) << "p99, us" << std::setw(8) << "CPU" << std::setw(11) << "spread" << std::endl;
+
+    createInput(o.file, o.bytes);
+
+    // Reference output of FileCryptor runs
+    {
+        FileMapper in(o.file);
+        FileMapper out(o.file + ".ref", in.getSize());
+        run<C, FileCryptor>(8, Workers{ "reference", 0, 1, 0 }, 64 * 1024, in, out);
+    }
+
+    // Combinations to run
+    struct Point
+    {
+        std::string name;
+        Workers workers;
+        std::string cryptor;
+        uint32_t tasks;
+        size_t bytes;
+    };
+
+    std::vector<Point> points;
+
+    for(auto& w : workers)
+    {
+        for(auto cryptor : { "fake", "file" })
+        {
+            for(auto tasks : taskCounts)
+            {
+                for(auto bytes : taskSizes)
+                {
+                    const std::string name = w.name + "/" + cryptor + "/" + std::to_string(tasks) + "x" + std::to_string(bytes / 1024) + "KiB";
+                    points.push_back({ name, w, cryptor, tasks, bytes });
+                }
+            }
+        }
+    }
+
+    // Every pass runs all combinations once, so a slow period of the board
+    // affects one repeat of many combinations instead of all repeats of a few
+    std::vector<std::vector<Result>> repeats(points.size());
+    std::vector<std::string> errors(points.size());
+
+    for(uint32_t pass = 0; pass < o.repeats; pass++)
+    {
+        for(size_t i = 0; i < points.size(); i++)
+        {
+            const Point& p = points[i];
+            if (!errors[i].empty()) continue;
+
+            try
+            {
+                repeats[i].push_back(measure<C>(o, p.workers, p.cryptor, p.tasks, p.bytes / sizeof(uint32_t)));
+            }
+
+            catch (std::runtime_error e)
+            {
+                errors[i] = e.what();
+            }
+        }
+    }
+
+    std::vector<Result> results;
+
+    for(size_t i = 0; i < points.size(); i++)
+    {
+        std::vector<Result>& runs = repeats[i];
+        Result r;
+
+        // Report the run with the median throughput
+        if (errors[i].empty())
+        {
+            std::sort(runs.begin(), runs.end(),
+                [](const Result& a, const Result& b) { return a.throughput < b.throughput; });
+            r = runs[runs.size() / 2];
+            r.spread = 100 * (runs.back().throughput - runs.front().throughput) / r.throughput;
+            for(auto& x : runs) r.wrong |= x.wrong;
+            if (r.wrong) r.error = "output differs from ChaCha20Worker";
+        }
+
+        else r.error = errors[i];
+
+        r.name = points[i].name;
+        results.push_back(r);
+
+        if (!r.error.empty())
+        {
+            std::cout << std::left << std::setw(36) << r.name << std::right << r.error << std::endl;
+            continue;
+        }
+
+        std::cout << std::left << std::setw(36) << r.name << std::right << std::fixed << std::setprecision(1);
+        std::cout << std::setw(10) << r.throughput << std::setw(10) << r.p50 << std::setw(10) << r.p90;
+        std::cout << std::setw(10) << r.p99 << std::setw(7) << r.cpu << "%" << std::setw(10) << r.spread << "%" << std::endl;
+    }
+
+    unlink(o.file.c_str());
+    unlink((o.file + ".out").c_str());
+    unlink((o.file + ".ref").c_str());
+
+    return results;
+}
+
+// Writes the results as JSON (one run per line)
+void save(const Options& o, const std::string& board, const std::vector<Result>& results)
+{
+    std::ofstream file(o.out);
+    file << std::fixed << std::setprecision(1);
+    file << "{" << std::endl;
+    file << "  \"board\": " << quote(board) << "," << std::endl;
+    file << "  \"bytes\": " << o.bytes << "," << std::endl;
+    file << "  \"runs\": [" << std::endl;
+
+    for(size_t i = 0; i < results.size(); i++)
+    {
+        const Result& r = results[i];
+        file << "    { \"name\": " << quote(r.name) << ", ";
+
+        if (!r.error.empty()) file << "\"error\": " << quote(r.error) << " }";
+
+        else
+        {
+            file << "\"throughput\": " << r.throughput << ", \"spread\": " << r.spread << ", \"p50\": " << r.p50 << ", \"p90\": " << r.p90;
+            file << ", \"p99\": " << r.p99 << ", \"cpu\": " << r.cpu;
+            if (r.baseline != 0) file << ", \"baseline\": " << r.baseline;
+            file << ", \"regression\": " << (r.regression ? "true" : "false") << " }";
+        }
+
+        file << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+
+    file << "  ]" << std::endl;
+    file << "}" << std::endl;
+
+    if (!file) throw std::runtime_error("Error when writing to '" + o.out + "'");
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        Options o;
+
+        // Parse input arguments
+        for(int i = 1; i < argc; i++)
+        {
+            const std::string a = argv[i];
+
+            if (a == "--emu")
+            {
+                o.emu = true;
+                continue;
+            }
+
+            if (i + 1 >= argc) throw std::runtime_error("no value for '" + a + "'");
+            const std::string v = argv[++i];
+
+            if (a == "--bytes") o.bytes = std::stoull(v);
+            else if (a == "--repeats") o.repeats = std::stoul(v);
+            else if (a == "--file") o.file = v;
+            else if (a == "--out") o.out = v;
+            else if (a == "--baseline") o.baseline = v;
+            else if (a == "--tolerance") o.tolerance = std::stod(v);
+            else throw std::runtime_error("unknown argument '" + a + "'");
+        }
+
+        if (o.bytes == 0) throw std::runtime_error("bytes must be positive");
+        if (o.repeats == 0) throw std::runtime_error("repeats must be positive");
+
+        std::map<std::string, Result> baseline;
+        if (!o.baseline.empty()) baseline = loadBaseline(o.baseline);
+
+        std::vector<Result> results;
+        std::string board;
+
+        if (o.emu)
+        {
+            results = benchmark<FpgaCha::EmuFpgaCha>(o);
+            board = Autotuner<FpgaCha::EmuFpgaCha>::board();
+        }
+
+        else
+        {
+            results = benchmark<FpgaCha::FpgaCha>(o);
+            board = Autotuner<FpgaCha::FpgaCha>::board();
+        }
+
+        // Flag runs that became slower than the baseline
+        size_t regressions = 0;
+        size_t wrong = 0;
+
+        for(auto& r : results)
+        {
+            if (r.wrong) wrong++;
+            if (!r.error.empty() || baseline.count(r.name) == 0) continue;
+            const Result& b = baseline[r.name];
+            r.baseline = b.throughput;
+            r.regression = r.throughput < r.baseline * (1 - std::max({ o.tolerance, r.spread, b.spread }) / 100);
+            if (!r.regression) continue;
+
+            std::cout << "Regression: " << r.name << " " << r.throughput << " MiB/s (baseline ";
+            std::cout << r.baseline << " MiB/s)" << std::endl;
+            regressions++;
+        }
+
+        save(o, board, results);
+        std::cout << "Results saved to '" << o.out << "'" << std::endl;
+
+        if (!o.baseline.empty()) std::cout << regressions << " regression(s) against '" << o.baseline << "'" << std::endl;
+        if (wrong > 0) std::cout << wrong << " run(s) with wrong output" << std::endl;
+        if (wrong > 0) return 3;
+        if (regressions > 0) return 2;
+    }
+
+    catch (std::runtime_error e)
+    {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+}
\ No newline at end of file
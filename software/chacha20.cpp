@@ -23,13 +23,23 @@
 #include "ChaCha20/Nonce.h"
 #include "ChaCha20/BCount.h"
 #include "FpgaCha/UDmaBuf.h"
+#include "FpgaCha/EmuDmaBuf.h"
+#include "FpgaCha/DmaPool.h"
 #include "TaskManager.h"
 #include "FakeCryptor.h"
 #include "FakeWorker.h"
 #include "ChaCha20Worker.h"
 #include "FpgaChaWorker.h"
+#include "FpgaChaReactor.h"
 #include "FileMapper.h"
 #include "FileCryptor.h"
+#include "Autotuner.h"
+#include "Trace.h"
+#include "Profile.h"
+#include "Metrics.h"
+#include "Verify.h"
+#include "Placement.h"
+#include "Budget.h"
 
 // Set encryption parameters
 ChaCha20::State state
@@ -53,14 +63,109 @@ ChaCha20::State state
 // Number of buffers (and tasks)
 const uint32_t N = 8;
 
-// Total buffer size in words
-// Must be less or equal to uDmaBuf.size
-const size_t buffSize = N*1024*256;
+// Buffer size of one task in words
+// N buffers must fit into the regions of the DMA pool, and N more if the tasks
+// of an FpgaCha core that hangs and cannot be stopped have to be moved
+const size_t taskSize = 1024*256;
+
+// FpgaCha cores for the autotuner and for tuned runs
+typedef Autotuner<FpgaCha::FpgaCha> Tuner;
+//typedef Autotuner<FpgaCha::EmuFpgaCha> Tuner;
 
 int main(int argc, char* argv[])
 {
     try
     {   
+        // Find the best configuration for this board (optionally by encrypting a file)
+        if (argc > 1 && std::string(argv[1]) == "--autotune")
+        {
+            Tuner::tune(state, argc > 2 ? argv[2] : "");
+            return 0;
+        }
+        
+        // Options before the file names (e.g. chacha20 --trace trace.json --profile in out)
+        //   --trace <file> - record the timeline of the pipeline (written when the workers are finished)
+        //   --profile - print performance counters of the CPU per pipeline stage at the end
+        //   --metrics <file> - print statistics every second and keep a snapshot of them in the file
+        //   --verify <share> - recompute this share of the blocks of FpgaCha cores in software (e.g. 0.01)
+        //   --pin <role>=<cpus> - run the threads of a role on these CPUs (e.g. --pin control=1 --pin cryptor=0)
+        //   --rt <priority> - run FpgaCha control threads under SCHED_FIFO and lock the task buffers in memory
+        //   --jitter - print the resubmission latencies of FpgaCha control threads (also done with --pin and --rt)
+        //   --budget <MiB/s> - limit the DRAM traffic of the pipeline (e.g. 100) and print the achieved bandwidth
+        //   --no-tune - use the configuration below even if the autotuner saved one for this board
+        std::string traceFile;
+        std::string metricsFile;
+        bool profile = false;
+        double verifyShare = 0;
+        bool placement = false;
+        double budget = 0;
+        bool tune = true;
+        
+        for(; argc > 1 && std::string(argv[1]).compare(0, 2, "--") == 0; argv++, argc--)
+        {
+            const std::string option = argv[1];
+            
+            if (option == "--profile") profile = true;
+            
+            else if (option == "--trace" && argc > 2)
+            {
+                traceFile = argv[2];
+                argv++;
+                argc--;
+            }
+            
+            else if (option == "--metrics" && argc > 2)
+            {
+                metricsFile = argv[2];
+                argv++;
+                argc--;
+            }
+            
+            else if (option == "--jitter") placement = true;
+            
+            else if (option == "--no-tune") tune = false;
+            
+            else if (option == "--pin" && argc > 2)
+            {
+                Placement::pin(argv[2]);
+                placement = true;
+                argv++;
+                argc--;
+            }
+            
+            else if (option == "--rt" && argc > 2)
+            {
+                Placement::setRealtime(std::stoi(argv[2]));
+                placement = true;
+                argv++;
+                argc--;
+            }
+            
+            else if (option == "--verify" && argc > 2)
+            {
+                verifyShare = std::stod(argv[2]);
+                if (verifyShare < 0 || verifyShare > 1) throw std::runtime_error("share of verified blocks must be 0 to 1");
+                argv++;
+                argc--;
+            }
+            
+            else if (option == "--budget" && argc > 2)
+            {
+                budget = std::stod(argv[2]);
+                if (budget <= 0) throw std::runtime_error("DRAM bandwidth budget must be positive");
+                argv++;
+                argc--;
+            }
+            
+            else throw std::runtime_error("unknown option '" + option + "'");
+        }
+        
+        Trace::Session trace(traceFile);
+        Metrics::Session metrics(metricsFile);
+        Verify::Session verify(verifyShare);
+        Placement::Session placing(placement);
+        Budget::Session budgeting(budget);
+        
         // Validate input arguments
         if (argc < 3) throw std::runtime_error("too few arguments passed");
         
@@ -68,11 +173,45 @@ int main(int argc, char* argv[])
         FileMapper inFile(argv[1]);
         FileMapper outFile(argv[2], inFile.getSize());
         
-        // Initialize buffer for DMA
-        FpgaCha::UDmaBuf uDmaBuf("udmabuf0");
+        // Profile every stage of the threads created below
+        Profile::Session profiling(profile, inFile.getSize());
+        
+        // Use the configuration found by the autotuner if this board was tuned
+        // Otherwise (or with --no-tune) use the configuration below
+        TunedConfig tuned;
+        if (tune && Tuner::load(tuned))
+        {
+            std::cout << "Tuned configuration of '" << Tuner::board() << "' from '" << Tuner::fileName() << "': ";
+            std::cout << tuned.str() << " (--no-tune to use the one in chacha20.cpp)" << std::endl;
+            Tuner::run<FileCryptor>(tuned, state, inFile, outFile);
+            return 0;
+        }
+        
+        std::cout << "Configuration in chacha20.cpp" << (tune ? " (the board is not tuned)" : "") << std::endl;
+        
+        // Initialize buffers for DMA (add udmabuf devices for more or bigger tasks)
+        // (use the emulated ones together with emulated FpgaCha cores or CPU-only workers)
+        FpgaCha::UDmaPool uDmaBuf;
+        uDmaBuf.add("udmabuf0");
+        //uDmaBuf.add("udmabuf1");
+        //FpgaCha::EmuDmaPool uDmaBuf;
+        //uDmaBuf.add("emudmabuf0", 2 * N * taskSize * sizeof(uint32_t));
+        
+        // Uncomment to encrypt a second file with the same workers (chacha20 in out in2 out2)
+        // The interactive stream gets 16 times the share of the bulk one, which has at most
+        // 2 tasks given to workers, so the job queues of the cores stay short for the other
+        // (the DMA buffers should hold 2 * N tasks, and the second file is encrypted
+        // from block TaskScheduler<N>::STREAM_BLOCKS on)
+        //TaskScheduler<N> scheduler;
         
         // Task manager to coordinate cryptor and workers
-        TaskManager<N> m(uDmaBuf.content, buffSize);
+        TaskManager<N> m(uDmaBuf, taskSize);
+        //m.attach(scheduler, 0, TaskScheduler<N>::BULK, 2);
+        //TaskManager<N> m2(uDmaBuf, taskSize);
+        //m2.attach(scheduler, 1, TaskScheduler<N>::INTERACTIVE);
+        //FileMapper inFile2(argv[3]);
+        //FileMapper outFile2(argv[4], inFile2.getSize());
+        //FileCryptor<N> fc2(m2, inFile2, outFile2);
 
         // Choose one of the cryptors
         FileCryptor<N> fc(m, inFile, outFile);
@@ -82,10 +221,16 @@ int main(int argc, char* argv[])
         //FakeWorker<N> fw(m);
         //ChaCha20Worker<N> ccw0(m, state);
         //ChaCha20Worker<N> ccw1(m, state);
+        //ChaCha20Worker<N> cdw0(m, state, inFile, outFile);
+        //ChaCha20Worker<N> cdw1(m, state, inFile, outFile);
         FpgaChaWorker<N, 1> fcw0(m, state, "uio0", uDmaBuf);
         FpgaChaWorker<N, 1> fcw1(m, state, "uio1", uDmaBuf);
         //FpgaChaWorker<N, 1> fcw2(m, state, "uio2", uDmaBuf);
         //FpgaChaWorker<N, 1> fcw3(m, state, "uio3", uDmaBuf);
+        //FpgaChaWorker<N, 1, FpgaCha::EmuFpgaCha, FpgaCha::EmuDmaPool> ecw0(m, state, "emu0", uDmaBuf);
+        //FpgaChaWorker<N, 1, FpgaCha::EmuFpgaCha, FpgaCha::EmuDmaPool> ecw1(m, state, "emu1", uDmaBuf);
+        //FpgaChaReactor<N, 1> fcr(m, state, {"uio0", "uio1", "uio2", "uio3"}, uDmaBuf);
+        //FpgaChaReactor<N, 1, FpgaCha::EmuFpgaCha, FpgaCha::EmuDmaPool> ecr(m, state, {"emu0", "emu1"}, uDmaBuf);
     }
     
     catch (std::runtime_error e)
@@ -0,0 +1,145 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+// Measures the latency and the CPU cost of one job of FpgaCha core
+// with interrupt based and polling based completion
+// Usage: latency <device> [blocks] [jobs]
+//   device - UIO device of FpgaCha core (e.g. uio0) or "emu" for an emulated core
+//   blocks - OTP blocks per job
+//   jobs - jobs per measurement
+
+#include <time.h>
+#include <stdint.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include "ChaCha20/State.h"
+#include "FpgaCha/FpgaCha.h"
+#include "FpgaCha/UDmaBuf.h"
+#include "FpgaCha/EmuFpgaCha.h"
+#include "FpgaCha/EmuDmaBuf.h"
+
+// Polling times to compare (0 - interrupts only)
+const std::vector<std::chrono::microseconds> spins
+{
+    std::chrono::microseconds(0),
+    std::chrono::microseconds(10),
+    std::chrono::microseconds(50),
+    std::chrono::microseconds(200),
+    std::chrono::microseconds(1000)
+};
+
+// CPU time consumed by the calling thread in seconds
+double threadTime()
+{
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Runs <jobs> jobs one by one for every polling time and prints the results
+// C - interface to the core (FpgaCha::FpgaCha or FpgaCha::EmuFpgaCha)
+// B - DMA buffer type (FpgaCha::UDmaBuf or FpgaCha::EmuDmaBuf)
+template <typename C, typename B>
+void measure(const std::string& device, const B& buffer, uint32_t blocks, uint32_t jobs)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    if (blocks * ChaCha20::State::WORD_SIZE > buffer.size)
+        throw std::runtime_error("the job does not fit into the DMA buffer");
+
+    ChaCha20::State state;
+    const uint32_t physical = buffer.toPhysical(buffer.content);
+
+    std::cout << std::left << std::setw(12) << "spin, us";
+    std::cout << std::right << std::setw(12) << "mean, us";
+    std::cout << std::setw(12) << "p50, us";
+    std::cout << std::setw(12) << "p99, us";
+    std::cout << std::setw(14) << "CPU/job, us";
+    std::cout << std::setw(8) << "CPU" << std::endl;
+
+    for(auto spin : spins)
+    {
+        C core(device);
+        core.setState(state);
+        core.setCoalesce(1);
+        core.setPolling(spin);
+
+        std::vector<double> latency;
+        const double cpuStart = threadTime();
+        const auto start = Clock::now();
+
+        for(uint32_t i = 0; i < jobs; i++)
+        {
+            const auto submitted = Clock::now();
+            core.submit(physical, i * blocks, blocks);
+            core.wait();
+            latency.push_back(std::chrono::duration<double, std::micro>(Clock::now() - submitted).count());
+        }
+
+        const double wall = std::chrono::duration<double>(Clock::now() - start).count();
+        const double cpu = threadTime() - cpuStart;
+        std::sort(latency.begin(), latency.end());
+
+        double mean = 0;
+        for(auto l : latency) mean += l / jobs;
+
+        std::cout << std::left << std::setw(12) << spin.count() << std::right << std::fixed;
+        std::cout << std::setw(12) << std::setprecision(1) << mean;
+        std::cout << std::setw(12) << latency[jobs / 2];
+        std::cout << std::setw(12) << latency[jobs * 99 / 100];
+        std::cout << std::setw(14) << cpu * 1e6 / jobs;
+        std::cout << std::setw(7) << 100 * cpu / wall << "%" << std::endl;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        // Validate input arguments
+        if (argc < 2) throw std::runtime_error("too few arguments passed");
+
+        const std::string device = argv[1];
+        const uint32_t blocks = argc > 2 ? std::stoul(argv[2]) : 16;
+        const uint32_t jobs = argc > 3 ? std::stoul(argv[3]) : 1000;
+
+        if (blocks == 0 || jobs == 0) throw std::runtime_error("blocks and jobs must be positive");
+
+        if (device == "emu")
+        {
+            FpgaCha::EmuDmaBuf buffer("emudmabuf0", blocks * ChaCha20::State::BYTE_SIZE);
+            measure<FpgaCha::EmuFpgaCha>("emu0", buffer, blocks, jobs);
+        }
+
+        else
+        {
+            FpgaCha::UDmaBuf buffer("udmabuf0");
+            measure<FpgaCha::FpgaCha>(device, buffer, blocks, jobs);
+        }
+    }
+
+    catch (std::runtime_error e)
+    {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+}
\ No newline at end of file
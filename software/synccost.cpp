@@ -0,0 +1,104 @@
+/*******************************************************************************
+ * Copyright 2020 Igor Semenov (goshik92@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *******************************************************************************/
+
+// Measures the cache maintenance overhead per task (one sync for DMA and
+// one sync for CPU) with the sysfs files of udmabuf kept open by UDmaBuf
+// and with the sysfs file opened on every sync
+// Usage: synccost [device] [tasks]
+//   device - udmabuf device (udmabuf0 by default)
+//   tasks - syncs per measurement
+
+#include <stdint.h>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <stdexcept>
+#include "FpgaCha/UDmaBuf.h"
+
+// Task sizes to measure in bytes
+const std::vector<size_t> sizes { 4096, 64 * 1024, 256 * 1024, 1024 * 1024 };
+
+// Syncs the way UDmaBuf did before it kept the sysfs files open
+void syncPerCall(const FpgaCha::LinuxDevice& device, const std::string& property,
+    uint32_t offset, uint32_t size, int direction)
+{
+    std::stringstream sstream;
+    sstream << "0x" << std::hex;
+    sstream << std::setw(8) << std::setfill('0') << offset;
+    sstream << std::setw(8) << std::setfill('0');
+    sstream << ((size & 0xFFFFFFF0) | (direction << 2) | 1);
+
+    device.writeProperty(property, sstream.str());
+}
+
+// Returns the average time of <f> in microseconds
+template <typename F>
+double measure(uint32_t tasks, F f)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const auto start = Clock::now();
+    for(uint32_t i = 0; i < tasks; i++) f();
+    return std::chrono::duration<double, std::micro>(Clock::now() - start).count() / tasks;
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        const std::string name = argc > 1 ? argv[1] : "udmabuf0";
+        const uint32_t tasks = argc > 2 ? std::stoul(argv[2]) : 1000;
+
+        FpgaCha::UDmaBuf buffer(name);
+        const FpgaCha::LinuxDevice device(name, "udmabuf", "size", false);
+
+        std::cout << std::left << std::setw(12) << "task, KiB";
+        std::cout << std::right << std::setw(16) << "kept open, us";
+        std::cout << std::setw(16) << "per call, us" << std::endl;
+
+        for(auto bytes : sizes)
+        {
+            if (bytes > buffer.size * sizeof(uint32_t)) break;
+            const size_t length = bytes / sizeof(uint32_t);
+
+            const double fast = measure(tasks, [&]
+            {
+                buffer.syncForDma(buffer.content, length);
+                buffer.syncForCpu(buffer.content, length);
+            });
+
+            const double slow = measure(tasks, [&]
+            {
+                syncPerCall(device, "sync_for_device", 0, bytes, 2);
+                syncPerCall(device, "sync_for_cpu", 0, bytes, 1);
+            });
+
+            std::cout << std::left << std::setw(12) << bytes / 1024 << std::right << std::fixed;
+            std::cout << std::setw(16) << std::setprecision(1) << fast;
+            std::cout << std::setw(16) << slow << std::endl;
+        }
+    }
+
+    catch (std::runtime_error e)
+    {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+}
\ No newline at end of file